@@ -0,0 +1,64 @@
+#include "arena.h"
+
+#include <stdlib.h>
+
+static ArenaBlock *new_block(ArenaBlock *next, size_t size) {
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (block != NULL) {
+        block->next = next;
+        block->size = size;
+        block->used = 0;
+    }
+    return block;
+}
+
+void arena_init(Arena *arena) {
+    arena->block = NULL;
+}
+
+char *arena_reserve(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->block;
+    if (block == NULL || block->size - block->used < size) {                        // Chain a block twice as large, the old ones stay valid
+        size_t block_size = block != NULL ? block->size * 2 : ARENA_BLOCK_SIZE;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        block = new_block(block, block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        arena->block = block;
+    }
+    return block->data + block->used;
+}
+
+void arena_commit(Arena *arena, size_t size) {
+    arena->block->used += size;
+}
+
+void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->block;
+    if (block == NULL) {
+        return;
+    }
+    if (block->next != NULL) {                                                      // Merge the blocks of the last command
+        size_t size = 0;
+        while (block != NULL) {
+            ArenaBlock *next = block->next;
+            size += block->size;
+            free(block);
+            block = next;
+        }
+        arena->block = new_block(NULL, size);                                       // NULL if out of memory: the next reserve retries
+        return;
+    }
+    block->used = 0;
+}
+
+void arena_free(Arena *arena) {
+    while (arena->block != NULL) {
+        ArenaBlock *next = arena->block->next;
+        free(arena->block);
+        arena->block = next;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef KVS_ARENA_H
+#define KVS_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (16 * 1024)                                                // Bytes of an arena's first block
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;                                                        // Block filled before this one
+    size_t size;                                                                    // Bytes of data
+    size_t used;                                                                    // Bytes handed out
+    char data[];
+} ArenaBlock;
+
+// Bump allocator of the strings of one command. Each string costs a pointer increment,
+// and all of them are dropped at once by arena_reset before the next command. When a
+// command needed several blocks, the reset merges them into one block as large as all
+// of them, so the arena settles on the size of its largest command and stops calling
+// malloc. Used by one thread at a time.
+typedef struct Arena {
+    ArenaBlock *block;                                                              // Current block, the older ones chained from it
+} Arena;
+
+/// Starts an empty arena (no block is allocated until the first string).
+/// @param arena Arena to initialize.
+void arena_init(Arena *arena);
+
+/// Makes room for up to size bytes without taking them, so that a string of unknown
+/// length can be read in place and then kept with arena_commit.
+/// @param arena Arena to allocate from.
+/// @param size Most bytes the string may take, NUL included.
+/// @return Where the string goes, NULL if out of memory.
+char *arena_reserve(Arena *arena, size_t size);
+
+/// Takes the first bytes of the room given by the last arena_reserve.
+/// @param arena Arena allocated from.
+/// @param size Bytes taken, at most the size reserved.
+void arena_commit(Arena *arena, size_t size);
+
+/// Drops every string of the arena, keeping its memory for the next command.
+/// @param arena Arena to reset.
+void arena_reset(Arena *arena);
+
+/// Frees the memory of the arena.
+/// @param arena Arena to free.
+void arena_free(Arena *arena);
+
+#endif  // KVS_ARENA_H
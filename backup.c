@@ -0,0 +1,250 @@
+#include "backup.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "outbuf.h"
+#include "snapfile.h"
+
+typedef struct BackupRequest {
+    int snapshot;                                                                   // Taken when the backup was submitted
+    BackupGroup *group;
+    char path[MAX_JOB_FILE_NAME_SIZE];
+} BackupRequest;
+
+static HashTable *backup_table = NULL;
+static enum BackupFormat backup_format = BACKUP_TEXT;
+static int backup_threads = 1;                                                      // Threads serializing each backup
+static pthread_t *workers = NULL;
+static int num_workers = 0;
+
+static BackupRequest queue[BACKUP_QUEUE_SIZE];                                      // Ring buffer, guarded by queue_mutex
+static size_t queue_head = 0;
+static size_t queue_count = 0;
+static int stopping = 0;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+// Writes a pair in the "(key, value)" format used by SHOW.
+static void write_backup_pair(const char *key, const char *value, void *arg) {
+    OutBuf *out = arg;
+    outbuf_write(out, "(", 1);
+    outbuf_puts(out, key);
+    outbuf_write(out, ", ", 2);
+    outbuf_puts(out, value);
+    outbuf_write(out, ")\n", 2);
+}
+
+// Text of one key range of a backup, built in memory.
+typedef struct TextSegment {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} TextSegment;
+
+// Appends a pair in the "(key, value)" format to a segment.
+static void append_backup_pair(const char *key, const char *value, void *arg) {
+    TextSegment *segment = arg;
+    size_t key_length = strlen(key);
+    size_t value_length = strlen(value);
+    size_t needed = segment->length + key_length + value_length + 5;
+    if (needed > segment->capacity) {
+        size_t capacity = segment->capacity > 0 ? segment->capacity * 2 : 64 * 1024;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *grown = realloc(segment->data, capacity);
+        if (grown == NULL) {
+            segment->failed = 1;
+            return;
+        }
+        segment->data = grown;
+        segment->capacity = capacity;
+    }
+    char *p = segment->data + segment->length;
+    *p++ = '(';
+    memcpy(p, key, key_length);
+    p += key_length;
+    *p++ = ',';
+    *p++ = ' ';
+    memcpy(p, value, value_length);
+    p += value_length;
+    *p++ = ')';
+    *p++ = '\n';
+    segment->length = needed;
+}
+
+static void skip_pair(const char *key, const char *value, void *arg) {
+    (void)key;
+    (void)value;
+    (void)arg;
+}
+
+// Writes a text backup from backup_threads threads, each formatting a key range into
+// its own segment, then writes the segments in key order. Returns 0 on success.
+static int write_text_ranges(int snapshot, int backup_fd) {
+    TextSegment segments[MAX_SNAPSHOT_THREADS] = { 0 };
+    void *args[MAX_SNAPSHOT_THREADS];
+    for (int i = 0; i < backup_threads; i++) {
+        args[i] = &segments[i];
+    }
+    int failed = snapshot_foreach_ranges(backup_table, snapshot, backup_threads, append_backup_pair, args);
+    for (int i = 0; i < backup_threads; i++) {
+        failed |= segments[i].failed;
+        if (!failed) {
+            failed = write_all(backup_fd, (const uint8_t *)segments[i].data, segments[i].length);
+        }
+        free(segments[i].data);
+    }
+    return failed;
+}
+
+// Writes a backup file. Returns 0 on success.
+static int write_backup(const BackupRequest *request) {
+    int backup_fd = open(request->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (backup_fd == -1) {
+        perror("Failed to create backup file");
+        snapshot_foreach(backup_table, request->snapshot, skip_pair, NULL);        // Still releases the snapshot
+        return 1;
+    }
+    int result;
+    if (backup_format != BACKUP_TEXT) {                                             // Deltas are binary too
+        result = snapfile_write(backup_table, request->snapshot, backup_fd, backup_threads);
+    } else if (backup_threads > 1) {
+        result = write_text_ranges(request->snapshot, backup_fd);
+    } else {
+        OutBuf *out = malloc(sizeof(OutBuf));
+        if (out == NULL) {
+            snapshot_foreach(backup_table, request->snapshot, skip_pair, NULL);
+            result = 1;
+        } else {
+            outbuf_init(out, backup_fd);
+            result = snapshot_foreach(backup_table, request->snapshot, write_backup_pair, out);
+            result |= outbuf_flush(out);
+            free(out);
+        }
+    }
+    if (result != 0) {
+        fprintf(stderr, "Failed to write backup to %s\n", request->path);
+    }
+    close(backup_fd);
+    return result;
+}
+
+static void *backup_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&queue_mutex);
+    for (;;) {
+        while (queue_count == 0 && !stopping) {
+            pthread_cond_wait(&queue_not_empty, &queue_mutex);
+        }
+        if (queue_count == 0) {                                                     // Stopping, and nothing left to write
+            break;
+        }
+        BackupRequest request = queue[queue_head];
+        queue_head = (queue_head + 1) % BACKUP_QUEUE_SIZE;
+        queue_count--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_mutex);
+
+        int failed = write_backup(&request);
+        if (request.group != NULL) {
+            pthread_mutex_lock(&request.group->mutex);
+            request.group->failed += failed;
+            if (--request.group->pending == 0) {
+                pthread_cond_broadcast(&request.group->done);
+            }
+            pthread_mutex_unlock(&request.group->mutex);
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return NULL;
+}
+
+int backup_start(HashTable *ht, int count, enum BackupFormat format, int threads) {
+    workers = malloc((size_t)count * sizeof(pthread_t));
+    if (workers == NULL) {
+        return 1;
+    }
+    backup_table = ht;
+    backup_format = format;
+    backup_threads = threads;
+    stopping = 0;
+    for (num_workers = 0; num_workers < count; num_workers++) {
+        if (pthread_create(&workers[num_workers], NULL, backup_worker, NULL) != 0) {
+            backup_stop();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void backup_stop(void) {
+    pthread_mutex_lock(&queue_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+    backup_table = NULL;
+}
+
+int backup_submit(const char *path, BackupGroup *group) {
+    if (strlen(path) >= MAX_JOB_FILE_NAME_SIZE) {
+        return 1;
+    }
+    if (group != NULL) {
+        pthread_mutex_lock(&group->mutex);
+        group->pending++;
+        pthread_mutex_unlock(&group->mutex);
+    }
+
+    int snapshot = backup_format == BACKUP_DELTA && group != NULL                    // Fixes the contents of the backup
+                   ? snapshot_begin_delta(backup_table, &group->base)
+                   : snapshot_begin(backup_table);
+    pthread_mutex_lock(&queue_mutex);                                               // Not held above: workers free snapshot slots
+    while (queue_count == BACKUP_QUEUE_SIZE) {                                      // Backpressure on the job thread
+        pthread_cond_wait(&queue_not_full, &queue_mutex);
+    }
+    BackupRequest *request = &queue[(queue_head + queue_count) % BACKUP_QUEUE_SIZE];
+    request->snapshot = snapshot;
+    request->group = group;
+    strcpy(request->path, path);
+    queue_count++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+void backup_group_init(BackupGroup *group) {
+    group->pending = 0;
+    group->failed = 0;
+    memset(&group->base, 0, sizeof(group->base));
+    pthread_mutex_init(&group->mutex, NULL);
+    pthread_cond_init(&group->done, NULL);
+}
+
+int backup_group_finish(BackupGroup *group) {
+    pthread_mutex_lock(&group->mutex);
+    while (group->pending > 0) {
+        pthread_cond_wait(&group->done, &group->mutex);
+    }
+    int failed = group->failed;
+    pthread_mutex_unlock(&group->mutex);
+    delta_release(backup_table, &group->base);
+    pthread_mutex_destroy(&group->mutex);
+    pthread_cond_destroy(&group->done);
+    return failed;
+}
@@ -0,0 +1,60 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <pthread.h>
+#include "constants.h"
+#include "kvs.h"
+
+#define BACKUP_QUEUE_SIZE 8                                                         // Backups waiting for a worker before BACKUP blocks
+
+// Backups are written by a fixed pool of concurrent_backups worker threads, fed by a
+// bounded queue, so the limit holds for the whole server. A job thread only takes
+// the snapshot (which fixes what the backup contains) and queues it; the file is
+// written while the job goes on with its next commands. A large backup can itself be
+// serialized by several threads, each one a range of keys (see snapshot_foreach_ranges).
+
+// Format of the backup files.
+enum BackupFormat {
+    BACKUP_TEXT,                                                                    // "(key, value)" lines, like SHOW
+    BACKUP_BINARY,                                                                  // Binary snapshot (see snapfile.h), for --restore
+    BACKUP_DELTA                                                                    // Binary, only the changes since the job's previous backup
+};
+
+// Backups requested by one job, to know when all of them were written.
+typedef struct BackupGroup {
+    int pending;                                                                    // Queued or being written
+    int failed;                                                                     // Could not be written
+    DeltaBase base;                                                                 // Chain of the job's backups (BACKUP_DELTA)
+    pthread_mutex_t mutex;
+    pthread_cond_t done;                                                            // Signaled when pending drops to 0
+} BackupGroup;
+
+/// Starts the backup workers.
+/// @param ht Hash table the snapshots are taken from.
+/// @param workers Number of backups written at the same time.
+/// @param format Format of the backup files.
+/// @param threads Threads serializing each backup (1 to MAX_SNAPSHOT_THREADS).
+/// @return 0 if the workers were started successfully, 1 otherwise.
+int backup_start(HashTable *ht, int workers, enum BackupFormat format, int threads);
+
+/// Writes every queued backup, then stops the workers.
+void backup_stop(void);
+
+/// Takes a snapshot of the table and queues it to be written to a file.
+/// Blocks only while the queue is full.
+/// @param path File the backup is written to.
+/// @param group Group the backup is counted in (may be NULL).
+/// @return 0 if the backup was queued successfully, 1 otherwise.
+int backup_submit(const char *path, BackupGroup *group);
+
+/// Initializes an empty backup group.
+/// @param group Group to initialize.
+void backup_group_init(BackupGroup *group);
+
+/// Waits until every backup of a group was written, then destroys the group
+/// (and closes its delta chain).
+/// @param group Group to wait for.
+/// @return Number of backups of the group that failed.
+int backup_group_finish(BackupGroup *group);
+
+#endif  // KVS_BACKUP_H
@@ -0,0 +1,111 @@
+/**
+ * Job scaling benchmark. Writes a directory of synthetic jobs, then runs the server
+ * on it with 1, 2, 4, ... <max_threads> job threads and reports the wall time and
+ * the speedup of each. Every job writes and reads its own keys and waits wait_ms
+ * halfway through, so jobs running at the same time overlap even on one core.
+ * Usage: bench/job_bench [max_threads] [jobs] [lines_per_job] [wait_ms] [kvs_path]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAIRS_PER_LINE 16
+
+static double elapsed_seconds(struct timespec start, struct timespec end) {
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Writes job j: lines of WRITE then READ of its own keys, with a WAIT in the middle.
+static int write_job(const char *dir, int j, int lines, unsigned int wait_ms) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%03d.job", dir, j);
+    FILE *job = fopen(path, "w");
+    if (job == NULL) {
+        return 1;
+    }
+    for (int l = 0; l < lines; l++) {
+        if (l == lines / 2) {
+            fprintf(job, "WAIT %u\n", wait_ms);
+        }
+        fputs("WRITE [", job);
+        for (int p = 0; p < PAIRS_PER_LINE; p++) {
+            fprintf(job, "(j%dk%d,v%d)", j, (l * PAIRS_PER_LINE + p) % 4096, l);
+        }
+        fputs("]\nREAD [", job);
+        for (int p = 0; p < PAIRS_PER_LINE; p++) {
+            fprintf(job, p == 0 ? "j%dk%d" : ",j%dk%d", j, (l * PAIRS_PER_LINE + p) % 4096);
+        }
+        fputs("]\n", job);
+    }
+    return fclose(job) != 0;
+}
+
+// Runs the server on the jobs with a number of job threads. Returns the wall time, -1 on failure.
+static double run_server(const char *kvs, const char *dir, int threads) {
+    char threads_arg[16], fifo[300];
+    snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+    snprintf(fifo, sizeof(fifo), "%s/registration", dir);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(kvs, kvs, dir, "1", threads_arg, fifo, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return elapsed_seconds(start, end);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    int jobs = argc > 2 ? atoi(argv[2]) : 16;
+    int lines = argc > 3 ? atoi(argv[3]) : 2000;
+    unsigned int wait_ms = argc > 4 ? (unsigned int)atoi(argv[4]) : 100;
+    const char *kvs = argc > 5 ? argv[5] : "./kvs";
+    if (max_threads <= 0 || jobs <= 0 || lines <= 0) {
+        fprintf(stderr, "Usage: %s [max_threads] [jobs] [lines_per_job] [wait_ms] [kvs_path]\n", argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/job_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("Failed to create the job directory");
+        return 1;
+    }
+    for (int j = 0; j < jobs; j++) {
+        if (write_job(dir, j, lines, wait_ms) != 0) {
+            perror("Failed to write the jobs");
+            return 1;
+        }
+    }
+
+    printf("%d jobs of %d lines (%d pairs each), WAIT %u ms per job\n", jobs, lines, PAIRS_PER_LINE, wait_ms);
+    double base = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double seconds = run_server(kvs, dir, threads);
+        if (seconds < 0) {
+            fprintf(stderr, "%s failed with %d threads\n", kvs, threads);
+            break;
+        }
+        if (threads == 1) {
+            base = seconds;
+        }
+        printf("%3d threads %8.3f s %8.1f jobs/s  speedup %.2fx\n", threads, seconds, jobs / seconds, base / seconds);
+    }
+
+    char command[64];                                                               // The jobs, their .out files and the FIFO
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    return system(command) != 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * Parser benchmark. Writes a synthetic job file of WRITE commands with many pairs
+ * per line, then parses it with each delimiter scanner the CPU supports and reports
+ * the throughput of each.
+ * Usage: bench/parse_bench [pairs_per_line] [lines] [string_length]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "parser.h"
+#include "reader.h"
+
+#define ROUNDS 3                                                                    // Best of this many parses
+
+static double elapsed_seconds(struct timespec start, struct timespec end) {
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Writes lines of "WRITE [(key,value)...]" with keys and values of string_length characters.
+static int write_job(int fd, size_t pairs_per_line, size_t lines, size_t string_length) {
+    size_t pair_length = 2 * string_length + 3;
+    char *line = malloc(pairs_per_line * pair_length + 16);
+    if (line == NULL) {
+        return 1;
+    }
+    unsigned int seed = 1;
+    for (size_t l = 0; l < lines; l++) {
+        size_t length = (size_t)sprintf(line, "WRITE [");
+        for (size_t p = 0; p < pairs_per_line; p++) {
+            line[length++] = '(';
+            for (int field = 0; field < 2; field++) {
+                for (size_t c = 0; c < string_length; c++) {
+                    seed = seed * 1103515245 + 12345;
+                    line[length++] = (char)('a' + (seed >> 16) % 26);
+                }
+                line[length++] = field == 0 ? ',' : ')';
+            }
+        }
+        line[length++] = ']';
+        line[length++] = '\n';
+        if (write(fd, line, length) != (ssize_t)length) {
+            free(line);
+            return 1;
+        }
+    }
+    free(line);
+    return 0;
+}
+
+// Parses the whole file. Returns the number of pairs read.
+static size_t parse_job(const char *path, Reader *reader, CommandArgs *args) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    reader_init(reader, fd);
+    size_t pairs = 0;
+    enum Command command;
+    while ((command = parse_command(reader, args)) != EOC) {
+        if (command == CMD_WRITE) {
+            pairs += args->num_pairs;
+        }
+    }
+    close(fd);
+    return pairs;
+}
+
+int main(int argc, char *argv[]) {
+    size_t pairs_per_line = argc > 1 ? (size_t)atol(argv[1]) : 4000;
+    size_t lines = argc > 2 ? (size_t)atol(argv[2]) : 2000;
+    size_t string_length = argc > 3 ? (size_t)atol(argv[3]) : 16;
+    if (pairs_per_line == 0 || lines == 0 || string_length == 0 || string_length >= MAX_STRING_SIZE - 1) {
+        fprintf(stderr, "Usage: %s [pairs_per_line] [lines] [string_length < %d]\n", argv[0], MAX_STRING_SIZE - 1);
+        return 1;
+    }
+
+    char path[] = "/tmp/parse_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1 || write_job(fd, pairs_per_line, lines, string_length) != 0) {
+        perror("Failed to write the job file");
+        return 1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    Reader *reader = malloc(sizeof(Reader));
+    CommandArgs args;
+    command_args_init(&args);
+    if (reader == NULL) {
+        unlink(path);
+        return 1;
+    }
+
+    printf("%zu lines of %zu pairs, %zu-character strings: %.1f MB\n", lines, pairs_per_line, string_length,
+           (double)size / 1e6);
+    const char *names[] = { "auto", "scalar", "sse2", "avx2" };
+    for (int scan = READER_SCAN_SCALAR; scan <= READER_SCAN_AVX2; scan++) {
+        if (reader_use_scan((enum ReaderScan)scan) != 0) {
+            printf("%-8s unsupported\n", names[scan]);
+            continue;
+        }
+        double best = 0;
+        size_t pairs = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pairs = parse_job(path, reader, &args);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double seconds = elapsed_seconds(start, end);
+            if (round == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        printf("%-8s %8.1f MB/s %8.2f Mpairs/s (%zu pairs)\n", names[scan], (double)size / 1e6 / best,
+               (double)pairs / 1e6 / best, pairs);
+    }
+
+    unlink(path);
+    free(reader);
+    command_args_free(&args);
+    return 0;
+}
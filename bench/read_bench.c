@@ -0,0 +1,84 @@
+/**
+ * Contention benchmark for the KVS hash table.
+ * Runs 1..<max_threads> threads reading a small set of hot keys (optionally mixed
+ * with writes) and reports the aggregate throughput for each thread count.
+ * Usage: bench/read_bench [max_threads] [hot_keys] [write_percent] [chained|flat]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "constants.h"
+#include "kvs.h"
+
+#define OPS_PER_THREAD 2000000
+
+static HashTable *ht;
+static unsigned int hot_keys = 8;
+static unsigned int write_percent = 0;
+
+static void *reader_thread(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE + 1];
+    for (int i = 0; i < OPS_PER_THREAD; i++) {
+        seed = seed * 1103515245 + 12345;                                           // Cheap per-thread LCG
+        snprintf(key, sizeof(key), "hot%u", (seed >> 16) % hot_keys);
+        if ((seed >> 8) % 100 < write_percent) {
+            write_pair(ht, key, "value");
+        } else {
+            read_pair(ht, key, value, sizeof(value));
+        }
+    }
+    return NULL;
+}
+
+static double elapsed_seconds(struct timespec start, struct timespec end) {
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+    if (argc > 2) hot_keys = (unsigned int)atoi(argv[2]);
+    if (argc > 3) write_percent = (unsigned int)atoi(argv[3]);
+    enum TableEngine engine = argc > 4 && strcmp(argv[4], "flat") == 0 ? ENGINE_FLAT : ENGINE_CHAINED;
+    if (max_threads <= 0 || hot_keys == 0) {
+        fprintf(stderr, "Usage: %s [max_threads] [hot_keys] [write_percent] [chained|flat]\n", argv[0]);
+        return 1;
+    }
+
+    TableConfig config = { .engine = engine, .ordered_index = 0 };
+    ht = create_hash_table(&config);
+    if (ht == NULL) {
+        perror("Failed to create hash table");
+        return 1;
+    }
+    char key[MAX_STRING_SIZE];
+    for (unsigned int i = 0; i < hot_keys; i++) {
+        snprintf(key, sizeof(key), "hot%u", i);
+        write_pair(ht, key, "value");
+    }
+
+    printf("threads  Mops/s  (hot_keys=%u, writes=%u%%, engine=%s)\n", hot_keys, write_percent,
+           engine == ENGINE_FLAT ? "flat" : "chained");
+    pthread_t threads[max_threads];
+    for (int n = 1; n <= max_threads; n++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < n; i++) {
+            pthread_create(&threads[i], NULL, reader_thread, (void *)(size_t)(i + 1));
+        }
+        for (int i = 0; i < n; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ops = (double)n * OPS_PER_THREAD;
+        printf("%7d  %6.2f\n", n, ops / elapsed_seconds(start, end) / 1e6);
+    }
+
+    free_table(ht);
+    return 0;
+}
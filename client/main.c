@@ -33,8 +33,11 @@ int main(int argc, char* argv[]) {
 
   // TO DO open pipes
 
+  static Reader input;                                                              // Commands typed or piped in
+  reader_init(&input, STDIN_FILENO);
+
   while (1) {
-    switch (get_next(STDIN_FILENO)) {
+    switch (get_next(&input)) {
       case CMD_DISCONNECT:
         /*if (kvs_disconnect() != 0) {
           fprintf(stderr, "Failed to disconnect to the server\n");
@@ -45,7 +48,7 @@ int main(int argc, char* argv[]) {
         return 0;
 
       case CMD_SUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(&input, keys, 1, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
@@ -58,7 +61,7 @@ int main(int argc, char* argv[]) {
         break;
 
       case CMD_UNSUBSCRIBE:
-        num = parse_list(STDIN_FILENO, keys, 1, MAX_STRING_SIZE);
+        num = parse_list(&input, keys, 1, MAX_STRING_SIZE);
         if (num == 0) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
@@ -71,7 +74,7 @@ int main(int argc, char* argv[]) {
         break;
 
       case CMD_DELAY:
-        if (parse_delay(STDIN_FILENO, &delay_ms) == -1) {
+        if (parse_delay(&input, &delay_ms) == -1) {
           fprintf(stderr, "Invalid command. See HELP for usage\n");
           continue;
         }
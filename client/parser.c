@@ -7,122 +7,37 @@
 
 #include "constants.h"
 
-// Reads a string and indicates the position from where it was
-// extracted, based on the KVS specification.
-// @param fd File to read from.
-// @param buffer To write the string in.
-// @param max Maximum string size.
-static int read_string(int fd, char *buffer, size_t max) {
-  ssize_t bytes_read;
-  char ch;
-  size_t i = 0;
-  int value = -1;
-
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
-
-    if (bytes_read <= 0) {
-      return -1;
-    }
-
-    if (ch == ' ') {
-      return -1;
-    }
-
-    if (ch == ',') {
-      value = 0;
-      break;
-    } else if (ch == ')') {
-      value = 1;
-      break;
-    } else if (ch == ']') {
-      value = 2;
-      break;
-    }
-
-    buffer[i++] = ch;
-  }
-
-  buffer[i] = '\0';
-
-  return value;
-}
-
-// Reads a number and stores it in an unsigned integer
-// variable.
-// @param fd File to read from.
-// @param value To store the number in.
-// @param next Will point to the character succeding the number.
-static int read_uint(int fd, unsigned int *value, char *next) {
-  char buf[16];
-
-  int i = 0;
-  while (1) {
-    if (read(fd, buf + i, 1) == 0) {
-      *next = '\0';
-      break;
-    }
-
-    *next = buf[i];
-
-    if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
-      break;
-    }
-
-    i++;
-  }
-
-  unsigned long ul = strtoul(buf, NULL, 10);
-
-  if (ul > UINT_MAX) {
-    return 1;
-  }
-
-  *value = (unsigned int)ul;
-
-  return 0;
-}
-
-// Jumps file descriptor to next line.
-// @param fd File descriptor.
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
-}
-
-enum Command get_next(int fd) {
+enum Command get_next(Reader *reader) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (reader_read(reader, buf, 1) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'S':
-      if (read(fd, buf + 1, 9) != 9 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
-        cleanup(fd);
+      if (reader_read(reader, buf + 1, 9) != 9 || strncmp(buf, "SUBSCRIBE ", 10) != 0) {
+        reader_skip_line(reader);
         return CMD_INVALID;
       }
 
       return CMD_SUBSCRIBE;
 
     case 'U':
-      if (read(fd, buf + 1, 11) != 11 || strncmp(buf, "UNSUBSCRIBE ", 12) != 0) {
-        cleanup(fd);
+      if (reader_read(reader, buf + 1, 11) != 11 || strncmp(buf, "UNSUBSCRIBE ", 12) != 0) {
+        reader_skip_line(reader);
         return CMD_INVALID;
       }
 
       return CMD_UNSUBSCRIBE;
 
     case 'D':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
-        if (read(fd, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
-          cleanup(fd);
+      if (reader_read(reader, buf + 1, 5) != 5 || strncmp(buf, "DELAY ", 6) != 0) {
+        if (reader_read(reader, buf + 6, 4) != 4 || strncmp(buf, "DISCONNECT", 10) != 0) {
+          reader_skip_line(reader);
           return CMD_INVALID;
         }
-        if (read(fd, buf + 10, 1) != 0 && buf[10] != '\n') {
-          cleanup(fd);
+        if (reader_read(reader, buf + 10, 1) != 0 && buf[10] != '\n') {
+          reader_skip_line(reader);
           return CMD_INVALID;
         }
         return CMD_DISCONNECT;
@@ -131,23 +46,23 @@ enum Command get_next(int fd) {
       return CMD_DELAY;
 
     case '#':
-      cleanup(fd);
+      reader_skip_line(reader);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      reader_skip_line(reader);
       return CMD_INVALID;
   }
 }
 
-size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_list(Reader *reader, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
   char ch;
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (reader_read(reader, &ch, 1) != 1 || ch != '[') {
+    reader_skip_line(reader);
     return 0;
   }
 
@@ -155,9 +70,9 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t
   int output = 2;
   char key[max_string_size];
   while (num_keys < max_keys) {
-    output = read_string(fd, key, max_string_size);
+    output = reader_string(reader, key, max_string_size, NULL);
     if (output < 0 || output == 1) {
-      cleanup(fd);
+      reader_skip_line(reader);
       return 0;
     }
 
@@ -169,23 +84,23 @@ size_t parse_list(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t
   }
 
   if (num_keys == max_keys && output != 2) {
-    cleanup(fd);
+    reader_skip_line(reader);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+    reader_skip_line(reader);
     return 0;
   }
 
   return num_keys;
 }
 
-int parse_delay(int fd, unsigned int *delay) {
+int parse_delay(Reader *reader, unsigned int *delay) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (reader_uint(reader, delay, &ch) != 0) {
+    reader_skip_line(reader);
     return -1;
   }
 
@@ -0,0 +1,38 @@
+#include "codec.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));                   // Castagnoli polynomial, reflected
+        }
+        crc_table[i] = crc;
+    }
+}
+
+uint32_t crc32c(const uint8_t *data, size_t length) {
+    pthread_once(&crc_once, crc_init);
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+int write_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            return 1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef KVS_CODEC_H
+#define KVS_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Helpers shared by the on-disk formats (snapshot files, WAL): integers are stored
+// little-endian whatever the host, and records are checksummed with CRC-32C.
+
+static inline void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static inline void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static inline uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+/// Computes the CRC-32C (Castagnoli) of a buffer.
+/// @param data Bytes to checksum.
+/// @param length Number of bytes.
+/// @return Checksum of the bytes.
+uint32_t crc32c(const uint8_t *data, size_t length);
+
+/// Writes a whole buffer, retrying short writes.
+/// @param fd File to write to.
+/// @param data Bytes to write.
+/// @param length Number of bytes.
+/// @return 0 if every byte was written, 1 otherwise.
+int write_all(int fd, const uint8_t *data, size_t length);
+
+#endif  // KVS_CODEC_H
@@ -0,0 +1,204 @@
+#include "flat.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "kvs.h"
+
+#define FLAT_EMPTY 0x80                                                             // Never used (ends a lookup)
+#define FLAT_DELETED 0xFE                                                           // Used, then erased (lookups go on)
+
+// Slot position bits skip the low bits of the hash, which select the lock stripe
+// and are therefore equal for every key of a FlatTable.
+static inline size_t hash_position(uint64_t hash) {
+    return (size_t)(hash >> 12);
+}
+
+// Tag stored in ctrl for a full slot: the top 7 bits of the hash.
+static inline uint8_t hash_tag(uint64_t hash) {
+    return (uint8_t)(hash >> 57);
+}
+
+// Bit i of the result is set when ctrl[i] == tag, for the 16 bytes of a group.
+static inline uint32_t group_match(const uint8_t *group, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FLAT_GROUP_SIZE; i++) {
+        mask |= (uint32_t)(group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i of the result is set when slot i of a group is empty or deleted (tag high bit set).
+static inline uint32_t group_match_free(const uint8_t *group) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < FLAT_GROUP_SIZE; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// Allocates the arrays of an empty table with the given capacity.
+static int allocate_arrays(FlatTable *ft, size_t capacity) {
+    ft->ctrl = malloc(capacity);
+    ft->slots = malloc(capacity * sizeof(struct KeyNode *));
+    if (ft->ctrl == NULL || ft->slots == NULL) {
+        free(ft->ctrl);
+        free(ft->slots);
+        return 1;
+    }
+    memset(ft->ctrl, FLAT_EMPTY, capacity);
+    ft->capacity = capacity;
+    ft->size = 0;
+    ft->tombstones = 0;
+    return 0;
+}
+
+int flat_init(FlatTable *ft) {
+    return allocate_arrays(ft, FLAT_MIN_CAPACITY);
+}
+
+struct KeyNode *flat_find(const FlatTable *ft, uint64_t hash, const char *key) {
+    size_t group_mask = ft->capacity / FLAT_GROUP_SIZE - 1;
+    size_t group = hash_position(hash) & group_mask;
+    uint8_t tag = hash_tag(hash);
+
+    for (size_t probe = 1; ; probe++) {                                             // Triangular probing over the groups
+        const uint8_t *ctrl = ft->ctrl + group * FLAT_GROUP_SIZE;
+        for (uint32_t match = group_match(ctrl, tag); match != 0; match &= match - 1) {
+            KeyNode *node = ft->slots[group * FLAT_GROUP_SIZE + (size_t)__builtin_ctz(match)];
+            if (node->hash == hash && strcmp(node->key, key) == 0) {
+                return node;
+            }
+        }
+        if (group_match(ctrl, FLAT_EMPTY) != 0) {                                   // The key would have been placed here
+            return NULL;
+        }
+        group = (group + probe) & group_mask;
+    }
+}
+
+// Index of the first empty or deleted slot in the probe sequence of a hash.
+static size_t find_free_slot(const FlatTable *ft, uint64_t hash) {
+    size_t group_mask = ft->capacity / FLAT_GROUP_SIZE - 1;
+    size_t group = hash_position(hash) & group_mask;
+
+    for (size_t probe = 1; ; probe++) {
+        uint32_t match = group_match_free(ft->ctrl + group * FLAT_GROUP_SIZE);
+        if (match != 0) {
+            return group * FLAT_GROUP_SIZE + (size_t)__builtin_ctz(match);
+        }
+        group = (group + probe) & group_mask;
+    }
+}
+
+// Moves every node to new arrays of the given capacity, dropping the tombstones.
+static int rehash(FlatTable *ft, size_t capacity) {
+    FlatTable old = *ft;
+    if (allocate_arrays(ft, capacity) != 0) {
+        *ft = old;
+        return 1;
+    }
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.ctrl[i] & FLAT_EMPTY) {                                             // Empty or deleted
+            continue;
+        }
+        size_t slot = find_free_slot(ft, old.slots[i]->hash);
+        ft->ctrl[slot] = old.ctrl[i];
+        ft->slots[slot] = old.slots[i];
+        ft->size++;
+    }
+    free(old.ctrl);
+    free(old.slots);
+    return 0;
+}
+
+int flat_reserve(FlatTable *ft, size_t pairs) {
+    size_t capacity = ft->capacity;
+    while (pairs * 8 > capacity * 7) {                                              // Same bound as flat_insert
+        capacity *= 2;
+    }
+    return capacity == ft->capacity ? 0 : rehash(ft, capacity);
+}
+
+int flat_insert(FlatTable *ft, struct KeyNode *node) {
+    if ((ft->size + ft->tombstones + 1) * 8 > ft->capacity * 7) {                  // Keep the load (with tombstones) under 7/8
+        size_t capacity = ft->capacity;
+        if ((ft->size + 1) * 16 > capacity * 7) {                                   // Mostly live slots: grow, otherwise just purge tombstones
+            capacity *= 2;
+        }
+        if (rehash(ft, capacity) != 0) {
+            return 1;
+        }
+    }
+
+    size_t slot = find_free_slot(ft, node->hash);
+    if (ft->ctrl[slot] == FLAT_DELETED) {
+        ft->tombstones--;
+    }
+    ft->ctrl[slot] = hash_tag(node->hash);
+    ft->slots[slot] = node;
+    ft->size++;
+    return 0;
+}
+
+struct KeyNode *flat_erase(FlatTable *ft, uint64_t hash, const char *key) {
+    size_t group_mask = ft->capacity / FLAT_GROUP_SIZE - 1;
+    size_t group = hash_position(hash) & group_mask;
+    uint8_t tag = hash_tag(hash);
+
+    for (size_t probe = 1; ; probe++) {
+        uint8_t *ctrl = ft->ctrl + group * FLAT_GROUP_SIZE;
+        for (uint32_t match = group_match(ctrl, tag); match != 0; match &= match - 1) {
+            size_t slot = group * FLAT_GROUP_SIZE + (size_t)__builtin_ctz(match);
+            KeyNode *node = ft->slots[slot];
+            if (node->hash == hash && strcmp(node->key, key) == 0) {
+                // A group that still has an empty slot never made a lookup go past it,
+                // so the slot can become empty again; otherwise it must stay a tombstone
+                if (group_match(ctrl, FLAT_EMPTY) != 0) {
+                    ft->ctrl[slot] = FLAT_EMPTY;
+                } else {
+                    ft->ctrl[slot] = FLAT_DELETED;
+                    ft->tombstones++;
+                }
+                ft->size--;
+                return node;
+            }
+        }
+        if (group_match(ctrl, FLAT_EMPTY) != 0) {
+            return NULL;
+        }
+        group = (group + probe) & group_mask;
+    }
+}
+
+size_t flat_collect(const FlatTable *ft, struct KeyNode **nodes) {
+    size_t n = 0;
+    for (size_t i = 0; i < ft->capacity; i++) {
+        if (!(ft->ctrl[i] & FLAT_EMPTY)) {
+            nodes[n++] = ft->slots[i];
+        }
+    }
+    return n;
+}
+
+void flat_destroy(FlatTable *ft) {
+    free(ft->ctrl);
+    free(ft->slots);
+    ft->ctrl = NULL;
+    ft->slots = NULL;
+    ft->capacity = 0;
+    ft->size = 0;
+}
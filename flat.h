@@ -0,0 +1,65 @@
+#ifndef KVS_FLAT_H
+#define KVS_FLAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAT_GROUP_SIZE 16                                                          // Control bytes scanned at once (one SSE2 register)
+#define FLAT_MIN_CAPACITY 16                                                        // Initial number of slots (multiple of FLAT_GROUP_SIZE)
+
+struct KeyNode;
+
+// Open-addressing table in the style of a Swiss table. Each slot has a one byte tag
+// in ctrl: the top 7 bits of the key's hash when full, or FLAT_EMPTY / FLAT_DELETED.
+// Lookups compare 16 tags per step and only dereference the nodes whose tag matches.
+// The table stores pointers, so nodes never move when it grows. Not thread-safe.
+typedef struct FlatTable {
+    uint8_t *ctrl;                                                                  // One tag per slot
+    struct KeyNode **slots;
+    size_t capacity;                                                                // Number of slots (power of two)
+    size_t size;                                                                    // Full slots
+    size_t tombstones;                                                              // Deleted slots
+} FlatTable;
+
+/// Initializes an empty flat table.
+/// @param ft Table to initialize.
+/// @return 0 if the table was initialized successfully, 1 otherwise.
+int flat_init(FlatTable *ft);
+
+/// Finds the node of a key.
+/// @param ft Table to search.
+/// @param hash Hash of the key.
+/// @param key Key to find.
+/// @return The node holding the key, NULL if it is not in the table.
+struct KeyNode *flat_find(const FlatTable *ft, uint64_t hash, const char *key);
+
+/// Inserts a node whose key is not in the table yet, growing the table if needed.
+/// @param ft Table to modify.
+/// @param node Node to insert (its hash field must be set).
+/// @return 0 if the node was inserted successfully, 1 otherwise.
+int flat_insert(FlatTable *ft, struct KeyNode *node);
+
+/// Grows the table so that it holds a number of keys without growing again.
+/// @param ft Table to grow.
+/// @param pairs Number of keys it must hold.
+/// @return 0 if the table was grown successfully, 1 otherwise.
+int flat_reserve(FlatTable *ft, size_t pairs);
+
+/// Removes the node of a key from the table.
+/// @param ft Table to modify.
+/// @param hash Hash of the key.
+/// @param key Key to remove.
+/// @return The removed node, NULL if the key was not in the table.
+struct KeyNode *flat_erase(FlatTable *ft, uint64_t hash, const char *key);
+
+/// Appends every node of the table to an array.
+/// @param ft Table to traverse.
+/// @param nodes Array with room for at least ft->size more nodes.
+/// @return Number of nodes appended.
+size_t flat_collect(const FlatTable *ft, struct KeyNode **nodes);
+
+/// Frees the arrays of the table (not the nodes).
+/// @param ft Table to destroy.
+void flat_destroy(FlatTable *ft);
+
+#endif  // KVS_FLAT_H
@@ -0,0 +1,304 @@
+#include "jobc.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "codec.h"
+
+// Opcodes of the file, fixed whatever the order of enum Command.
+enum JobcOp {
+    JOBC_WRITE = 1,
+    JOBC_WRITE_TTL,
+    JOBC_READ,
+    JOBC_READ_RANGE,
+    JOBC_DELETE,
+    JOBC_SHOW,
+    JOBC_STATS,
+    JOBC_WAIT,
+    JOBC_BACKUP,
+    JOBC_HELP,
+    JOBC_INVALID
+};
+
+// Commands being compiled, in memory.
+typedef struct JobcBuffer {
+    uint8_t *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} JobcBuffer;
+
+// Makes room for length more bytes. Returns where they go, NULL on failure.
+static uint8_t *reserve(JobcBuffer *buffer, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 64 * 1024;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        uint8_t *grown = realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            buffer->failed = 1;
+            return NULL;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    uint8_t *p = buffer->data + buffer->length;
+    buffer->length += length;
+    return p;
+}
+
+static void put_string(JobcBuffer *buffer, const Span *string) {
+    uint8_t *p = reserve(buffer, 1 + string->length + 1);
+    if (p != NULL) {
+        p[0] = (uint8_t)string->length;
+        memcpy(p + 1, string->data, string->length + 1);                            // NUL included
+    }
+}
+
+static void put_op(JobcBuffer *buffer, enum JobcOp op) {
+    uint8_t *p = reserve(buffer, 1);
+    if (p != NULL) {
+        *p = (uint8_t)op;
+    }
+}
+
+static void put_count(JobcBuffer *buffer, size_t count) {
+    uint8_t *p = reserve(buffer, 4);
+    if (p != NULL) {
+        put_u32(p, (uint32_t)count);
+    }
+}
+
+// Appends one command. Returns 0 if it is dropped (prints nothing when run).
+static int compile_command(JobcBuffer *buffer, enum Command command, const CommandArgs *args) {
+    size_t num_pairs = args->num_pairs;
+    switch (command) {
+        case CMD_WRITE:
+        case CMD_WRITE_TTL:
+            put_op(buffer, command == CMD_WRITE ? JOBC_WRITE : JOBC_WRITE_TTL);
+            put_count(buffer, num_pairs);
+            for (size_t i = 0; i < num_pairs; i++) {
+                put_string(buffer, &args->keys[i]);
+                put_string(buffer, &args->values[i]);
+                uint8_t *p = command == CMD_WRITE_TTL ? reserve(buffer, 4) : NULL;
+                if (p != NULL) {
+                    put_u32(p, args->ttls[i]);
+                }
+            }
+            return 1;
+        case CMD_READ:
+        case CMD_READ_RANGE:
+        case CMD_DELETE:
+            put_op(buffer, command == CMD_READ ? JOBC_READ : command == CMD_DELETE ? JOBC_DELETE : JOBC_READ_RANGE);
+            put_count(buffer, num_pairs);
+            for (size_t i = 0; i < num_pairs; i++) {
+                put_string(buffer, &args->keys[i]);
+            }
+            return 1;
+        case CMD_WAIT: {
+            put_op(buffer, JOBC_WAIT);
+            uint8_t *p = reserve(buffer, 4);
+            if (p != NULL) {
+                put_u32(p, args->delay);
+            }
+            return 1;
+        }
+        case CMD_SHOW:
+            put_op(buffer, JOBC_SHOW);
+            return 1;
+        case CMD_STATS:
+            put_op(buffer, JOBC_STATS);
+            return 1;
+        case CMD_BACKUP:
+            put_op(buffer, JOBC_BACKUP);
+            return 1;
+        case CMD_HELP:
+            put_op(buffer, JOBC_HELP);
+            return 1;
+        case CMD_INVALID:
+            put_op(buffer, JOBC_INVALID);
+            return 1;
+        case CMD_EMPTY:
+        case EOC:
+            break;
+    }
+    return 0;
+}
+
+int jobc_compile(Reader *reader, int fd, uint64_t *commands) {
+    CommandArgs args;
+    command_args_init(&args);
+    JobcBuffer buffer = { NULL, 0, 0, 0 };
+    reserve(&buffer, JOBC_HEADER_SIZE);                                             // Filled in at the end
+
+    *commands = 0;
+    enum Command command;
+    while ((command = parse_command(reader, &args)) != EOC) {
+        *commands += (uint64_t)compile_command(&buffer, command, &args);
+    }
+    command_args_free(&args);
+    if (buffer.failed) {
+        free(buffer.data);
+        return 1;
+    }
+
+    memcpy(buffer.data, JOBC_MAGIC, sizeof(JOBC_MAGIC));
+    put_u32(buffer.data + 8, JOBC_VERSION);
+    put_u32(buffer.data + 12, crc32c(buffer.data + JOBC_HEADER_SIZE, buffer.length - JOBC_HEADER_SIZE));
+    put_u64(buffer.data + 16, *commands);
+    int failed = write_all(fd, buffer.data, buffer.length);
+    free(buffer.data);
+    return failed;
+}
+
+int jobc_open(const char *path, JobcFile *file) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open compiled job");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < JOBC_HEADER_SIZE) {
+        fprintf(stderr, "Compiled job %s is too short\n", path);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                                                                      // The mapping keeps the file open
+    if (map == MAP_FAILED) {
+        perror("Failed to map compiled job");
+        return 1;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    file->map = map;
+    file->size = size;
+    file->position = JOBC_HEADER_SIZE;
+    file->commands = get_u64(map + 16);
+    file->failed = 0;
+    if (memcmp(map, JOBC_MAGIC, sizeof(JOBC_MAGIC)) != 0 || get_u32(map + 8) != JOBC_VERSION ||
+        get_u32(map + 12) != crc32c(map + JOBC_HEADER_SIZE, size - JOBC_HEADER_SIZE)) {
+        fprintf(stderr, "%s is not a valid compiled job\n", path);
+        jobc_close(file);
+        return 1;
+    }
+    return 0;
+}
+
+void jobc_close(JobcFile *file) {
+    munmap((void *)file->map, file->size);
+    file->map = NULL;
+}
+
+// Takes length bytes of the file. Returns NULL if the file ends before.
+static const uint8_t *take(JobcFile *file, size_t length) {
+    if (file->size - file->position < length) {
+        file->failed = 1;
+        return NULL;
+    }
+    const uint8_t *p = file->map + file->position;
+    file->position += length;
+    return p;
+}
+
+// Takes a length-prefixed, NUL-terminated string. Returns 1 if it is malformed.
+static int take_string(JobcFile *file, Span *string) {
+    const uint8_t *length = take(file, 1);
+    if (length == NULL || *length >= MAX_STRING_SIZE) {
+        file->failed = 1;
+        return 1;
+    }
+    const uint8_t *p = take(file, (size_t)*length + 1);
+    if (p == NULL || p[*length] != '\0') {
+        file->failed = 1;
+        return 1;
+    }
+    *string = (Span){ (const char *)p, *length };
+    return 0;
+}
+
+enum Command jobc_next(JobcFile *file, CommandArgs *args) {
+    args->num_pairs = 0;
+    if (file->commands == 0 || file->failed) {
+        return EOC;
+    }
+    file->commands--;
+    const uint8_t *op = take(file, 1);
+    if (op == NULL) {
+        return EOC;
+    }
+
+    const uint8_t *p;
+    size_t count;
+    switch (*op) {
+        case JOBC_WRITE:
+        case JOBC_WRITE_TTL:
+        case JOBC_READ:
+        case JOBC_READ_RANGE:
+        case JOBC_DELETE:
+            if ((p = take(file, 4)) == NULL) {
+                return EOC;
+            }
+            count = get_u32(p);
+            if (count > (file->size - file->position) / 2 || command_args_reserve(args, count) != 0) {
+                file->failed = 1;                                                   // Each key takes 2 bytes at least
+                return EOC;
+            }
+            for (size_t i = 0; i < count; i++) {
+                if (take_string(file, &args->keys[i]) != 0) {
+                    return EOC;
+                }
+                if ((*op == JOBC_WRITE || *op == JOBC_WRITE_TTL) && take_string(file, &args->values[i]) != 0) {
+                    return EOC;
+                }
+                if (*op == JOBC_WRITE_TTL) {
+                    if ((p = take(file, 4)) == NULL) {
+                        return EOC;
+                    }
+                    args->ttls[i] = get_u32(p);
+                }
+            }
+            args->num_pairs = count;
+            return *op == JOBC_WRITE ? CMD_WRITE : *op == JOBC_WRITE_TTL ? CMD_WRITE_TTL : *op == JOBC_READ ? CMD_READ
+                   : *op == JOBC_DELETE ? CMD_DELETE : CMD_READ_RANGE;
+        case JOBC_WAIT:
+            if ((p = take(file, 4)) == NULL) {
+                return EOC;
+            }
+            args->delay = get_u32(p);
+            return CMD_WAIT;
+        case JOBC_SHOW:
+            return CMD_SHOW;
+        case JOBC_STATS:
+            return CMD_STATS;
+        case JOBC_BACKUP:
+            return CMD_BACKUP;
+        case JOBC_HELP:
+            return CMD_HELP;
+        case JOBC_INVALID:
+            return CMD_INVALID;
+        default:
+            file->failed = 1;
+            return EOC;
+    }
+}
+
+int jobc_is_compiled(const char *path) {
+    size_t length = strlen(path);
+    return length >= 5 && strcmp(path + length - 5, ".jobc") == 0;
+}
+
+size_t job_name_length(const char *path) {
+    size_t length = strlen(path);
+    if (jobc_is_compiled(path)) {
+        return length - 5;
+    }
+    return length >= 4 && strcmp(path + length - 4, ".job") == 0 ? length - 4 : length;
+}
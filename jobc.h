@@ -0,0 +1,71 @@
+#ifndef KVS_JOBC_H
+#define KVS_JOBC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+#include "parser.h"
+
+#define JOBC_MAGIC "KVSJOBC"                                                        // First 8 bytes of the file (with the NUL)
+#define JOBC_VERSION 2
+#define JOBC_HEADER_SIZE 24
+
+// Compiled job layout (every integer little-endian), written by kvs-jobc:
+//   header    magic[8] version:u32 crc:u32 (CRC-32C of the commands) commands:u64
+//   commands  op:u8, then by op
+//     WRITE        count:u32, count x (key value)
+//     WRITE_TTL    count:u32, count x (key value ttl:u32)
+//     READ, DELETE, READ_RANGE
+//                  count:u32, count x key
+//     WAIT         delay:u32 (milliseconds)
+//     others       nothing
+//   where a string is length:u8, its bytes and a NUL, so commands point into the map.
+// A command the text parser rejected is kept with a count of 0, so that running the
+// compiled job reports it just like the text job does. Empty lines, comments and
+// malformed WAITs, which print nothing, are dropped.
+
+// Compiled job file mapped in memory, and the position of the next command.
+typedef struct JobcFile {
+    const uint8_t *map;
+    size_t size;
+    size_t position;
+    uint64_t commands;                                                              // Commands left
+    int failed;                                                                     // A command was cut or malformed
+} JobcFile;
+
+/// Compiles a text job into the binary format.
+/// @param reader Reader of the .job file.
+/// @param fd File to write the .jobc to (seekable, empty).
+/// @param commands Receives the number of commands compiled.
+/// @return 0 if the job was compiled successfully, 1 otherwise.
+int jobc_compile(Reader *reader, int fd, uint64_t *commands);
+
+/// Maps a compiled job and checks its header and checksum.
+/// @param path .jobc file.
+/// @param file Receives the mapping.
+/// @return 0 if the file was mapped successfully, 1 otherwise.
+int jobc_open(const char *path, JobcFile *file);
+
+/// Unmaps a compiled job.
+/// @param file File returned by jobc_open.
+void jobc_close(JobcFile *file);
+
+/// Decodes the next command of a compiled job, with the arguments parse_command
+/// would give for it. The strings are not copied: they stay in the mapped file.
+/// @param file Compiled job.
+/// @param args Receives the arguments (the arena is left untouched).
+/// @return The command, EOC at the end of the file or if it is corrupted (failed is then set).
+enum Command jobc_next(JobcFile *file, CommandArgs *args);
+
+/// Tells whether a job file is compiled, from its extension.
+/// @param path Path of the job file.
+/// @return 1 for a .jobc file, 0 otherwise.
+int jobc_is_compiled(const char *path);
+
+/// Length of a job file's path without its .job or .jobc extension, to name the
+/// files the job writes (<job>.out, <job>-<n>.bck).
+/// @param path Path of the job file.
+/// @return Length of the path without the extension.
+size_t job_name_length(const char *path);
+
+#endif  // KVS_JOBC_H
@@ -0,0 +1,356 @@
+#include "jobdag.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One lock guards the graphs of every running window. A command takes it twice (to be
+// taken, to be done), which is little next to a batch of pairs.
+static pthread_mutex_t dag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dag_wake = PTHREAD_COND_INITIALIZER;                         // Commands became ready, a window is done, or stop
+static JobDag *active = NULL;                                                       // Windows being run (dag_mutex)
+static int stopping = 0;                                                            // dag_mutex
+
+static pthread_t *helpers = NULL;
+static OutBuf **helper_outputs = NULL;
+static int num_helpers = 0;
+static JobDagRun run = NULL;                                                        // Runs one command
+
+// Runs one command of a window and keeps its output. Called without the lock: the
+// command's pairs are only read by the thread that took it.
+static void execute(JobDag *dag, size_t index, OutBuf *capture) {
+    DagCommand *command = &dag->commands[index];
+    CommandArgs args;                                                               // A view of the window's arrays
+    command_args_init(&args);
+    args.keys = dag->keys + command->first;
+    args.values = dag->values + command->first;
+    args.ttls = dag->ttls + command->first;
+    args.num_pairs = command->num_pairs;
+    run(command->command, &args, capture);
+    command->lost = outbuf_take(capture, &command->output, &command->output_length);
+}
+
+// Marks a command done and readies the commands that were only waiting for it.
+// Called with dag_mutex held.
+static void complete(JobDag *dag, size_t index) {
+    DagCommand *command = &dag->commands[index];
+    int woke = 0;
+    for (size_t i = command->first_next; i < command->first_next + command->num_next; i++) {
+        size_t next = dag->next[i];
+        if (--dag->commands[next].waiting == 0) {
+            dag->ready[dag->num_ready++] = next;
+            woke = 1;
+        }
+    }
+    if (--dag->remaining == 0 || woke) {
+        pthread_cond_broadcast(&dag_wake);
+    }
+}
+
+static void *helper_thread(void *arg) {
+    OutBuf *capture = arg;
+    pthread_mutex_lock(&dag_mutex);
+    while (!stopping) {
+        JobDag *dag = active;
+        while (dag != NULL && dag->num_ready == 0) {
+            dag = dag->next_active;
+        }
+        if (dag == NULL) {
+            pthread_cond_wait(&dag_wake, &dag_mutex);
+            continue;
+        }
+        size_t index = dag->ready[--dag->num_ready];
+        pthread_mutex_unlock(&dag_mutex);
+        execute(dag, index, capture);
+        pthread_mutex_lock(&dag_mutex);
+        complete(dag, index);
+    }
+    pthread_mutex_unlock(&dag_mutex);
+    return NULL;
+}
+
+int jobdag_start(int count, JobDagRun run_one) {
+    helpers = malloc((size_t)count * sizeof(pthread_t));
+    helper_outputs = calloc((size_t)count, sizeof(OutBuf *));
+    if (helpers == NULL || helper_outputs == NULL) {
+        free(helpers);
+        free(helper_outputs);
+        return 1;
+    }
+    run = run_one;
+    stopping = 0;
+    for (num_helpers = 0; num_helpers < count; num_helpers++) {
+        OutBuf *capture = malloc(sizeof(OutBuf));
+        if (capture == NULL) {
+            break;
+        }
+        outbuf_init_memory(capture);
+        helper_outputs[num_helpers] = capture;
+        if (pthread_create(&helpers[num_helpers], NULL, helper_thread, capture) != 0) {
+            free(capture);
+            break;
+        }
+    }
+    if (num_helpers < count) {
+        jobdag_stop();
+        return 1;
+    }
+    return 0;
+}
+
+void jobdag_stop(void) {
+    pthread_mutex_lock(&dag_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&dag_wake);
+    pthread_mutex_unlock(&dag_mutex);
+    for (int i = 0; i < num_helpers; i++) {
+        pthread_join(helpers[i], NULL);
+        free(helper_outputs[i]);
+    }
+    free(helpers);
+    free(helper_outputs);
+    helpers = NULL;
+    helper_outputs = NULL;
+    num_helpers = 0;
+}
+
+int jobdag_enabled(void) {
+    return num_helpers > 0;
+}
+
+int jobdag_init(JobDag *dag) {
+    memset(dag, 0, sizeof(*dag));
+    arena_init(&dag->strings);
+    keyset_init(&dag->last_use);
+    dag->commands = malloc(DAG_WINDOW_COMMANDS * sizeof(DagCommand));
+    dag->ready = malloc(DAG_WINDOW_COMMANDS * sizeof(size_t));
+    dag->capture = malloc(sizeof(OutBuf));
+    if (dag->commands == NULL || dag->ready == NULL || dag->capture == NULL) {
+        jobdag_free(dag);
+        return 1;
+    }
+    outbuf_init_memory(dag->capture);
+    return 0;
+}
+
+void jobdag_free(JobDag *dag) {
+    free(dag->commands);
+    free(dag->keys);
+    free(dag->values);
+    free(dag->ttls);
+    arena_free(&dag->strings);
+    keyset_free(&dag->last_use);
+    free(dag->edges);
+    free(dag->next);
+    free(dag->ready);
+    free(dag->capture);
+    memset(dag, 0, sizeof(*dag));
+}
+
+int jobdag_is_barrier(enum Command command) {
+    switch (command) {
+        case CMD_READ_RANGE:
+        case CMD_SHOW:
+        case CMD_STATS:
+        case CMD_WAIT:
+        case CMD_BACKUP:
+            return 1;
+        case CMD_WRITE:
+        case CMD_WRITE_TTL:
+        case CMD_READ:
+        case CMD_DELETE:
+        case CMD_HELP:
+        case CMD_EMPTY:
+        case CMD_INVALID:
+        case EOC:
+            return 0;
+    }
+    return 1;
+}
+
+// Makes room for num_pairs more pairs in the window's arrays. Returns 0 on success.
+static int reserve_pairs(JobDag *dag, size_t num_pairs) {
+    if (num_pairs <= dag->pairs_capacity - dag->num_pairs) {
+        return 0;
+    }
+    size_t capacity = dag->pairs_capacity > 0 ? dag->pairs_capacity : 1024;
+    while (capacity - dag->num_pairs < num_pairs) {
+        capacity *= 2;
+    }
+    Span *keys = realloc(dag->keys, capacity * sizeof(Span));
+    if (keys != NULL) {
+        dag->keys = keys;
+    }
+    Span *values = realloc(dag->values, capacity * sizeof(Span));
+    if (values != NULL) {
+        dag->values = values;
+    }
+    unsigned int *ttls = realloc(dag->ttls, capacity * sizeof(unsigned int));
+    if (ttls != NULL) {
+        dag->ttls = ttls;
+    }
+    if (keys == NULL || values == NULL || ttls == NULL) {
+        return 1;
+    }
+    dag->pairs_capacity = capacity;
+    return 0;
+}
+
+// Copies a string into the window's arena. Returns 1 if out of memory.
+static int copy_string(JobDag *dag, const Span *string, Span *copy) {
+    char *data = arena_reserve(&dag->strings, string->length + 1);
+    if (data == NULL) {
+        return 1;
+    }
+    memcpy(data, string->data, string->length + 1);
+    arena_commit(&dag->strings, string->length + 1);
+    *copy = (Span){ data, string->length };
+    return 0;
+}
+
+static int add_edge(JobDag *dag, size_t from, size_t to) {
+    if (dag->num_edges == dag->edges_capacity) {
+        size_t capacity = dag->edges_capacity > 0 ? dag->edges_capacity * 2 : 1024;
+        DagEdge *edges = realloc(dag->edges, capacity * sizeof(DagEdge));
+        if (edges == NULL) {
+            return 1;
+        }
+        dag->edges = edges;
+        dag->edges_capacity = capacity;
+    }
+    dag->edges[dag->num_edges++] = (DagEdge){ from, to };
+    return 0;
+}
+
+int jobdag_add(JobDag *dag, enum Command command, const CommandArgs *args) {
+    if (command == CMD_EMPTY) {
+        return 0;
+    }
+    int writes = command == CMD_WRITE || command == CMD_WRITE_TTL;
+    size_t num_pairs = writes || command == CMD_READ || command == CMD_DELETE ? args->num_pairs : 0;
+    if (reserve_pairs(dag, num_pairs) != 0) {
+        return 1;
+    }
+
+    size_t index = dag->count;
+    size_t first_edge = dag->num_edges;
+    DagCommand *added = &dag->commands[index];
+    *added = (DagCommand){ command, dag->num_pairs, num_pairs, 0, SIZE_MAX, 0, 0, NULL, 0, 0 };
+    for (size_t i = 0; i < num_pairs; i++) {
+        size_t pair = dag->num_pairs + i;
+        dag->values[pair] = (Span){ NULL, 0 };
+        dag->ttls[pair] = command == CMD_WRITE_TTL ? args->ttls[i] : 0;
+        if (copy_string(dag, &args->keys[i], &dag->keys[pair]) != 0 ||
+            (writes && copy_string(dag, &args->values[i], &dag->values[pair]) != 0)) {
+            dag->num_edges = first_edge;
+            return 1;
+        }
+        size_t previous = keyset_use(&dag->last_use, &dag->keys[pair], index);
+        if (previous == SIZE_MAX) {
+            dag->num_edges = first_edge;
+            return 1;
+        }
+        if (previous != index && dag->commands[previous].stamp != index) {          // Not already waiting for it
+            if (add_edge(dag, previous, index) != 0) {
+                dag->num_edges = first_edge;
+                return 1;
+            }
+            dag->commands[previous].stamp = index;
+            added->waiting++;
+        }
+    }
+    dag->num_pairs += num_pairs;
+    dag->count++;
+    return 0;
+}
+
+int jobdag_full(const JobDag *dag) {
+    return dag->count >= DAG_WINDOW_COMMANDS || dag->num_pairs >= DAG_WINDOW_PAIRS;
+}
+
+// Groups the edges by the command they leave, so each command finds its dependents.
+// Returns 0 on success.
+static int link_dependents(JobDag *dag) {
+    free(dag->next);
+    dag->next = malloc((dag->num_edges > 0 ? dag->num_edges : 1) * sizeof(size_t));
+    if (dag->next == NULL) {
+        return 1;
+    }
+    for (size_t e = 0; e < dag->num_edges; e++) {
+        dag->commands[dag->edges[e].from].num_next++;
+    }
+    size_t first = 0;
+    for (size_t i = 0; i < dag->count; i++) {
+        dag->commands[i].first_next = first;
+        first += dag->commands[i].num_next;
+        dag->commands[i].num_next = 0;
+    }
+    for (size_t e = 0; e < dag->num_edges; e++) {
+        DagCommand *from = &dag->commands[dag->edges[e].from];
+        dag->next[from->first_next + from->num_next++] = dag->edges[e].to;
+    }
+    return 0;
+}
+
+// Empties the window for the next commands.
+static void reset_window(JobDag *dag) {
+    dag->count = 0;
+    dag->num_pairs = 0;
+    dag->num_edges = 0;
+    dag->num_ready = 0;
+    arena_reset(&dag->strings);
+    keyset_reset(&dag->last_use);
+}
+
+void jobdag_run(JobDag *dag, OutBuf *out) {
+    if (dag->count == 0) {
+        reset_window(dag);                                                          // Keys of a command that could not be added
+        return;
+    }
+    if (link_dependents(dag) != 0) {                                                // Out of memory: in order, on this thread
+        for (size_t i = 0; i < dag->count; i++) {
+            execute(dag, i, dag->capture);
+        }
+    } else {
+        for (size_t i = dag->count; i-- > 0;) {                                     // Lowest index on top
+            if (dag->commands[i].waiting == 0) {
+                dag->ready[dag->num_ready++] = i;
+            }
+        }
+        dag->remaining = dag->count;
+        pthread_mutex_lock(&dag_mutex);
+        dag->next_active = active;
+        active = dag;
+        pthread_cond_broadcast(&dag_wake);
+        while (dag->remaining > 0) {
+            if (dag->num_ready == 0) {
+                pthread_cond_wait(&dag_wake, &dag_mutex);
+                continue;
+            }
+            size_t index = dag->ready[--dag->num_ready];
+            pthread_mutex_unlock(&dag_mutex);
+            execute(dag, index, dag->capture);
+            pthread_mutex_lock(&dag_mutex);
+            complete(dag, index);
+        }
+        JobDag **link = &active;
+        while (*link != dag) {
+            link = &(*link)->next_active;
+        }
+        *link = dag->next_active;
+        pthread_mutex_unlock(&dag_mutex);
+    }
+
+    for (size_t i = 0; i < dag->count; i++) {                                       // The output in command order
+        DagCommand *command = &dag->commands[i];
+        if (command->output != NULL) {
+            outbuf_write(out, command->output, command->output_length);
+            free(command->output);
+        }
+        if (command->lost) {
+            out->failed = 1;
+        }
+    }
+    reset_window(dag);
+}
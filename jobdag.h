@@ -0,0 +1,113 @@
+#ifndef KVS_JOBDAG_H
+#define KVS_JOBDAG_H
+
+#include <stddef.h>
+#include "arena.h"
+#include "keyset.h"
+#include "outbuf.h"
+#include "parser.h"
+
+#define DAG_WINDOW_COMMANDS 1024                                                    // Commands parsed ahead before they are run
+#define DAG_WINDOW_PAIRS 65536                                                      // Keys parsed ahead (a larger command runs alone)
+
+// Parallel commands of a job (--command-threads). The job thread parses ahead a window
+// of commands and builds a dependency graph from their keys: a command waits for the
+// last earlier command of the window that used one of its keys, whether either of them
+// writes, reads or deletes it. Commands with no path between them run at once, on the
+// helper threads and on the job thread itself. The output of each command is gathered
+// in memory and written to the .out in command order once the window is done, so the
+// .out is the one the job would write running alone. SHOW, STATS, READ_RANGE and
+// BACKUP see the whole table and WAIT pauses the whole job: the window before them is
+// finished first and they run by themselves.
+
+/// Runs one command of a window, writing its output to out.
+typedef void (*JobDagRun)(enum Command command, CommandArgs *args, OutBuf *out);
+
+typedef struct DagCommand {
+    enum Command command;
+    size_t first;                                                                   // First pair in the window's arrays
+    size_t num_pairs;
+    size_t waiting;                                                                 // Earlier commands not done yet
+    size_t stamp;                                                                   // Last command given an edge from this one
+    size_t first_next;                                                              // First dependent in next
+    size_t num_next;                                                                // Commands waiting for this one
+    char *output;                                                                   // Output gathered when it ran (malloc)
+    size_t output_length;
+    int lost;                                                                       // Some of its output could not be kept
+} DagCommand;
+
+typedef struct DagEdge {
+    size_t from;
+    size_t to;
+} DagEdge;
+
+// Window of commands of one job thread. Only the graph state (waiting, ready,
+// remaining) is shared with the helpers, under the pool's lock.
+typedef struct JobDag {
+    DagCommand *commands;                                                           // DAG_WINDOW_COMMANDS of them
+    size_t count;
+    Span *keys;                                                                     // Pairs of every command of the window
+    Span *values;
+    unsigned int *ttls;
+    size_t num_pairs;
+    size_t pairs_capacity;
+    Arena strings;                                                                  // Copies of the keys and values
+    KeySet last_use;                                                                // Command that last used each key
+    DagEdge *edges;
+    size_t num_edges;
+    size_t edges_capacity;
+    size_t *next;                                                                   // Dependents of each command, edges grouped by from
+    size_t *ready;                                                                  // Commands that can run, a stack
+    size_t num_ready;
+    size_t remaining;                                                               // Commands not done yet
+    OutBuf *capture;                                                                // Output of the commands the job thread runs
+    struct JobDag *next_active;                                                     // Windows being run
+} JobDag;
+
+/// Starts the helper threads.
+/// @param helpers Number of helper threads.
+/// @param run Runs a command (the same function as the job threads).
+/// @return 0 if the helpers were started successfully, 1 otherwise.
+int jobdag_start(int helpers, JobDagRun run);
+
+/// Stops and joins the helper threads. No window may be running.
+void jobdag_stop(void);
+
+/// Tells whether jobs run their commands as dependency graphs.
+/// @return 1 if the helpers are running, 0 otherwise.
+int jobdag_enabled(void);
+
+/// Starts an empty window.
+/// @param dag Window to initialize.
+/// @return 0 if the window was initialized successfully, 1 otherwise.
+int jobdag_init(JobDag *dag);
+
+/// Frees a window, which must be empty (just run).
+/// @param dag Window to free.
+void jobdag_free(JobDag *dag);
+
+/// Tells whether a command must run alone, after the window before it.
+/// @param command Command parsed.
+/// @return 1 for SHOW, STATS, READ_RANGE, BACKUP and WAIT, 0 otherwise.
+int jobdag_is_barrier(enum Command command);
+
+/// Adds a command to the window, copying its arguments.
+/// @param dag Window of the job.
+/// @param command Command parsed (not a barrier).
+/// @param args Its arguments.
+/// @return 0 if the command was added, 1 if out of memory: the caller then runs the
+///         window and the command by itself.
+int jobdag_add(JobDag *dag, enum Command command, const CommandArgs *args);
+
+/// Tells whether the window should be run before adding more commands.
+/// @param dag Window of the job.
+/// @return 1 if the window is full, 0 otherwise.
+int jobdag_full(const JobDag *dag);
+
+/// Runs every command of the window, with the helpers, then writes their output in
+/// command order and empties the window.
+/// @param dag Window of the job.
+/// @param out Buffer of the job's output file.
+void jobdag_run(JobDag *dag, OutBuf *out);
+
+#endif  // KVS_JOBDAG_H
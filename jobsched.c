@@ -0,0 +1,227 @@
+#include "jobsched.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEQUE_INITIAL_CAPACITY 16
+#define TIMERS_INITIAL_CAPACITY 64
+
+typedef struct WorkDeque {
+    pthread_mutex_t mutex;
+    void **tasks;                                                                   // Ring buffer
+    size_t capacity;
+    size_t head;                                                                    // Index of the front task
+    size_t count;
+} WorkDeque;
+
+// Task parked until a deadline.
+typedef struct Timer {
+    uint64_t deadline;                                                              // CLOCK_MONOTONIC, in milliseconds
+    uint64_t order;                                                                 // Parked first, woken first on the same deadline
+    void *task;
+} Timer;
+
+static WorkDeque *deques = NULL;
+static int num_workers = 0;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_wake;                                                    // Signaled on a push or a park, and when the last task is done
+static size_t queued = 0;                                                           // Tasks in the deques (idle_mutex)
+static size_t pending = 0;                                                          // Tasks pushed and not done yet, parked ones included (idle_mutex)
+static Timer *timers = NULL;                                                        // Min-heap by deadline (idle_mutex)
+static size_t num_timers = 0;
+static size_t timers_capacity = 0;
+static uint64_t timers_parked = 0;
+
+static uint64_t now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static int timer_before(const Timer *a, const Timer *b) {
+    return a->deadline < b->deadline || (a->deadline == b->deadline && a->order < b->order);
+}
+
+int jobsched_start(int workers) {
+    deques = calloc((size_t)workers, sizeof(WorkDeque));
+    if (deques == NULL) {
+        return 1;
+    }
+    pthread_condattr_t attr;                                                        // Timed waits on the monotonic clock, like the deadlines
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&idle_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_init(&deques[w].mutex, NULL);
+    }
+    num_workers = workers;
+    queued = 0;
+    pending = 0;
+    return 0;
+}
+
+void jobsched_stop(void) {
+    if (deques == NULL) {                                                           // Never started: idle_wake was not initialized
+        return;
+    }
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_destroy(&deques[w].mutex);
+        free(deques[w].tasks);
+    }
+    free(deques);
+    deques = NULL;
+    num_workers = 0;
+    pthread_cond_destroy(&idle_wake);
+    free(timers);
+    timers = NULL;
+    num_timers = 0;
+    timers_capacity = 0;
+}
+
+// Doubles the ring of a deque, its tasks moved to the start. Returns 0 on success.
+static int grow(WorkDeque *deque) {
+    size_t capacity = deque->capacity > 0 ? deque->capacity * 2 : DEQUE_INITIAL_CAPACITY;
+    void **tasks = malloc(capacity * sizeof(void *));
+    if (tasks == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < deque->count; i++) {
+        tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->capacity = capacity;
+    deque->head = 0;
+    return 0;
+}
+
+int jobsched_push(int worker, void *task, int front) {
+    WorkDeque *deque = &deques[worker];
+    pthread_mutex_lock(&idle_mutex);                                                // Counted before a thief can take it and call done
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == deque->capacity && grow(deque) != 0) {
+        pthread_mutex_unlock(&deque->mutex);
+        pthread_mutex_unlock(&idle_mutex);
+        return 1;
+    }
+    if (front) {
+        deque->head = (deque->head + deque->capacity - 1) % deque->capacity;
+        deque->tasks[deque->head] = task;
+    } else {
+        deque->tasks[(deque->head + deque->count) % deque->capacity] = task;
+    }
+    deque->count++;
+    pthread_mutex_unlock(&deque->mutex);
+    queued++;
+    pending++;
+    pthread_cond_broadcast(&idle_wake);
+    pthread_mutex_unlock(&idle_mutex);
+    return 0;
+}
+
+// Takes the front task of a deque, NULL if it is empty.
+static void *take_front(WorkDeque *deque) {
+    void *task = NULL;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count > 0) {
+        task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return task;
+}
+
+// Takes the parked task whose deadline passed first, NULL if none did yet.
+// Called with idle_mutex held.
+static void *take_due_timer(uint64_t now) {
+    if (num_timers == 0 || timers[0].deadline > now) {
+        return NULL;
+    }
+    void *task = timers[0].task;
+    Timer last = timers[--num_timers];
+    size_t i = 0;
+    for (;;) {                                                                      // Sift the last timer down from the root
+        size_t child = 2 * i + 1;
+        if (child >= num_timers) {
+            break;
+        }
+        if (child + 1 < num_timers && timer_before(&timers[child + 1], &timers[child])) {
+            child++;
+        }
+        if (!timer_before(&timers[child], &last)) {
+            break;
+        }
+        timers[i] = timers[child];
+        i = child;
+    }
+    timers[i] = last;
+    return task;
+}
+
+int jobsched_defer(void *task, unsigned int delay_ms) {
+    pthread_mutex_lock(&idle_mutex);
+    if (num_timers == timers_capacity) {
+        size_t capacity = timers_capacity > 0 ? timers_capacity * 2 : TIMERS_INITIAL_CAPACITY;
+        Timer *grown = realloc(timers, capacity * sizeof(Timer));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&idle_mutex);
+            return 1;
+        }
+        timers = grown;
+        timers_capacity = capacity;
+    }
+    Timer timer = { now_ms() + delay_ms, timers_parked++, task };
+    size_t i = num_timers++;
+    while (i > 0 && timer_before(&timer, &timers[(i - 1) / 2])) {                  // Sift up
+        timers[i] = timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    timers[i] = timer;
+    pthread_cond_broadcast(&idle_wake);                                             // Sleeping workers wait for the new earliest deadline
+    pthread_mutex_unlock(&idle_mutex);
+    return 0;
+}
+
+void *jobsched_next(int worker) {
+    for (;;) {
+        pthread_mutex_lock(&idle_mutex);
+        void *task = take_due_timer(now_ms());                                      // Woken tasks waited already, they go first
+        pthread_mutex_unlock(&idle_mutex);
+        if (task != NULL) {
+            return task;
+        }
+        task = take_front(&deques[worker]);
+        for (int i = 1; task == NULL && i < num_workers; i++) {                     // Steal, starting with the next worker
+            task = take_front(&deques[(worker + i) % num_workers]);
+        }
+        pthread_mutex_lock(&idle_mutex);
+        if (task != NULL) {
+            queued--;
+            pthread_mutex_unlock(&idle_mutex);
+            return task;
+        }
+        if (pending == 0) {                                                         // Nothing queued or running: no task can appear
+            pthread_mutex_unlock(&idle_mutex);
+            return NULL;
+        }
+        if (queued == 0 && num_timers > 0) {                                        // Sleep until the earliest parked task is due
+            struct timespec deadline = { (time_t)(timers[0].deadline / 1000), (long)(timers[0].deadline % 1000) * 1000000 };
+            pthread_cond_timedwait(&idle_wake, &idle_mutex, &deadline);
+        } else if (queued == 0) {                                                   // Only running tasks left, they may push some
+            pthread_cond_wait(&idle_wake, &idle_mutex);
+        }
+        pthread_mutex_unlock(&idle_mutex);
+    }
+}
+
+void jobsched_done(void) {
+    pthread_mutex_lock(&idle_mutex);
+    if (--pending == 0) {
+        pthread_cond_broadcast(&idle_wake);
+    }
+    pthread_mutex_unlock(&idle_mutex);
+}
@@ -0,0 +1,45 @@
+#ifndef KVS_JOBSCHED_H
+#define KVS_JOBSCHED_H
+
+// Work-stealing scheduler of the job threads. Each worker has its own deque of
+// tasks, guarded by its own lock, and takes tasks from its front. A worker whose
+// deque is empty steals from the front of another worker's deque, so no worker is
+// idle while another one still has tasks queued. The jobs are dealt out largest first
+// at the back of the deques. A large job split into segments while running has its
+// segments pushed at the front of its worker's deque, where idle workers find them
+// first. A task that has to wait (a job at a WAIT) is parked on a timer heap instead of
+// holding its worker: once its deadline passes, the next worker looking for a task
+// takes it before any queued one.
+
+/// Creates the deques of the workers.
+/// @param workers Number of job threads.
+/// @return 0 if the scheduler was started successfully, 1 otherwise.
+int jobsched_start(int workers);
+
+/// Frees the deques. No worker may be using the scheduler anymore.
+void jobsched_stop(void);
+
+/// Queues a task in a worker's deque. It is pending until jobsched_done is called for it.
+/// @param worker Deque to push to.
+/// @param task Task to queue.
+/// @param front Push at the front (taken next) instead of the back.
+/// @return 0 if the task was queued successfully, 1 otherwise.
+int jobsched_push(int worker, void *task, int front);
+
+/// Takes the next task of a worker: from its own deque, or stolen from another one.
+/// Waits while other workers still run tasks that may push new ones.
+/// @param worker Calling worker.
+/// @return The task, NULL once every task pushed is done.
+void *jobsched_next(int worker);
+
+/// Tells the scheduler that a task returned by jobsched_next is finished.
+void jobsched_done(void);
+
+/// Parks a task returned by jobsched_next until a delay passes, instead of calling
+/// jobsched_done. jobsched_next returns it again after the delay.
+/// @param task Task to park.
+/// @param delay_ms Delay in milliseconds.
+/// @return 0 if the task was parked successfully, 1 otherwise (the caller keeps it).
+int jobsched_defer(void *task, unsigned int delay_ms);
+
+#endif  // KVS_JOBSCHED_H
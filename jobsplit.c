@@ -0,0 +1,114 @@
+#include "jobsplit.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyset.h"
+#include "parser.h"
+#include "reader.h"
+
+// Segments being planned: the offset where each one starts and its first command.
+typedef struct SegmentPlan {
+    size_t *starts;
+    size_t *first_commands;
+    size_t count;
+    size_t capacity;
+} SegmentPlan;
+
+static int add_segment(SegmentPlan *plan, size_t start, size_t command) {
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity > 0 ? plan->capacity * 2 : 16;
+        size_t *starts = realloc(plan->starts, capacity * sizeof(size_t));
+        if (starts != NULL) {
+            plan->starts = starts;
+        }
+        size_t *first_commands = realloc(plan->first_commands, capacity * sizeof(size_t));
+        if (first_commands != NULL) {
+            plan->first_commands = first_commands;
+        }
+        if (starts == NULL || first_commands == NULL) {
+            return 1;
+        }
+        plan->capacity = capacity;
+    }
+    plan->starts[plan->count] = start;
+    plan->first_commands[plan->count] = command;
+    plan->count++;
+    return 0;
+}
+
+size_t job_split(int fd, size_t segment_bytes, size_t **offsets) {
+    Reader *reader = malloc(sizeof(Reader));
+    SegmentPlan plan = { NULL, NULL, 0, 0 };
+    KeySet set;                                                                     // Command that last used each key
+    CommandArgs args;
+    command_args_init(&args);
+    keyset_init(&set);
+    int failed = reader == NULL || add_segment(&plan, 0, 0) != 0;
+    int whole = 0;                                                                  // The job sees the whole table
+
+    size_t index = 0;                                                               // Commands parsed so far
+    if (!failed) {
+        reader_init(reader, fd);
+    }
+    while (!failed && !whole) {
+        size_t offset = reader_offset(reader);
+        if (offset - plan.starts[plan.count - 1] >= segment_bytes) {                // The last segment is large enough
+            failed = add_segment(&plan, offset, index);
+        }
+        enum Command command = parse_command(reader, &args);
+        if (command == EOC) {
+            break;
+        }
+        switch (command) {
+            case CMD_WRITE:
+            case CMD_WRITE_TTL:
+            case CMD_READ:
+            case CMD_DELETE:
+                for (size_t i = 0; i < args.num_pairs && !failed; i++) {
+                    size_t previous = keyset_use(&set, &args.keys[i], index);
+                    failed = previous == SIZE_MAX;
+                    while (!failed && plan.first_commands[plan.count - 1] > previous) {    // Merge the segments since the key's last use
+                        plan.count--;
+                    }
+                }
+                break;
+            case CMD_SHOW:
+            case CMD_STATS:
+            case CMD_READ_RANGE:
+            case CMD_BACKUP:
+                whole = 1;
+                break;
+            case CMD_WAIT:
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+            case EOC:
+                break;
+        }
+        index++;
+    }
+
+    size_t segments = 0;
+    if (!failed) {
+        size_t end = whole ? 0 : reader_offset(reader);
+        if (whole) {
+            plan.count = 1;
+        } else if (plan.count > 1 && plan.starts[plan.count - 1] == end) {         // Cut right at the end of the file
+            plan.count--;
+        }
+        *offsets = malloc((plan.count + 1) * sizeof(size_t));
+        if (*offsets != NULL) {
+            memcpy(*offsets, plan.starts, plan.count * sizeof(size_t));
+            (*offsets)[plan.count] = whole ? SIZE_MAX : end;                        // Not read further when the job is whole
+            segments = plan.count;
+        }
+    }
+    free(reader);
+    command_args_free(&args);
+    keyset_free(&set);
+    free(plan.starts);
+    free(plan.first_commands);
+    return segments;
+}
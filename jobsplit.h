@@ -0,0 +1,22 @@
+#ifndef KVS_JOBSPLIT_H
+#define KVS_JOBSPLIT_H
+
+#include <stddef.h>
+
+// A large text job can be run as several segments at once when they cannot see each
+// other: a segment is a run of whole commands, and no key is used by two segments.
+// A new segment is started at the first command boundary after the current one
+// reaches segment_bytes. When a command uses a key that an earlier segment used, every
+// segment since that use is merged back into it, so segments only end where the
+// keys change. Jobs with SHOW, STATS, READ_RANGE or BACKUP, which see the whole
+// table, are never split.
+
+/// Plans the segments of a text job, parsing the whole file once.
+/// @param fd Job file, read from its current offset (where offsets are counted from).
+/// @param segment_bytes Smallest size of a segment.
+/// @param offsets Receives, with malloc, the offset where each segment starts followed
+///        by the offset where the last one ends (SIZE_MAX for a job that is not split).
+/// @return Number of segments (1 if the job is not split), 0 on failure.
+size_t job_split(int fd, size_t segment_bytes, size_t **offsets);
+
+#endif  // KVS_JOBSPLIT_H
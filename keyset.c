@@ -0,0 +1,81 @@
+#include "keyset.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t hash_key(const Span *key) {
+    uint64_t h = 0xCBF29CE484222325ULL;                                             // FNV-1a
+    for (size_t i = 0; i < key->length; i++) {
+        h = (h ^ (uint8_t)key->data[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static KeySlot *find_slot(KeySlot *slots, size_t capacity, const char *key, uint64_t hash) {
+    size_t i = (size_t)hash & (capacity - 1);
+    while (slots[i].key != NULL && (slots[i].hash != hash || strcmp(slots[i].key, key) != 0)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+static int grow_set(KeySet *set) {
+    size_t capacity = set->capacity > 0 ? set->capacity * 2 : KEY_SET_INITIAL_SLOTS;
+    KeySlot *slots = calloc(capacity, sizeof(KeySlot));
+    if (slots == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->slots[i].key != NULL) {
+            *find_slot(slots, capacity, set->slots[i].key, set->slots[i].hash) = set->slots[i];
+        }
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+    return 0;
+}
+
+void keyset_init(KeySet *set) {
+    set->slots = NULL;
+    set->capacity = 0;
+    set->count = 0;
+    arena_init(&set->keys);
+}
+
+size_t keyset_use(KeySet *set, const Span *key, size_t command) {
+    if (2 * (set->count + 1) > set->capacity && grow_set(set) != 0) {               // At most half full
+        return SIZE_MAX;
+    }
+    uint64_t hash = hash_key(key);
+    KeySlot *slot = find_slot(set->slots, set->capacity, key->data, hash);
+    if (slot->key != NULL) {
+        size_t previous = slot->command;
+        slot->command = command;
+        return previous;
+    }
+    size_t length = key->length + 1;
+    char *copy = arena_reserve(&set->keys, length);
+    if (copy == NULL) {
+        return SIZE_MAX;
+    }
+    memcpy(copy, key->data, length);
+    arena_commit(&set->keys, length);
+    *slot = (KeySlot){ copy, hash, command };
+    set->count++;
+    return command;
+}
+
+void keyset_reset(KeySet *set) {
+    if (set->count > 0) {
+        memset(set->slots, 0, set->capacity * sizeof(KeySlot));
+    }
+    set->count = 0;
+    arena_reset(&set->keys);
+}
+
+void keyset_free(KeySet *set) {
+    free(set->slots);
+    arena_free(&set->keys);
+    keyset_init(set);
+}
@@ -0,0 +1,47 @@
+#ifndef KVS_KEYSET_H
+#define KVS_KEYSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "span.h"
+
+#define KEY_SET_INITIAL_SLOTS 1024                                                  // Power of two
+
+typedef struct KeySlot {
+    const char *key;                                                                // NULL for an empty slot
+    uint64_t hash;
+    size_t command;
+} KeySlot;
+
+// Command of a job that last used each key, in an open-addressing table. Used to find
+// which commands of a job depend on each other (job splitting, parallel commands).
+// Used by one thread at a time.
+typedef struct KeySet {
+    KeySlot *slots;
+    size_t capacity;
+    size_t count;
+    Arena keys;                                                                     // Copies of the keys, kept until the reset
+} KeySet;
+
+/// Starts an empty set (no slot is allocated until the first key).
+/// @param set Set to initialize.
+void keyset_init(KeySet *set);
+
+/// Records that a key is used by a command.
+/// @param set Set of keys.
+/// @param key Key used.
+/// @param command Command using it.
+/// @return The command that used the key before (command itself for a new key),
+///         SIZE_MAX if out of memory.
+size_t keyset_use(KeySet *set, const Span *key, size_t command);
+
+/// Forgets every key, keeping the memory.
+/// @param set Set to reset.
+void keyset_reset(KeySet *set);
+
+/// Frees the memory of the set.
+/// @param set Set to free.
+void keyset_free(KeySet *set);
+
+#endif  // KVS_KEYSET_H
@@ -1,117 +1,1273 @@
-#include <ctype.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
 #include "kvs.h"
 #include "string.h"
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
+static KeyNode moved_marker;                                                        // Stored in old_table buckets that were already migrated
+#define MOVED (&moved_marker)
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// 64-bit string hash, mixing the key eight bytes at a time (murmur3-style rounds
+// followed by the murmur3 finalizer, so the low bits used for indexing are well spread).
+// @param key Bytes of the key.
+// @param len Number of bytes.
 // @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+static uint64_t hash_bytes(const char *key, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        h ^= rotl64(word * 0x87C37B91114253D5ULL, 31) * 0x4CF5AD432745937FULL;
+        h = rotl64(h, 27) * 5 + 0x52DCE729;
+    }
+    uint64_t tail = 0;                                                              // Remaining (len % 8) bytes
+    memcpy(&tail, key + i, len - i);
+    h ^= rotl64(tail * 0x87C37B91114253D5ULL, 31) * 0x4CF5AD432745937FULL;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Hash of a null-terminated key (see hash_bytes).
+static inline uint64_t hash(const char *key) {
+    return hash_bytes(key, strlen(key));
+}
+
+// Index of the lock protecting every bucket a hash can be placed in.
+static inline size_t stripe_of(uint64_t h) {
+    return (size_t)(h & (LOCK_STRIPES - 1));
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+// Tells whether the deadline of a pair passed. The clock is only read for pairs with a TTL.
+static inline int is_expired(const KeyNode *keyNode) {
+    return keyNode->expires_at != 0 && keyNode->expires_at <= monotonic_ms();
+}
+
+size_t key_stripe(const Span *key) {
+    return stripe_of(hash_bytes(key->data, key->length));
+}
+
+// Returns the bucket currently holding the given hash. Must be called with its lock held.
+static KeyNode **find_bucket(HashTable *ht, uint64_t h) {
+    if (ht->old_table != NULL) {
+        KeyNode **old_bucket = &ht->old_table[h & (ht->old_size - 1)];
+        if (*old_bucket != MOVED) {                                                 // Not migrated yet
+            return old_bucket;
+        }
+    }
+    return &ht->table[h & (ht->size - 1)];
+}
+
+// Takes a node from the pool, allocating a new slab when there is no free node.
+// Must be called with the pool's lock held for writing.
+static KeyNode *alloc_node(NodePool *pool) {
+    if (pool->free_list != NULL) {                                                  // Reuse a released node
+        KeyNode *keyNode = pool->free_list;
+        pool->free_list = keyNode->next;
+        return keyNode;
+    }
+
+    Slab *slab = pool->slabs;
+    if (slab == NULL || slab->used == slab->capacity) {                             // Current slab is full
+        size_t capacity = slab == NULL ? MIN_SLAB_NODES : slab->capacity * 2;
+        if (capacity > MAX_SLAB_NODES) {
+            capacity = MAX_SLAB_NODES;
+        }
+        if (pool->max_nodes != 0 && capacity > pool->max_nodes - pool->capacity) { // Never allocate past the limit
+            capacity = pool->max_nodes - pool->capacity;
+        }
+        slab = malloc(sizeof(Slab) + capacity * sizeof(KeyNode));
+        if (slab == NULL) {
+            return NULL;
+        }
+        slab->capacity = capacity;
+        slab->used = 0;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->capacity += capacity;
+    }
+    return &slab->nodes[slab->used++];
+}
+
+// Returns a node to the pool's free list. Must be called with the pool's lock held for writing.
+static void release_node(NodePool *pool, KeyNode *keyNode) {
+    keyNode->next = pool->free_list;
+    pool->free_list = keyNode;
+}
+
+// Node the CLOCK hand of a pool would evict: the first live node that is expired or
+// has no referenced bit, starting from the hand and wrapping around the slabs. Nodes
+// passed over lose their bit, so at most two rounds are needed. The pool must have live nodes.
+static KeyNode *clock_victim(NodePool *pool) {
+    for (;;) {
+        if (pool->hand_slab == NULL || pool->hand >= pool->hand_slab->used) {      // Next slab, or back to the first one
+            pool->hand_slab = pool->hand_slab == NULL || pool->hand_slab->next == NULL ? pool->slabs : pool->hand_slab->next;
+            pool->hand = 0;
+            continue;
+        }
+        KeyNode *keyNode = &pool->hand_slab->nodes[pool->hand++];
+        if (!keyNode->live) {                                                       // On the free list
+            continue;
+        }
+        if (__atomic_load_n(&keyNode->referenced, __ATOMIC_RELAXED) && !is_expired(keyNode)) {
+            __atomic_store_n(&keyNode->referenced, 0, __ATOMIC_RELAXED);           // Second chance
+            continue;
+        }
+        return keyNode;
     }
-    return -1;                                                                      // Invalid index for non-alphabetic or number strings
 }
 
 // Creates a new hash table.
-struct HashTable* create_hash_table() {
-  HashTable *ht = malloc(sizeof(HashTable));                                        // Allocate memory for the hash table
+struct HashTable* create_hash_table(const TableConfig *config) {
+  HashTable *ht = calloc(1, sizeof(HashTable));                                     // Allocate memory for the hash table (all fields zeroed)
   if (!ht) return NULL;
-  for (int i = 0; i < TABLE_SIZE; i++) {
-      ht->table[i] = NULL;
-      pthread_mutex_init(&ht->list_mutex[i], NULL);
+  ht->engine = config->engine;
+  ht->size = INITIAL_TABLE_SIZE;
+  for (int i = 0; i < LOCK_STRIPES; i++) {
+      pthread_rwlock_init(&ht->list_lock[i], NULL);
+      if (config->memory_limit != 0) {                                              // Each stripe gets an equal share, at least one node
+          size_t max_nodes = config->memory_limit / LOCK_STRIPES / sizeof(KeyNode);
+          ht->pools[i].max_nodes = max_nodes > 0 ? max_nodes : 1;
+      }
   }
+  pthread_rwlock_init(&ht->index_lock, NULL);
   pthread_mutex_init(&ht->table_mutex, NULL);
+  pthread_mutex_init(&ht->snapshot_mutex, NULL);
+  pthread_cond_init(&ht->snapshot_free, NULL);
+  ht->delta_floor = UINT64_MAX;                                                     // No chain open, removals leave no tombstone
+
+  int failed = 0;
+  if (ht->engine == ENGINE_CHAINED) {
+      ht->table = calloc(INITIAL_TABLE_SIZE, sizeof(KeyNode *));
+      failed = ht->table == NULL;
+  } else {
+      for (int i = 0; i < LOCK_STRIPES && !failed; i++) {
+          failed = flat_init(&ht->flat[i]);
+      }
+  }
+  if (!failed && config->ordered_index) {
+      ht->index = malloc(sizeof(SkipList));
+      if (ht->index == NULL || skiplist_init(ht->index) != 0) {
+          free(ht->index);
+          ht->index = NULL;
+          failed = 1;
+      }
+  }
+  if (failed) {
+      free_table(ht);                                                               // Releases whatever was allocated
+      return NULL;
+  }
   return ht;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    pthread_mutex_lock(&ht->list_mutex[index]);
+void lock_table(HashTable *ht) {
+    for (int i = 0; i < LOCK_STRIPES; i++) {                                        // Always in ascending order
+        pthread_rwlock_wrlock(&ht->list_lock[i]);
+    }
+}
 
+// Locks every bucket of the hash table for reading.
+static void read_lock_table(HashTable *ht) {
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        pthread_rwlock_rdlock(&ht->list_lock[i]);
+    }
+}
+
+void unlock_table(HashTable *ht) {
+    for (int i = LOCK_STRIPES - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&ht->list_lock[i]);
+    }
+}
+
+// Bucket count the table should have for its current number of pairs
+// (grows above a load factor of 1, shrinks below 1/8 down to min_size).
+static size_t target_size(size_t count, size_t size, size_t min_size) {
+    if (size < min_size) {
+        return min_size;
+    }
+    if (count > size) {
+        return size * 2;
+    }
+    if (count < size / 8 && size > INITIAL_TABLE_SIZE && size > min_size) {
+        return size / 2;
+    }
+    return size;
+}
+
+// Starts a resize when the load factor is out of bounds. Only swaps the arrays;
+// the pairs are moved afterwards, a few buckets at a time, by rehash_step.
+static void maybe_resize(HashTable *ht) {
+    if (ht->engine != ENGINE_CHAINED) {                                             // Flat tables grow on insert
+        return;
+    }
+    if (__atomic_load_n(&ht->old_table, __ATOMIC_ACQUIRE) != NULL) {               // A resize is already in progress
+        return;
+    }
+    size_t size = __atomic_load_n(&ht->size, __ATOMIC_RELAXED);
+    size_t new_size = target_size(__atomic_load_n(&ht->count, __ATOMIC_RELAXED), size, ht->min_size);
+    if (new_size == size) {
+        return;
+    }
+
+    KeyNode **new_table = calloc(new_size, sizeof(KeyNode *));                      // Allocated before taking the locks
+    if (new_table == NULL) {
+        return;                                                                     // Keep the current array
+    }
+
+    lock_table(ht);
+    if (ht->old_table == NULL && ht->size == size && target_size(ht->count, ht->size, ht->min_size) == new_size) {
+        ht->old_size = ht->size;
+        __atomic_store_n(&ht->rehash_index, 0, __ATOMIC_RELAXED);                  // Claimed concurrently by rehash_step
+        __atomic_store_n(&ht->rehash_done, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ht->size, new_size, __ATOMIC_RELAXED);
+        __atomic_store_n(&ht->old_table, ht->table, __ATOMIC_RELEASE);
+        ht->table = new_table;
+        new_table = NULL;
+    }
+    unlock_table(ht);
+    free(new_table);                                                                // Someone else resized first
+}
+
+// Releases old_table once all of its buckets were migrated.
+static void finish_rehash(HashTable *ht) {
+    lock_table(ht);
+    KeyNode **old_table = ht->old_table;
+    __atomic_store_n(&ht->old_table, NULL, __ATOMIC_RELEASE);
+    ht->old_size = 0;
+    unlock_table(ht);
+    free(old_table);
+}
+
+// Migrates up to REHASH_STEP buckets of old_table, holding one bucket lock at a time,
+// so a resize never blocks readers and writers of the other buckets.
+static void rehash_step(HashTable *ht) {
+    for (int step = 0; step < REHASH_STEP; step++) {
+        if (__atomic_load_n(&ht->old_table, __ATOMIC_ACQUIRE) == NULL) {
+            return;
+        }
+        size_t index = __sync_fetch_and_add(&ht->rehash_index, 1);                 // Claim an old bucket
+        pthread_rwlock_t *lock = &ht->list_lock[index & (LOCK_STRIPES - 1)];
+
+        pthread_rwlock_wrlock(lock);
+        if (ht->old_table == NULL || index >= ht->old_size || ht->old_table[index] == MOVED) {
+            pthread_rwlock_unlock(lock);                                            // Nothing left to migrate
+            return;
+        }
+        KeyNode *keyNode = ht->old_table[index];
+        while (keyNode != NULL) {                                                   // Same lock guards the target buckets
+            KeyNode *next = keyNode->next;
+            KeyNode **bucket = &ht->table[keyNode->hash & (ht->size - 1)];
+            keyNode->next = *bucket;
+            *bucket = keyNode;
+            keyNode = next;
+        }
+        ht->old_table[index] = MOVED;
+        size_t old_size = ht->old_size;
+        pthread_rwlock_unlock(lock);
+
+        if (__sync_add_and_fetch(&ht->rehash_done, 1) == old_size) {                // Last bucket migrated
+            finish_rehash(ht);
+            return;
+        }
+    }
+}
+
+// Finds the node of a key. Must be called with the key's lock held.
+static KeyNode *lookup(HashTable *ht, size_t stripe, uint64_t h, const char *key) {
+    if (ht->engine == ENGINE_FLAT) {
+        return flat_find(&ht->flat[stripe], h, key);
+    }
+    KeyNode *keyNode = *find_bucket(ht, h);
     while (keyNode != NULL) {                                                       // Search for the key node
-        if (strcmp(keyNode->key, key) == 0) {
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            pthread_mutex_unlock(&ht->list_mutex[index]);
-            return 0;
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            break;
         }
         keyNode = keyNode->next;                                                    // Move to the next node
     }
+    return keyNode;
+}
 
-    keyNode = malloc(sizeof(KeyNode));                                              // Key not found, create a new key node
-    keyNode->key = strdup(key);                                                     // Allocate memory for the key
-    keyNode->value = strdup(value);                                                 // Allocate memory for the value
-    keyNode->next = ht->table[index];                                               // Link to existing nodes
-    ht->table[index] = keyNode;                                                     // Place new key node at the start of the list
-    pthread_mutex_unlock(&ht->list_mutex[index]);
+// Adds a node whose key is not in the table. Must be called with its lock held for writing.
+static int link_node(HashTable *ht, size_t stripe, KeyNode *keyNode) {
+    if (ht->engine == ENGINE_FLAT) {
+        return flat_insert(&ht->flat[stripe], keyNode);
+    }
+    KeyNode **bucket = find_bucket(ht, keyNode->hash);
+    keyNode->next = *bucket;                                                        // Link to existing nodes
+    *bucket = keyNode;                                                              // Place new key node at the start of the list
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    pthread_mutex_lock(&ht->list_mutex[index]);
-    char* value = NULL;                                                             // Initialize value to NULL
+// Removes the node of a key and returns it (NULL if missing). Must be called with its lock held for writing.
+static KeyNode *unlink_node(HashTable *ht, size_t stripe, uint64_t h, const char *key) {
+    if (ht->engine == ENGINE_FLAT) {
+        return flat_erase(&ht->flat[stripe], h, key);
+    }
+    KeyNode **link = find_bucket(ht, h);                                            // Link that points to the current node
+    while (*link != NULL) {                                                         // Search for the key node
+        KeyNode *keyNode = *link;
+        if (keyNode->hash == h && strcmp(keyNode->key, key) == 0) {
+            *link = keyNode->next;                                                  // Bypass the node
+            return keyNode;
+        }
+        link = &keyNode->next;                                                      // Move to the next node
+    }
+    return NULL;
+}
+
+// Adds a new node to the ordered index, if there is one. Must be called with its lock held for writing.
+static int index_insert(HashTable *ht, KeyNode *keyNode) {
+    if (ht->index == NULL) {
+        return 0;
+    }
+    pthread_rwlock_wrlock(&ht->index_lock);
+    int result = skiplist_insert(ht->index, keyNode);
+    pthread_rwlock_unlock(&ht->index_lock);
+    return result;
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            break;                                                                  // Exit the loop once the key is found
+// Removes a key from the ordered index, if there is one. Must be called with its lock held for writing.
+static void index_remove(HashTable *ht, const char *key) {
+    if (ht->index == NULL) {
+        return;
+    }
+    pthread_rwlock_wrlock(&ht->index_lock);
+    skiplist_remove(ht->index, key);
+    pthread_rwlock_unlock(&ht->index_lock);
+}
+
+// Saves the contents of a node for the open snapshots that still see them and did not
+// copy its stripe yet. Called before the node is changed or released, with its lock
+// held for writing.
+static void preserve(HashTable *ht, size_t stripe, const KeyNode *keyNode) {
+    uint32_t active = __atomic_load_n(&ht->active_snapshots, __ATOMIC_ACQUIRE);
+    for (; active != 0; active &= active - 1) {
+        Snapshot *snapshot = &ht->snapshots[__builtin_ctz(active)];
+        if (keyNode->version > snapshot->version || snapshot->copied[stripe]) {     // Written after the snapshot, or already copied
+            continue;
         }
-        keyNode = keyNode->next;                                                    // Move to the next node
+        PreservedPair *pair = malloc(sizeof(PreservedPair));
+        if (pair == NULL) {
+            __atomic_store_n(&snapshot->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        pair->expires_at = keyNode->expires_at;
+        pair->version = keyNode->version;
+        strcpy(pair->key, keyNode->key);
+        strcpy(pair->value, keyNode->value);
+        pair->next = snapshot->preserved[stripe];
+        snapshot->preserved[stripe] = pair;
     }
-    pthread_mutex_unlock(&ht->list_mutex[index]);
-    return value;                                                                   // Key not found
+}
+
+// Frees the tombstones of a stripe that no delta chain needs anymore (the list is
+// newest first). Must be called with the stripe's lock held for writing.
+static void prune_tombstones(HashTable *ht, size_t stripe, uint64_t floor) {
+    Tombstone **link = &ht->tombstones[stripe];
+    while (*link != NULL && (*link)->version > floor) {
+        link = &(*link)->next;
+    }
+    Tombstone *tombstone = *link;
+    *link = NULL;
+    while (tombstone != NULL) {
+        Tombstone *next = tombstone->next;
+        free(tombstone);
+        tombstone = next;
+    }
+}
+
+// Remembers the removal of a key while a delta chain is open. Must be called with the
+// key's lock held for writing.
+static void record_removal(HashTable *ht, size_t stripe, const char *key) {
+    uint64_t floor = __atomic_load_n(&ht->delta_floor, __ATOMIC_ACQUIRE);
+    if (floor == UINT64_MAX) {                                                      // No chain open
+        if (ht->tombstones[stripe] != NULL) {
+            prune_tombstones(ht, stripe, floor);
+        }
+        return;
+    }
+    Tombstone *tombstone = malloc(sizeof(Tombstone));
+    if (tombstone == NULL) {                                                        // The open chains cannot see this removal
+        pthread_mutex_lock(&ht->snapshot_mutex);
+        for (DeltaBase *base = ht->delta_bases; base != NULL; base = base->next) {
+            base->broken = 1;
+        }
+        pthread_mutex_unlock(&ht->snapshot_mutex);
+        return;
+    }
+    tombstone->version = ht->epoch;
+    strcpy(tombstone->key, key);
+    tombstone->next = ht->tombstones[stripe];
+    ht->tombstones[stripe] = tombstone;
+    prune_tombstones(ht, stripe, floor);
+}
+
+// Deletes the pair of a key that hashes to h. Must be called with the key's lock held for writing.
+static int remove_locked(HashTable *ht, size_t stripe, uint64_t h, const char *key) {
+    KeyNode *keyNode = unlink_node(ht, stripe, h, key);
+    if (keyNode == NULL) {
+        return 1;
+    }
+    int expired = is_expired(keyNode);                                              // Reclaimed all the same, but it was not visible
+    preserve(ht, stripe, keyNode);
+    record_removal(ht, stripe, key);
+    index_remove(ht, key);                                                          // Before the node can be reused
+    keyNode->live = 0;
+    ht->pools[stripe].live--;
+    release_node(&ht->pools[stripe], keyNode);                                      // Back to the stripe's free list
+    __sync_fetch_and_sub(&ht->count, 1);
+    return expired;
+}
+
+// Writes a pair whose key hashes to h. Must be called with the key's lock held for writing.
+static int store_locked(HashTable *ht, size_t stripe, uint64_t h, const Span *key, const Span *value,
+                        uint64_t expires_at) {
+    if (key->length > MAX_STRING_SIZE || value->length > MAX_STRING_SIZE) {         // Keys and values are stored inline
+        return 1;
+    }
+
+    KeyNode *keyNode = lookup(ht, stripe, h, key->data);
+    if (keyNode != NULL) {                                                          // Key found, replace the value
+        preserve(ht, stripe, keyNode);
+        memcpy(keyNode->value, value->data, value->length + 1);
+        keyNode->expires_at = expires_at;
+        keyNode->version = ht->epoch;
+        __atomic_store_n(&keyNode->referenced, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    NodePool *pool = &ht->pools[stripe];
+    if (pool->max_nodes != 0 && pool->live >= pool->max_nodes) {                    // Stripe is full, make room for the new key
+        KeyNode *victim = clock_victim(pool);
+        remove_locked(ht, stripe, victim->hash, victim->key);
+        pool->evictions++;
+    }
+    if ((keyNode = alloc_node(pool)) == NULL) {                                     // Key not found, create a new key node
+        return 1;
+    }
+    keyNode->hash = h;
+    keyNode->expires_at = expires_at;
+    keyNode->version = ht->epoch;
+    memcpy(keyNode->key, key->data, key->length + 1);
+    memcpy(keyNode->value, value->data, value->length + 1);
+    if (link_node(ht, stripe, keyNode) != 0) {
+        release_node(&ht->pools[stripe], keyNode);
+        return 1;
+    }
+    if (index_insert(ht, keyNode) != 0) {
+        unlink_node(ht, stripe, h, key->data);
+        release_node(&ht->pools[stripe], keyNode);
+        return 1;
+    }
+    keyNode->live = 1;
+    keyNode->referenced = 1;
+    pool->live++;
+    __sync_fetch_and_add(&ht->count, 1);
+    return 0;
+}
+
+int write_pair(HashTable *ht, const char *key, const char *value) {
+    Span key_span = { key, strlen(key) };
+    Span value_span = { value, strlen(value) };
+    uint64_t h = hash_bytes(key, key_span.length);
+    size_t stripe = stripe_of(h);
+
+    pthread_rwlock_wrlock(&ht->list_lock[stripe]);
+    int result = store_locked(ht, stripe, h, &key_span, &value_span, 0);
+    pthread_rwlock_unlock(&ht->list_lock[stripe]);
+
+    rehash_step(ht);
+    maybe_resize(ht);
+    return result;
+}
+
+int read_pair(HashTable *ht, const char *key, char *value, size_t size) {
+    uint64_t h = hash(key);
+    size_t stripe = stripe_of(h);
+    pthread_rwlock_t *lock = &ht->list_lock[stripe];
+    int result = 1;
+
+    pthread_rwlock_rdlock(lock);                                                    // Readers never block each other
+    KeyNode *keyNode = lookup(ht, stripe, h, key);
+    if (keyNode != NULL && !is_expired(keyNode)) {
+        __atomic_store_n(&keyNode->referenced, 1, __ATOMIC_RELAXED);                // Readers only share the lock
+        size_t length = strnlen(keyNode->value, size - 1);
+        memcpy(value, keyNode->value, length);                                      // Copy while the bucket is protected
+        value[length] = '\0';
+        result = 0;
+    }
+    pthread_rwlock_unlock(lock);
+    return result;                                                                  // 1 if the key was not found
 }
 
 int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    uint64_t h = hash(key);
+    size_t stripe = stripe_of(h);
 
-    while (keyNode != NULL) {                                                       // Search for the key node
-        if (strcmp(keyNode->key, key) == 0) {
-            if (prevNode == NULL) {                                                 // Key found; delete this node
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next;                                   // Update the table to point to the next node
+    pthread_rwlock_wrlock(&ht->list_lock[stripe]);
+    int result = remove_locked(ht, stripe, h, key);
+    pthread_rwlock_unlock(&ht->list_lock[stripe]);
+
+    rehash_step(ht);
+    maybe_resize(ht);
+    return result;
+}
+
+// Locks of a batch: bit i of stripes[i / 64] is set when list_lock[i] is needed.
+// Each lock is taken once, in ascending order like lock_table, so batches cannot deadlock.
+typedef struct BatchLocks {
+    uint64_t stripes[(LOCK_STRIPES + 63) / 64];
+    uint64_t hashes[BATCH_HASHES];                                                  // Hashes of the first BATCH_HASHES keys
+} BatchLocks;
+
+static inline void mark_stripe(BatchLocks *locks, size_t stripe) {
+    locks->stripes[stripe / 64] |= 1ULL << (stripe % 64);
+}
+
+// Takes the locks marked in a batch, in ascending order.
+static void lock_marked(HashTable *ht, BatchLocks *locks, int write) {
+    for (size_t stripe = 0; stripe < LOCK_STRIPES; stripe++) {
+        if (locks->stripes[stripe / 64] & (1ULL << (stripe % 64))) {
+            if (write) {
+                pthread_rwlock_wrlock(&ht->list_lock[stripe]);
             } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next;                                     // Link the previous node to the next node
+                pthread_rwlock_rdlock(&ht->list_lock[stripe]);
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode);                                                          // Free the key node itself
-            return 0;                                                               // Exit the function
         }
-        prevNode = keyNode;                                                         // Move prevNode to current node
-        keyNode = keyNode->next;                                                    // Move to the next node
     }
-    
-    return 1;
+}
+
+// Hashes the keys of a batch and takes the locks they need, for reading or writing.
+static void lock_batch(HashTable *ht, BatchLocks *locks, size_t num_pairs, const Span *keys, int write) {
+    memset(locks->stripes, 0, sizeof(locks->stripes));
+    for (size_t i = 0; i < num_pairs; i++) {
+        uint64_t h = hash_bytes(keys[i].data, keys[i].length);
+        if (i < BATCH_HASHES) {
+            locks->hashes[i] = h;
+        }
+        mark_stripe(locks, stripe_of(h));
+    }
+    lock_marked(ht, locks, write);
+}
+
+static void unlock_batch(HashTable *ht, BatchLocks *locks) {
+    for (size_t stripe = LOCK_STRIPES; stripe-- > 0;) {
+        if (locks->stripes[stripe / 64] & (1ULL << (stripe % 64))) {
+            pthread_rwlock_unlock(&ht->list_lock[stripe]);
+        }
+    }
+}
+
+// Hash of the i-th key of a locked batch.
+static uint64_t batch_hash(const BatchLocks *locks, size_t i, const Span *key) {
+    return i < BATCH_HASHES ? locks->hashes[i] : hash_bytes(key->data, key->length);
+}
+
+int write_pairs_ttl(HashTable *ht, size_t num_pairs, const Span *keys, const Span *values, const uint64_t *expires_at) {
+    BatchLocks locks;
+    int result = 0;
+
+    lock_batch(ht, &locks, num_pairs, keys, 1);
+    for (size_t i = 0; i < num_pairs; i++) {                                        // In order, so the last write of a key wins
+        uint64_t h = batch_hash(&locks, i, &keys[i]);
+        if (store_locked(ht, stripe_of(h), h, &keys[i], &values[i], expires_at != NULL ? expires_at[i] : 0) != 0) {
+            result = 1;
+        }
+    }
+    if (ht->journal != NULL) {                                                      // Before another batch can touch the keys
+        ht->journal->write(ht->journal->arg, num_pairs, keys, values, expires_at);
+    }
+    unlock_batch(ht, &locks);
+
+    rehash_step(ht);
+    maybe_resize(ht);
+    return result;
+}
+
+int write_pairs(HashTable *ht, size_t num_pairs, const Span *keys, const Span *values) {
+    return write_pairs_ttl(ht, num_pairs, keys, values, NULL);
+}
+
+size_t expire_pairs(HashTable *ht, size_t num_pairs, const Span *keys, const uint64_t *expires_at) {
+    BatchLocks locks;
+    size_t removed = 0;
+
+    lock_batch(ht, &locks, num_pairs, keys, 1);
+    uint64_t now = monotonic_ms();
+    for (size_t i = 0; i < num_pairs; i++) {
+        uint64_t h = batch_hash(&locks, i, &keys[i]);
+        size_t stripe = stripe_of(h);
+        KeyNode *keyNode = lookup(ht, stripe, h, keys[i].data);
+        if (keyNode != NULL && keyNode->expires_at == expires_at[i] && expires_at[i] <= now) {
+            remove_locked(ht, stripe, h, keys[i].data);
+            ht->pools[stripe].expirations++;
+            removed++;
+        }
+    }
+    unlock_batch(ht, &locks);
+
+    rehash_step(ht);
+    maybe_resize(ht);
+    return removed;
+}
+
+// Value of a key read by read_pairs, copied so it is visited after the locks are released.
+typedef struct ReadSlot {
+    int found;
+    char value[MAX_STRING_SIZE + 1];
+} ReadSlot;
+
+int read_pairs(HashTable *ht, size_t num_pairs, const Span *keys,
+               void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    BatchLocks locks;
+    ReadSlot stack_slots[BATCH_HASHES];
+    ReadSlot *slots = stack_slots;
+    if (num_pairs > BATCH_HASHES) {
+        slots = malloc(num_pairs * sizeof(ReadSlot));                               // NULL: visited under the locks instead
+    }
+
+    lock_batch(ht, &locks, num_pairs, keys, 0);
+    for (size_t i = 0; i < num_pairs; i++) {
+        uint64_t h = batch_hash(&locks, i, &keys[i]);
+        KeyNode *keyNode = lookup(ht, stripe_of(h), h, keys[i].data);
+        if (keyNode != NULL && is_expired(keyNode)) {                               // Waiting to be reclaimed
+            keyNode = NULL;
+        }
+        if (keyNode != NULL) {
+            __atomic_store_n(&keyNode->referenced, 1, __ATOMIC_RELAXED);
+        }
+        if (slots == NULL) {
+            visit(keys[i].data, keyNode != NULL ? keyNode->value : NULL, arg);
+        } else {
+            slots[i].found = keyNode != NULL;
+            if (keyNode != NULL) {
+                strcpy(slots[i].value, keyNode->value);
+            }
+        }
+    }
+    unlock_batch(ht, &locks);
+
+    if (slots != NULL) {                                                            // visit may block writing out, with no lock held
+        for (size_t i = 0; i < num_pairs; i++) {
+            visit(keys[i].data, slots[i].found ? slots[i].value : NULL, arg);
+        }
+    }
+    if (slots != stack_slots) {
+        free(slots);
+    }
+    return 0;
+}
+
+int delete_pairs(HashTable *ht, size_t num_pairs, const Span *keys,
+                 void (*missing)(const char *key, void *arg), void *arg) {
+    BatchLocks locks;
+    int result = 0;
+
+    lock_batch(ht, &locks, num_pairs, keys, 1);
+    for (size_t i = 0; i < num_pairs; i++) {
+        uint64_t h = batch_hash(&locks, i, &keys[i]);
+        if (remove_locked(ht, stripe_of(h), h, keys[i].data) != 0) {
+            missing(keys[i].data, arg);
+            result = 1;
+        }
+    }
+    if (ht->journal != NULL) {
+        ht->journal->remove(ht->journal->arg, num_pairs, keys);
+    }
+    unlock_batch(ht, &locks);
+
+    rehash_step(ht);
+    maybe_resize(ht);
+    return result;
+}
+
+// Adds the nodes of a bucket array to nodes, skipping migrated buckets.
+static size_t collect_nodes(KeyNode **table, size_t size, KeyNode **nodes, size_t n) {
+    for (size_t i = 0; i < size; i++) {
+        if (table[i] == MOVED) {
+            continue;
+        }
+        for (KeyNode *keyNode = table[i]; keyNode != NULL; keyNode = keyNode->next) {
+            nodes[n++] = keyNode;
+        }
+    }
+    return n;
+}
+
+static int compare_nodes(const void *a, const void *b) {
+    const KeyNode *const *first = a;
+    const KeyNode *const *second = b;
+    return strcmp((*first)->key, (*second)->key);
+}
+
+// Pair copied out by foreach_pair, so it is visited after the locks are released.
+typedef struct PairCopy {
+    char key[MAX_STRING_SIZE + 1];
+    char value[MAX_STRING_SIZE + 1];
+} PairCopy;
+
+static void copy_node(PairCopy *copy, const KeyNode *keyNode) {
+    strcpy(copy->key, keyNode->key);
+    strcpy(copy->value, keyNode->value);
+}
+
+int foreach_pair(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    read_lock_table(ht);
+    size_t count = ht->count;                                                       // No writer runs while the table is locked
+    if (count == 0) {
+        unlock_table(ht);
+        return 0;
+    }
+
+    PairCopy *pairs = malloc(count * sizeof(PairCopy));
+    KeyNode **nodes = ht->index == NULL ? malloc(count * sizeof(KeyNode *)) : NULL;
+    if (pairs == NULL || (ht->index == NULL && nodes == NULL)) {
+        unlock_table(ht);
+        free(pairs);
+        free(nodes);
+        return 1;
+    }
+    size_t n = 0;
+    if (ht->index != NULL) {                                                        // Already in order, a single pass
+        pthread_rwlock_rdlock(&ht->index_lock);
+        for (SkipNode *node = skiplist_lower_bound(ht->index, NULL); node != NULL && n < count;
+             node = node->next[0]) {
+            if (!is_expired(node->entry)) {
+                copy_node(&pairs[n++], node->entry);
+            }
+        }
+        pthread_rwlock_unlock(&ht->index_lock);
+    } else {
+        size_t found = 0;
+        if (ht->engine == ENGINE_FLAT) {
+            for (int i = 0; i < LOCK_STRIPES; i++) {
+                found += flat_collect(&ht->flat[i], nodes + found);
+            }
+        } else {
+            if (ht->old_table != NULL) {
+                found = collect_nodes(ht->old_table, ht->old_size, nodes, found);
+            }
+            found = collect_nodes(ht->table, ht->size, nodes, found);
+        }
+        qsort(nodes, found, sizeof(KeyNode *), compare_nodes);                      // Sort the pairs by key
+        for (size_t i = 0; i < found; i++) {
+            if (!is_expired(nodes[i])) {
+                copy_node(&pairs[n++], nodes[i]);
+            }
+        }
+    }
+    unlock_table(ht);
+    free(nodes);
+
+    for (size_t i = 0; i < n; i++) {                                                // visit may block on its output
+        visit(pairs[i].key, pairs[i].value, arg);
+    }
+    free(pairs);
+    return 0;
+}
+
+// Range and callback of a read_range done by filtering foreach_pair.
+typedef struct RangeFilter {
+    const char *from;
+    const char *to;
+    void (*visit)(const char *key, const char *value, void *arg);
+    void *arg;
+} RangeFilter;
+
+static void visit_in_range(const char *key, const char *value, void *arg) {
+    RangeFilter *filter = arg;
+    if (strcmp(key, filter->from) >= 0 && strcmp(key, filter->to) <= 0) {
+        filter->visit(key, value, filter->arg);
+    }
+}
+
+int read_range(HashTable *ht, const char *from, const char *to,
+               void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    if (ht->index == NULL) {
+        RangeFilter filter = { from, to, visit, arg };
+        return foreach_pair(ht, visit_in_range, &filter);
+    }
+
+    // The bucket locks come before index_lock, so the keys are copied out of the
+    // index first and their values are read afterwards, one bucket at a time
+    size_t n = 0, capacity = 16;
+    char (*keys)[MAX_STRING_SIZE + 1] = malloc(capacity * sizeof(*keys));
+    if (keys == NULL) {
+        return 1;
+    }
+    pthread_rwlock_rdlock(&ht->index_lock);
+    SkipNode *node = skiplist_lower_bound(ht->index, from);
+    for (; node != NULL && strcmp(node->entry->key, to) <= 0; node = node->next[0]) {
+        if (n == capacity) {
+            void *grown = realloc(keys, 2 * capacity * sizeof(*keys));
+            if (grown == NULL) {
+                break;
+            }
+            keys = grown;
+            capacity *= 2;
+        }
+        strcpy(keys[n++], node->entry->key);
+    }
+    int result = node != NULL && strcmp(node->entry->key, to) <= 0;                // Stopped early: out of memory
+    pthread_rwlock_unlock(&ht->index_lock);
+
+    char value[MAX_STRING_SIZE + 1];
+    for (size_t i = 0; i < n && result == 0; i++) {
+        if (read_pair(ht, keys[i], value, sizeof(value)) == 0) {                    // Skip keys deleted meanwhile
+            visit(keys[i], value, arg);
+        }
+    }
+    free(keys);
+    return result;
+}
+
+// Recomputes the oldest version that an open chain, or a delta snapshot still being
+// copied, needs tombstones after. Must be called with snapshot_mutex held.
+static void update_delta_floor(HashTable *ht) {
+    uint64_t floor = UINT64_MAX;
+    for (DeltaBase *base = ht->delta_bases; base != NULL; base = base->next) {
+        floor = base->version < floor ? base->version : floor;
+    }
+    for (uint32_t used = ht->used_snapshots; used != 0; used &= used - 1) {
+        const Snapshot *snapshot = &ht->snapshots[__builtin_ctz(used)];
+        if (snapshot->delta && snapshot->since < floor) {
+            floor = snapshot->since;
+        }
+    }
+    __atomic_store_n(&ht->delta_floor, floor, __ATOMIC_RELEASE);
+}
+
+// Takes a snapshot, the next one of a delta chain if base is not NULL.
+static int begin_snapshot(HashTable *ht, DeltaBase *base) {
+    pthread_mutex_lock(&ht->snapshot_mutex);
+    while (ht->used_snapshots == (1u << MAX_SNAPSHOTS) - 1) {
+        pthread_cond_wait(&ht->snapshot_free, &ht->snapshot_mutex);
+    }
+    int id = __builtin_ctz(~ht->used_snapshots);
+    ht->used_snapshots |= 1u << id;
+    pthread_mutex_unlock(&ht->snapshot_mutex);
+
+    Snapshot *snapshot = &ht->snapshots[id];
+    read_lock_table(ht);                                                            // Waits for the writes in progress
+    pthread_mutex_lock(&ht->snapshot_mutex);                                        // Other snapshots may be taken meanwhile
+    snapshot->version = ht->epoch++;                                                // Later writes get a newer version
+    snapshot->taken_ms = monotonic_ms();
+    memset(snapshot->copied, 0, sizeof(snapshot->copied));
+    memset(snapshot->preserved, 0, sizeof(snapshot->preserved));
+    snapshot->failed = 0;
+    snapshot->delta = base != NULL && base->open && !base->broken;
+    snapshot->since = snapshot->delta ? base->version : 0;
+    if (base != NULL) {                                                             // No removal can happen until the table is unlocked
+        if (!base->open) {
+            base->next = ht->delta_bases;
+            ht->delta_bases = base;
+            base->open = 1;
+        }
+        base->broken = 0;
+        base->version = snapshot->version;
+        update_delta_floor(ht);
+    }
+    pthread_mutex_unlock(&ht->snapshot_mutex);
+    __atomic_or_fetch(&ht->active_snapshots, 1u << id, __ATOMIC_RELEASE);
+    unlock_table(ht);
+    return id;
+}
+
+int snapshot_begin(HashTable *ht) {
+    return begin_snapshot(ht, NULL);
+}
+
+int snapshot_begin_delta(HashTable *ht, DeltaBase *base) {
+    return begin_snapshot(ht, base);
+}
+
+void delta_release(HashTable *ht, DeltaBase *base) {
+    pthread_mutex_lock(&ht->snapshot_mutex);
+    if (!base->open) {
+        pthread_mutex_unlock(&ht->snapshot_mutex);
+        return;
+    }
+    DeltaBase **link = &ht->delta_bases;
+    while (*link != base) {
+        link = &(*link)->next;
+    }
+    *link = base->next;
+    base->open = 0;
+    update_delta_floor(ht);
+    pthread_mutex_unlock(&ht->snapshot_mutex);
+
+    for (size_t stripe = 0; stripe < LOCK_STRIPES; stripe++) {                      // Drop what no chain needs anymore
+        pthread_rwlock_wrlock(&ht->list_lock[stripe]);
+        prune_tombstones(ht, stripe, __atomic_load_n(&ht->delta_floor, __ATOMIC_ACQUIRE));
+        pthread_rwlock_unlock(&ht->list_lock[stripe]);
+    }
+}
+
+// Pairs copied out of a snapshot.
+typedef struct SnapshotCopy {
+    PreservedPair *pairs;                                                           // Only key and value are used
+    size_t count;
+    size_t capacity;
+    int failed;
+} SnapshotCopy;
+
+// Appends a pair, or the deletion of a key if value is NULL, to a copy.
+static void copy_pair(SnapshotCopy *copy, const char *key, const char *value) {
+    if (copy->count == copy->capacity) {
+        size_t capacity = copy->capacity == 0 ? 64 : copy->capacity * 2;
+        PreservedPair *pairs = realloc(copy->pairs, capacity * sizeof(PreservedPair));
+        if (pairs == NULL) {
+            copy->failed = 1;
+            return;
+        }
+        copy->pairs = pairs;
+        copy->capacity = capacity;
+    }
+    PreservedPair *pair = &copy->pairs[copy->count++];
+    strcpy(pair->key, key);
+    strcpy(pair->value, value != NULL ? value : "");
+    pair->deleted = value == NULL;
+}
+
+// Copies the contents a node had at some version, if the snapshot sees them.
+static void copy_version(SnapshotCopy *copy, const Snapshot *snapshot, const char *key, const char *value,
+                         uint64_t expires_at, uint64_t version) {
+    if (version > snapshot->version) {                                              // Written after the snapshot
+        return;
+    }
+    if (expires_at != 0 && expires_at <= snapshot->taken_ms) {                      // Already invisible when the snapshot was taken
+        if (snapshot->delta) {                                                      // It may have been in an earlier snapshot
+            copy_pair(copy, key, NULL);
+        }
+        return;
+    }
+    if (!snapshot->delta || version > snapshot->since) {
+        copy_pair(copy, key, value);
+    }
+}
+
+// Copies the nodes of a bucket array that belong to a stripe and that the snapshot sees.
+static void copy_buckets(SnapshotCopy *copy, const Snapshot *snapshot, KeyNode **table, size_t size, size_t stripe) {
+    for (size_t i = stripe; i < size; i += LOCK_STRIPES) {                          // Buckets guarded by the stripe's lock
+        if (table[i] == MOVED) {
+            continue;
+        }
+        for (KeyNode *keyNode = table[i]; keyNode != NULL; keyNode = keyNode->next) {
+            copy_version(copy, snapshot, keyNode->key, keyNode->value, keyNode->expires_at, keyNode->version);
+        }
+    }
+}
+
+// Copies the pairs of a stripe as the snapshot sees them. Must be called with the stripe's lock held.
+static void copy_stripe(HashTable *ht, Snapshot *snapshot, size_t stripe, SnapshotCopy *copy) {
+    if (ht->engine == ENGINE_FLAT) {
+        FlatTable *ft = &ht->flat[stripe];
+        KeyNode **nodes = malloc((ft->size + 1) * sizeof(KeyNode *));
+        if (nodes == NULL) {
+            copy->failed = 1;
+        } else {
+            size_t n = flat_collect(ft, nodes);
+            for (size_t i = 0; i < n; i++) {
+                copy_version(copy, snapshot, nodes[i]->key, nodes[i]->value, nodes[i]->expires_at, nodes[i]->version);
+            }
+            free(nodes);
+        }
+    } else {
+        if (ht->old_table != NULL) {
+            copy_buckets(copy, snapshot, ht->old_table, ht->old_size, stripe);
+        }
+        copy_buckets(copy, snapshot, ht->table, ht->size, stripe);
+    }
+
+    PreservedPair *pair = snapshot->preserved[stripe];                              // Pairs changed since the snapshot was taken
+    while (pair != NULL) {
+        PreservedPair *next = pair->next;
+        copy_version(copy, snapshot, pair->key, pair->value, pair->expires_at, pair->version);
+        free(pair);
+        pair = next;
+    }
+    if (snapshot->delta) {                                                          // Keys removed since the previous snapshot
+        for (Tombstone *tombstone = ht->tombstones[stripe]; tombstone != NULL; tombstone = tombstone->next) {
+            if (tombstone->version <= snapshot->since) {
+                break;
+            }
+            if (tombstone->version <= snapshot->version) {
+                copy_pair(copy, tombstone->key, NULL);
+            }
+        }
+    }
+    snapshot->preserved[stripe] = NULL;
+    snapshot->copied[stripe] = 1;                                                   // Writers stop preserving this stripe
+}
+
+// Orders by key, and the pair of a key before its deletions.
+static int compare_pairs(const void *a, const void *b) {
+    const PreservedPair *pa = a;
+    const PreservedPair *pb = b;
+    int order = strcmp(pa->key, pb->key);
+    return order != 0 ? order : pa->deleted - pb->deleted;
+}
+
+// Releases a snapshot whose stripes were all copied. Returns 1 if a preserve failed.
+static int release_snapshot(HashTable *ht, int id) {
+    Snapshot *snapshot = &ht->snapshots[id];
+    int failed = __atomic_load_n(&snapshot->failed, __ATOMIC_RELAXED);
+
+    __atomic_and_fetch(&ht->active_snapshots, ~(1u << id), __ATOMIC_RELEASE);
+    pthread_mutex_lock(&ht->snapshot_mutex);
+    ht->used_snapshots &= ~(1u << id);
+    if (snapshot->delta) {                                                          // Its tombstones can go now
+        update_delta_floor(ht);
+    }
+    pthread_cond_signal(&ht->snapshot_free);
+    pthread_mutex_unlock(&ht->snapshot_mutex);
+    return failed;
+}
+
+int snapshot_foreach(HashTable *ht, int id, void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    Snapshot *snapshot = &ht->snapshots[id];
+    SnapshotCopy copy = { NULL, 0, 0, 0 };
+
+    for (size_t stripe = 0; stripe < LOCK_STRIPES; stripe++) {                      // One lock at a time
+        pthread_rwlock_rdlock(&ht->list_lock[stripe]);
+        copy_stripe(ht, snapshot, stripe, &copy);
+        pthread_rwlock_unlock(&ht->list_lock[stripe]);
+    }
+    int failed = release_snapshot(ht, id) || copy.failed;
+
+    if (!failed) {
+        qsort(copy.pairs, copy.count, sizeof(PreservedPair), compare_pairs);
+        for (size_t i = 0; i < copy.count; i++) {
+            if (i > 0 && strcmp(copy.pairs[i].key, copy.pairs[i - 1].key) == 0) {  // Removed, then written again
+                continue;
+            }
+            visit(copy.pairs[i].key, copy.pairs[i].deleted ? NULL : copy.pairs[i].value, arg);
+        }
+    }
+    free(copy.pairs);
+    return failed;
+}
+
+// Work of one thread of snapshot_foreach_ranges. Each thread first copies and sorts
+// its share of the stripes (a run), then visits its key range across every run.
+typedef struct RangeVisit {
+    HashTable *ht;
+    int id;
+    int index;                                                                      // Of this thread: stripes index, index + ranges, ...
+    int ranges;
+    SnapshotCopy *runs;                                                             // One sorted copy per thread
+    size_t (*bounds)[MAX_SNAPSHOT_THREADS + 1];                                     // bounds[run][r]: first pair of range r in the run
+    void (*visit)(const char *key, const char *value, void *arg);
+    void *arg;
+} RangeVisit;
+
+static void *copy_run(void *arg) {
+    RangeVisit *work = arg;
+    SnapshotCopy *run = &work->runs[work->index];
+    for (size_t stripe = (size_t)work->index; stripe < LOCK_STRIPES; stripe += (size_t)work->ranges) {
+        pthread_rwlock_rdlock(&work->ht->list_lock[stripe]);
+        copy_stripe(work->ht, &work->ht->snapshots[work->id], stripe, run);
+        pthread_rwlock_unlock(&work->ht->list_lock[stripe]);
+    }
+    if (!run->failed) {
+        qsort(run->pairs, run->count, sizeof(PreservedPair), compare_pairs);
+    }
+    return NULL;
+}
+
+// Merges the slices of the runs that fall in this thread's range. A key lives in a
+// single stripe, so its pair and deletions are adjacent in one run.
+static void *visit_range(void *arg) {
+    RangeVisit *work = arg;
+    size_t next[MAX_SNAPSHOT_THREADS];
+    for (int run = 0; run < work->ranges; run++) {
+        next[run] = work->bounds[run][work->index];
+    }
+    for (;;) {
+        int smallest = -1;
+        for (int run = 0; run < work->ranges; run++) {
+            if (next[run] < work->bounds[run][work->index + 1] &&
+                (smallest == -1 || strcmp(work->runs[run].pairs[next[run]].key,
+                                          work->runs[smallest].pairs[next[smallest]].key) < 0)) {
+                smallest = run;
+            }
+        }
+        if (smallest == -1) {
+            break;
+        }
+        const SnapshotCopy *run = &work->runs[smallest];
+        const PreservedPair *pair = &run->pairs[next[smallest]++];
+        if (pair > run->pairs && strcmp(pair->key, (pair - 1)->key) == 0) {
+            continue;                                                               // Removed, then written again
+        }
+        work->visit(pair->key, pair->deleted ? NULL : pair->value, work->arg);
+    }
+    return NULL;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// First pair of a sorted run whose key is not smaller than key.
+static size_t lower_bound(const SnapshotCopy *run, const char *key) {
+    size_t low = 0;
+    size_t high = run->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(run->pairs[middle].key, key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Runs fn on every work item, each on its own thread (this one runs the first item).
+static void run_threads(void *(*fn)(void *), RangeVisit *work, int count) {
+    pthread_t threads[MAX_SNAPSHOT_THREADS];
+    int started[MAX_SNAPSHOT_THREADS] = { 0 };
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &work[i]) == 0;
+    }
+    fn(&work[0]);
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {                                                                    // No thread for it, run it here
+            fn(&work[i]);
+        }
+    }
+}
+
+int snapshot_foreach_ranges(HashTable *ht, int id, int ranges,
+                            void (*visit)(const char *key, const char *value, void *arg), void **args) {
+    SnapshotCopy runs[MAX_SNAPSHOT_THREADS] = { 0 };
+    size_t bounds[MAX_SNAPSHOT_THREADS][MAX_SNAPSHOT_THREADS + 1];
+    RangeVisit work[MAX_SNAPSHOT_THREADS];
+    for (int i = 0; i < ranges; i++) {
+        work[i] = (RangeVisit){ ht, id, i, ranges, runs, bounds, visit, args[i] };
+    }
+
+    run_threads(copy_run, work, ranges);
+    int failed = release_snapshot(ht, id);
+    for (int run = 0; run < ranges; run++) {
+        failed |= runs[run].failed;
+    }
+
+    const char *samples[MAX_SNAPSHOT_THREADS * SNAPSHOT_SAMPLES];
+    size_t num_samples = 0;
+    for (int run = 0; run < ranges && !failed; run++) {                             // Evenly spaced keys of every run
+        size_t count = runs[run].count;
+        size_t taken = count < SNAPSHOT_SAMPLES ? count : SNAPSHOT_SAMPLES;
+        for (size_t i = 0; i < taken; i++) {
+            samples[num_samples++] = runs[run].pairs[i * count / taken].key;
+        }
+    }
+    qsort(samples, num_samples, sizeof(samples[0]), compare_keys);
+    for (int run = 0; run < ranges && !failed; run++) {
+        bounds[run][0] = 0;
+        for (int r = 1; r < ranges; r++) {                                          // Range r starts at the r-th quantile
+            bounds[run][r] = num_samples > 0 ? lower_bound(&runs[run], samples[(size_t)r * num_samples / (size_t)ranges]) : 0;
+        }
+        bounds[run][ranges] = runs[run].count;
+    }
+
+    if (!failed) {
+        run_threads(visit_range, work, ranges);
+    }
+    for (int run = 0; run < ranges; run++) {
+        free(runs[run].pairs);
+    }
+    return failed;
+}
+
+void reserve_table(HashTable *ht, size_t pairs) {
+    if (ht->engine == ENGINE_FLAT) {
+        for (size_t i = 0; i < LOCK_STRIPES; i++) {                                 // Stripes hold an even share of the keys
+            pthread_rwlock_wrlock(&ht->list_lock[i]);
+            flat_reserve(&ht->flat[i], pairs / LOCK_STRIPES + pairs / LOCK_STRIPES / 8 + 1);
+            pthread_rwlock_unlock(&ht->list_lock[i]);
+        }
+        return;
+    }
+
+    size_t size = INITIAL_TABLE_SIZE;
+    while (size < pairs) {                                                          // Load factor of at most 1
+        size *= 2;
+    }
+    KeyNode **new_table = calloc(size, sizeof(KeyNode *));
+    lock_table(ht);
+    ht->min_size = size > ht->min_size ? size : ht->min_size;
+    if (new_table != NULL && ht->old_table == NULL && ht->count == 0 && size > ht->size) {
+        free(ht->table);                                                            // Empty: swapped without migrating
+        ht->table = new_table;
+        __atomic_store_n(&ht->size, size, __ATOMIC_RELAXED);
+        new_table = NULL;
+    }
+    unlock_table(ht);
+    free(new_table);                                                                // Not empty: maybe_resize grows to min_size
+}
+
+void set_table_journal(HashTable *ht, const TableJournal *journal) {
+    lock_table(ht);                                                                 // No batch is half journaled
+    ht->journal = journal;
+    unlock_table(ht);
+}
+
+void table_stats(HashTable *ht, TableStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    read_lock_table(ht);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        for (Slab *slab = ht->pools[i].slabs; slab != NULL; slab = slab->next) {
+            stats->resident_bytes += sizeof(Slab) + slab->capacity * sizeof(KeyNode);
+        }
+        stats->pairs += ht->pools[i].live;
+        stats->evictions += ht->pools[i].evictions;
+        stats->expirations += ht->pools[i].expirations;
+    }
+    unlock_table(ht);
 }
 
 // Frees the hash table.
 void free_table(HashTable *ht) {
     pthread_mutex_lock(&ht->table_mutex);
-    for (int i = 0; i < TABLE_SIZE; i++) {                      // Iterate over the table     
-        KeyNode *keyNode = ht->table[i];
-        while (keyNode != NULL) {                               // Iterate over the linked list
-            KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);                                    // Free the key
-            free(temp->value);                                  // Free the value
-            free(temp);                                         // Free the node
+    free(ht->old_table);
+    free(ht->table);
+    for (int i = 0; i < LOCK_STRIPES; i++) {                    // Nodes live in slabs, free them a slab at a time
+        Slab *slab = ht->pools[i].slabs;
+        while (slab != NULL) {
+            Slab *temp = slab;
+            slab = slab->next;
+            free(temp);
         }
-        pthread_mutex_destroy(&ht->list_mutex[i]);
+        flat_destroy(&ht->flat[i]);
+        prune_tombstones(ht, (size_t)i, UINT64_MAX);                             // Keeps none
+        pthread_rwlock_destroy(&ht->list_lock[i]);
+    }
+    if (ht->index != NULL) {
+        skiplist_destroy(ht->index);
+        free(ht->index);
     }
+    pthread_rwlock_destroy(&ht->index_lock);
+    pthread_mutex_destroy(&ht->snapshot_mutex);
+    pthread_cond_destroy(&ht->snapshot_free);
     pthread_mutex_unlock(&ht->table_mutex);
     pthread_mutex_destroy(&ht->table_mutex);
     free(ht);
@@ -1,26 +1,167 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
 
-#define TABLE_SIZE 26
+#define LOCK_STRIPES 64                                                             // Number of bucket locks (power of two)
+#define INITIAL_TABLE_SIZE 64                                                       // Initial bucket count (power of two, multiple of LOCK_STRIPES)
+#define REHASH_STEP 2                                                               // Old buckets migrated by each write/delete while resizing
+#define MIN_SLAB_NODES 16                                                           // Nodes in the first slab of a pool
+#define MAX_SLAB_NODES 4096                                                         // Slabs double in size up to this many nodes
+#define BATCH_HASHES 256                                                            // Keys of a batch whose hash is computed only once
+#define MAX_SNAPSHOTS 8                                                             // Snapshots that can be open at the same time
+#define MAX_SNAPSHOT_THREADS 16                                                     // Most threads visiting one snapshot
+#define SNAPSHOT_SAMPLES 64                                                         // Keys of each copy sampled to split the ranges
 
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
+#include "constants.h"
+#include "flat.h"
+#include "skiplist.h"
+#include "span.h"
+
+enum TableEngine {
+    ENGINE_CHAINED,                                                                 // Resizable array of linked-list buckets
+    ENGINE_FLAT                                                                     // One open-addressing FlatTable per lock stripe
+};
 
 typedef struct KeyNode {
-    char *key;
-    char *value;
-    struct KeyNode *next;
+    struct KeyNode *next;                                                           // Next node of the bucket (or of the free list)
+    uint64_t hash;                                                                  // Cached hash of the key
+    uint64_t expires_at;                                                            // Deadline (monotonic_ms), 0 if the pair never expires
+    uint64_t version;                                                               // Table epoch when the pair was last written
+    uint8_t live;                                                                   // 1 while the node holds a pair of the table
+    uint8_t referenced;                                                             // Set on every access, cleared by the CLOCK hand
+    char key[MAX_STRING_SIZE + 1];
+    char value[MAX_STRING_SIZE + 1];
 } KeyNode;
 
+// Creation parameters of a hash table.
+typedef struct TableConfig {
+    enum TableEngine engine;                                                        // Layout used to store the pairs
+    int ordered_index;                                                              // Keep the keys in an ordered index too
+    size_t memory_limit;                                                            // Bytes of nodes kept before evicting pairs, 0 for no limit
+} TableConfig;
+
+// Block of nodes allocated at once.
+typedef struct Slab {
+    struct Slab *next;
+    size_t capacity;                                                                // Number of nodes in this slab
+    size_t used;                                                                    // Nodes handed out so far (never decreases)
+    KeyNode nodes[];
+} Slab;
+
+// Node allocator of one lock stripe, only used with the stripe's lock held for writing.
+// With a memory limit, a stripe holds at most max_nodes pairs: a new key then evicts
+// the first live node the CLOCK hand finds without its referenced bit, clearing the
+// bits it passes. The hand walks the slabs themselves, so no list has to be kept.
+typedef struct NodePool {
+    Slab *slabs;                                                                    // Most recent slab first
+    KeyNode *free_list;                                                             // Nodes released by delete_pair
+    size_t capacity;                                                                // Nodes in all slabs
+    size_t live;                                                                    // Nodes holding a pair
+    size_t max_nodes;                                                               // Share of the memory limit, 0 for no limit
+    Slab *hand_slab;                                                                // CLOCK hand: slab and node it points to
+    size_t hand;
+    size_t evictions;
+    size_t expirations;                                                             // Pairs reclaimed by expire_pairs
+} NodePool;
+
+// Memory counters of a hash table.
+typedef struct TableStats {
+    size_t pairs;                                                                   // Pairs stored
+    size_t resident_bytes;                                                          // Bytes of the slabs that hold the nodes
+    size_t evictions;                                                               // Pairs dropped to stay under the memory limit
+    size_t expirations;                                                             // Expired pairs reclaimed
+} TableStats;
+
+// Copy of a pair as it was when a snapshot was taken.
+typedef struct PreservedPair {
+    struct PreservedPair *next;
+    uint64_t expires_at;
+    uint64_t version;                                                               // Version of the node it was copied from
+    uint8_t deleted;                                                                // Deletion of key (only in delta copies)
+    char key[MAX_STRING_SIZE + 1];
+    char value[MAX_STRING_SIZE + 1];
+} PreservedPair;
+
+// Key removed while a delta chain was open, so that later deltas can record it.
+typedef struct Tombstone {
+    struct Tombstone *next;                                                         // Older removal of the stripe
+    uint64_t version;                                                               // Epoch of the removal
+    char key[MAX_STRING_SIZE + 1];
+} Tombstone;
+
+// Receives every batch applied by write_pairs_ttl and delete_pairs while the batch's
+// locks are still held, so two batches that touch the same key reach it in the order
+// they were applied. Must not block (it runs under the bucket locks).
+typedef struct TableJournal {
+    void (*write)(void *arg, size_t num_pairs, const Span *keys, const Span *values,
+                  const uint64_t *expires_at);                                      // expires_at is NULL when there is no deadline
+    void (*remove)(void *arg, size_t num_pairs, const Span *keys);
+    void *arg;
+} TableJournal;
+
+// Position of a chain of delta backups: every change up to version was backed up.
+// While a chain is open, removed keys are kept as tombstones until no chain needs them.
+typedef struct DeltaBase {
+    struct DeltaBase *next;                                                         // Other open chains (snapshot_mutex)
+    uint64_t version;                                                               // Version of the chain's last snapshot
+    int open;                                                                       // Its first, full snapshot was taken
+    int broken;                                                                     // A tombstone was lost, the next snapshot is full
+} DeltaBase;
+
+// Point-in-time view of a table. Taking it only bumps the table epoch (with every lock
+// held for reading, so no write is half done); the pairs are copied afterwards, one
+// stripe at a time, while writers keep going. A pair with a version up to the
+// snapshot's is in the view; before changing or removing such a pair in a stripe that
+// was not copied yet, writers keep its old contents in preserved[stripe].
+typedef struct Snapshot {
+    uint64_t version;                                                               // Epoch the snapshot sees
+    uint64_t taken_ms;                                                              // Pairs expired by then are left out
+    uint8_t copied[LOCK_STRIPES];                                                   // Stripes already copied (under each stripe's lock)
+    PreservedPair *preserved[LOCK_STRIPES];                                         // Old contents saved by writers (under each stripe's lock)
+    int failed;                                                                     // A writer could not save a pair
+    int delta;                                                                      // Only the changes after since are in the view
+    uint64_t since;                                                                 // Version of the chain's previous snapshot
+} Snapshot;
+
+// With ENGINE_CHAINED, bucket b (in either array) is protected by list_lock[b % LOCK_STRIPES], taken for
+// reading by read_pair and for writing by anything that changes the bucket. Since both
+// arrays are power-of-two sized and at least LOCK_STRIPES long, a key keeps its lock
+// across resizes, and a resize only needs every lock to swap the arrays.
+// With ENGINE_FLAT, the keys of lock i are in flat[i] and the bucket arrays are unused.
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
+    enum TableEngine engine;
+    KeyNode **table;                                                                // Bucket array
+    size_t size;                                                                    // Number of buckets in table
+    KeyNode **old_table;                                                            // Array being migrated during a resize, NULL otherwise
+    size_t old_size;                                                                // Number of buckets in old_table
+    size_t rehash_index;                                                            // Next bucket of old_table to migrate
+    size_t rehash_done;                                                             // Number of buckets of old_table already migrated
+    size_t count;                                                                   // Number of pairs stored
+    size_t min_size;                                                                // Buckets kept by reserve_table (no shrinking below)
     pthread_mutex_t table_mutex;
-    pthread_mutex_t list_mutex[TABLE_SIZE];
+    pthread_rwlock_t list_lock[LOCK_STRIPES];
+    NodePool pools[LOCK_STRIPES];                                                   // Nodes of the keys guarded by each lock
+    FlatTable flat[LOCK_STRIPES];                                                   // Used by ENGINE_FLAT
+    SkipList *index;                                                                // Keys in order, NULL unless ordered_index
+    pthread_rwlock_t index_lock;                                                    // Taken after the bucket locks, never before
+    uint64_t epoch;                                                                 // Version given to writes, bumped by every snapshot
+    Snapshot snapshots[MAX_SNAPSHOTS];
+    uint32_t active_snapshots;                                                      // Bit i set while snapshots[i] is being copied
+    uint32_t used_snapshots;                                                        // Bit i set while snapshots[i] is taken (snapshot_mutex)
+    pthread_mutex_t snapshot_mutex;
+    pthread_cond_t snapshot_free;                                                   // Signaled when a snapshot slot is released
+    DeltaBase *delta_bases;                                                         // Open delta chains (snapshot_mutex)
+    uint64_t delta_floor;                                                           // Oldest version a chain or delta snapshot needs
+    Tombstone *tombstones[LOCK_STRIPES];                                            // Newest first (under each stripe's lock)
+    const TableJournal *journal;                                                    // Told about every batch, NULL for none
 } HashTable;
 
 /// Creates a new event hash table.
+/// @param config Layout and indexing of the table.
 /// @return Newly created hash table, NULL on failure
-struct HashTable *create_hash_table();
+struct HashTable *create_hash_table(const TableConfig *config);
 
 /// Appends a new key value pair to the hash table.
 /// @param ht Hash table to be modified.
@@ -29,11 +170,13 @@ struct HashTable *create_hash_table();
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int write_pair(HashTable *ht, const char *key, const char *value);
 
-/// Deletes the value of given key.
-/// @param ht Hash table to delete from.
-/// @param key Key of the pair to be deleted.
-/// @return 0 if the node was deleted successfully, 1 otherwise.
-char* read_pair(HashTable *ht, const char *key);
+/// Reads the value of given key into caller-provided storage, without allocating.
+/// @param ht Hash table to read from.
+/// @param key Key of the pair to be read.
+/// @param value Buffer that receives the null-terminated value.
+/// @param size Size of value, in bytes (MAX_STRING_SIZE + 1 always fits).
+/// @return 0 if the key was found, 1 otherwise.
+int read_pair(HashTable *ht, const char *key, char *value, size_t size);
 
 /// Appends a new node to the list.
 /// @param list Event list to be modified.
@@ -41,6 +184,149 @@ char* read_pair(HashTable *ht, const char *key);
 /// @return 0 if the node was appended successfully, 1 otherwise.
 int delete_pair(HashTable *ht, const char *key);
 
+/// Current time of the clock used for pair deadlines.
+/// @return Milliseconds of CLOCK_MONOTONIC.
+uint64_t monotonic_ms(void);
+
+/// Index of the lock stripe that guards a key (a fixed function of the key).
+/// @param key Key to locate.
+/// @return Stripe index, smaller than LOCK_STRIPES.
+size_t key_stripe(const Span *key);
+
+/// Writes several pairs at once. Each lock the keys need is taken once, and all of
+/// them are held until every pair is written, so readers see all or none of the batch.
+/// @param ht Hash table to be modified.
+/// @param num_pairs Number of pairs to write.
+/// @param keys Keys of the pairs, applied in order (the last value of a key wins).
+/// @param values Values of the pairs.
+/// @return 0 if every pair was written successfully, 1 otherwise.
+int write_pairs(HashTable *ht, size_t num_pairs, const Span *keys, const Span *values);
+
+/// Writes several pairs at once, like write_pairs, with a deadline for each pair.
+/// A pair is invisible to every read once monotonic_ms() reaches its deadline, and is
+/// reclaimed later by expire_pairs. Writing a key again replaces its deadline.
+/// @param ht Hash table to be modified.
+/// @param num_pairs Number of pairs to write.
+/// @param keys Keys of the pairs.
+/// @param values Values of the pairs.
+/// @param expires_at Deadline of each pair, 0 for none.
+/// @return 0 if every pair was written successfully, 1 otherwise.
+int write_pairs_ttl(HashTable *ht, size_t num_pairs, const Span *keys, const Span *values, const uint64_t *expires_at);
+
+/// Reclaims pairs whose deadline passed, taking each lock the batch needs once.
+/// A key is only removed if its deadline is still the given one (it was not written again).
+/// @param ht Hash table to be modified.
+/// @param num_pairs Number of keys to check.
+/// @param keys Keys to check.
+/// @param expires_at Deadline each key was given.
+/// @return Number of pairs removed.
+size_t expire_pairs(HashTable *ht, size_t num_pairs, const Span *keys, const uint64_t *expires_at);
+
+/// Reads several keys at once, holding the locks of all of them for reading.
+/// @param ht Hash table to read from.
+/// @param num_pairs Number of keys to read.
+/// @param keys Keys to read.
+/// @param visit Function called, in order, with each key and a copy of its value (NULL if
+///              missing), once the locks are released.
+/// @param arg Argument forwarded to visit.
+/// @return 0 if the keys were read successfully, 1 otherwise.
+int read_pairs(HashTable *ht, size_t num_pairs, const Span *keys,
+               void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Deletes several keys at once, holding the locks of all of them for writing.
+/// @param ht Hash table to delete from.
+/// @param num_pairs Number of keys to delete.
+/// @param keys Keys to delete.
+/// @param missing Function called, in order, with each key that was not found.
+/// @param arg Argument forwarded to missing.
+/// @return 0 if every key was deleted, 1 if some were missing.
+int delete_pairs(HashTable *ht, size_t num_pairs, const Span *keys,
+                 void (*missing)(const char *key, void *arg), void *arg);
+
+/// Visits every pair of the hash table in ascending key order.
+/// The pairs are copied while the table is locked for reading and visited after it is unlocked.
+/// @param ht Hash table to traverse.
+/// @param visit Function called with each key and value.
+/// @param arg Argument forwarded to visit.
+/// @return 0 if the traversal was successful, 1 otherwise.
+int foreach_pair(HashTable *ht, void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Visits the pairs whose keys are in [from, to], in ascending key order.
+/// Uses the ordered index when there is one, otherwise sorts the whole table.
+/// @param ht Hash table to read from.
+/// @param from Smallest key of the range.
+/// @param to Largest key of the range.
+/// @param visit Function called with each key and value.
+/// @param arg Argument forwarded to visit.
+/// @return 0 if the range was read successfully, 1 otherwise.
+int read_range(HashTable *ht, const char *from, const char *to,
+               void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Takes a point-in-time snapshot of the table. Writers are only held up while
+/// every bucket lock is taken for reading once; waits if MAX_SNAPSHOTS are open.
+/// @param ht Hash table to snapshot.
+/// @return Id of the snapshot, for snapshot_foreach.
+int snapshot_begin(HashTable *ht);
+
+/// Takes the next snapshot of a delta chain. The first one of a chain is full and
+/// opens it; the next ones only see the pairs written since the previous snapshot of
+/// the chain, and the keys removed since then (visited with a NULL value).
+/// @param ht Hash table to snapshot.
+/// @param base Chain of the snapshot, initialized to zeros before the first one.
+/// @return Id of the snapshot, for snapshot_foreach.
+int snapshot_begin_delta(HashTable *ht, DeltaBase *base);
+
+/// Closes a delta chain, so that its removed keys are no longer remembered.
+/// @param ht Hash table the chain was taken from.
+/// @param base Chain to close (may not be open).
+void delta_release(HashTable *ht, DeltaBase *base);
+
+/// Visits every pair of a snapshot in ascending key order, then releases the snapshot.
+/// The pairs are copied one bucket lock at a time, so writers are never blocked for long.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snapshot Id returned by snapshot_begin or snapshot_begin_delta.
+/// @param visit Function called with each key and value (NULL for a key removed, in deltas).
+/// @param arg Argument forwarded to visit.
+/// @return 0 if the snapshot was visited successfully, 1 otherwise.
+int snapshot_foreach(HashTable *ht, int snapshot, void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Visits every pair of a snapshot from several threads, then releases the snapshot.
+/// The stripes are copied and sorted in parallel, then the keys are split into
+/// contiguous ranges, one per thread: range r is visited in ascending key order with
+/// args[r], and its keys are all smaller than those of range r + 1.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snapshot Id returned by snapshot_begin or snapshot_begin_delta.
+/// @param ranges Number of ranges and threads (1 to MAX_SNAPSHOT_THREADS).
+/// @param visit Function called with each key and value (NULL for a key removed, in deltas).
+/// @param args Argument forwarded to visit, one per range.
+/// @return 0 if the snapshot was visited successfully, 1 otherwise.
+int snapshot_foreach_ranges(HashTable *ht, int snapshot, int ranges,
+                            void (*visit)(const char *key, const char *value, void *arg), void **args);
+
+/// Reads the memory counters of the hash table (holding every bucket lock for reading).
+/// @param ht Hash table to inspect.
+/// @param stats Receives the counters.
+void table_stats(HashTable *ht, TableStats *stats);
+
+/// Sizes the table for a number of pairs up front, so a bulk load does not go
+/// through every intermediate resize. A chained table never shrinks below it.
+/// @param ht Hash table to size.
+/// @param pairs Number of pairs expected.
+void reserve_table(HashTable *ht, size_t pairs);
+
+/// Sets the journal of the table, told about every later write and delete batch.
+/// @param ht Hash table to watch.
+/// @param journal Journal to call, NULL to stop.
+void set_table_journal(HashTable *ht, const TableJournal *journal);
+
+/// Locks every bucket of the hash table for writing, in a fixed order.
+/// @param ht Hash table to lock.
+void lock_table(HashTable *ht);
+
+/// Unlocks every bucket of the hash table.
+/// @param ht Hash table to unlock.
+void unlock_table(HashTable *ht);
+
 /// Frees the hashtable.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
@@ -14,14 +14,19 @@
 #include <limits.h>
 #include <pthread.h>
 #include <signal.h>    
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>  
 #include <unistd.h>
+#include "codec.h"
 #include "constants.h"
+#include "jobc.h"
+#include "jobdag.h"
+#include "jobsched.h"
+#include "jobsplit.h"
 #include "parser.h"
 #include "operations.h"
 
@@ -29,20 +34,50 @@
 #define MAX_SUBSCRIPTIONS 100
 #define MAX_KEY_LENGTH 40
 
+struct Job_data;
+
+// State of a running job, or segment of a split job. While it is parked at a WAIT its
+// input and output are closed, and reopened where it stopped, so thousands of waiting
+// jobs hold no file descriptors and no buffers.
+typedef struct JobRun {
+  int compiled;                                                                     // .jobc: run straight from the mapped file, mapped until the end
+  JobcFile jobc;
+  size_t position;                                                                  // Offset of the next command of a text job
+  size_t end;                                                                       // Bytes left to run from position, SIZE_MAX for all
+  int fd;                                                                           // Text job file, -1 while closed
+  Reader *reader;
+  int output_fd;                                                                    // Output (the .out is closed while parked), -1 until opened
+  int output_created;                                                               // The .out was truncated already, reopened to append
+  int output_failed;                                                                // Some output could not be written
+  OutBuf *out;                                                                      // NULL while closed
+  int backup_count;                                                                 // Counter for backups performed for this job
+  BackupGroup backups;                                                              // Backups of this job still being written
+} JobRun;
+
+// Part of a job run by one job thread: the whole job, or one segment of a split job.
+typedef struct JobSegment {
+  struct Job_data *job;
+  size_t index;                                                                     // Segment of the job, 0 for the first (or the whole job)
+  JobRun *run;                                                                      // NULL until it starts
+} JobSegment;
+
 typedef struct Job_data {
   int fd;
   char *file_path;                                                                  // Path to the .job file
   int output_fd;                                                                    // File descriptor for the output
-  int running_backups;                                                              // Number of backups currently running for this job
-  int concurrent_backups;                                                           // Maximum number of concurrent backups allowed
-  int status;                                                                       // 0 - Not processed, 1 - Processed or being processed
+  size_t size;                                                                      // Bytes of the job file, the largest jobs are run first
+  JobSegment first;                                                                 // Task of the whole job (or of its first segment)
+  JobSegment *segments;                                                             // Tasks of the other segments of a split job
+  size_t *offsets;                                                                  // Where each segment starts, then the end of the last one
+  size_t num_segments;                                                              // 0 until the job is planned, 1 if it is not split
+  int remaining;                                                                    // Segments still running
+  int *segment_fds;                                                                 // Output of each segment after the first, appended to the .out at the end
   struct Job_data *next;                                                            // Pointer to the next job
 } Job_data;
 
 typedef struct {
   Job_data* job_data;                                                               // Pointer to the list of jobs
   int num_files;                                                                    // Number of files in the directory
-  pthread_mutex_t mutex;                                                            // Mutex for thread synchronization
 } File_list;
 
 /*
@@ -58,16 +93,17 @@ Cliente* clientes = NULL;  // Lista de clientes conectados
 */
 
 int MAX_THREADS = 0;                                                                // Maximum number of threads
+static size_t split_bytes = 0;                                                      // Text jobs of at least twice this size may be split (--split-jobs)
+static int command_threads = 0;                                                     // Helpers running independent commands (--command-threads)
 volatile int concurrent_backups = 0;                                                         // Maximum number of concurrent backups, received as argument
-volatile int running_backups = 0;                                                            // Number of backups currently running globally
 //volatiless?
 char *registration_fifo_name_global; // Variável global para o nome do FIFO
 
 
 void *process_jobs_thread(void *arg);
-void handle_sigchld(int signo);
-void perform_backup(const char *filename, int backup_num);
 File_list *process_directory(const char *filename);
+int seed_jobs(File_list *file_list, int workers);
+static void run_dag_command(enum Command command, CommandArgs *args, OutBuf *out);
 
 
 
@@ -86,6 +122,35 @@ void cleanup_fifo() {
 
 
 
+// Parses a size in bytes, with an optional K, M or G suffix. Returns 0 on success.
+static int parse_size(const char *text, size_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || !isdigit((unsigned char)text[0])) {
+        return 1;
+    }
+    switch (*end) {
+        case 'G':
+            value *= 1024;
+            /* fall through */
+        case 'M':
+            value *= 1024;
+            /* fall through */
+        case 'K':
+            value *= 1024;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (*end != '\0' || value > SIZE_MAX) {
+        return 1;
+    }
+    *size = (size_t)value;
+    return 0;
+}
+
 /// Main function for the program.
 /// @param argc The number of command line arguments.
 /// @param argv An array of strings containing the command line arguments.
@@ -93,11 +158,100 @@ void cleanup_fifo() {
 int main(int argc, char *argv[]) {
 
 
-    if (argc != 5) { 
-        fprintf(stderr, "Usage: %s <directory_path> <concurrent_backups> <max_threads> <registration_fifo_name>\n", argv[0]);
+    if (argc < 5) { 
+        fprintf(stderr, "Usage: %s <directory_path> <concurrent_backups> <max_threads> <registration_fifo_name> [options]\n"
+                        "Options:\n"
+                        "  --engine chained|flat   Hash table layout (default: chained)\n"
+                        "  --ordered-index         Keep keys ordered (sorted SHOW/BACKUP in one pass, fast READ_RANGE)\n"
+                        "  --shards <n>            Split the keys among n executor threads, one per core\n"
+                        "  --memory-limit <bytes>  Evict pairs (CLOCK) to keep them under this size (K, M, G suffixes)\n"
+                        "  --binary-backups        Write BACKUP files as binary snapshots\n"
+                        "  --delta-backups         Binary BACKUP files with only the changes since the job's previous one\n"
+                        "  --backup-threads <n>    Serialize each BACKUP from n threads, one key range each (default: 1)\n"
+                        "  --restore <file>        Load a binary snapshot before running the jobs\n"
+                        "  --wal <file>            Log every change to a write-ahead log, replayed at startup\n"
+                        "  --wal-sync always|none|<ms>  Sync the log before each change returns, never, or every ms (default: 100)\n"
+                        "  --split-jobs <bytes>    Run job files of twice this size as segments of this size at once,\n"
+                        "                          when the segments use disjoint keys (K, M, G suffixes)\n"
+                        "  --command-threads <n>   Run the commands of a job that use different keys at once, on n\n"
+                        "                          helper threads (the .out is unchanged)\n"
+                        "When both <job>.job and <job>.jobc are in the directory, only <job>.jobc is run.\n", argv[0]);
         return 1;
     }
 
+    KvsOptions options = { .table = { .engine = ENGINE_CHAINED, .ordered_index = 0 }, .shards = 0, .backup_threads = 1,
+                           .wal_sync = WAL_SYNC_INTERVAL, .wal_interval_ms = WAL_DEFAULT_INTERVAL_MS };
+    for (int i = 5; i < argc; i++) {                                                // Optional arguments, after the positional ones
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "chained") == 0) {
+                options.table.engine = ENGINE_CHAINED;
+            } else if (strcmp(argv[i], "flat") == 0) {
+                options.table.engine = ENGINE_FLAT;
+            } else {
+                fprintf(stderr, "Error: unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--ordered-index") == 0) {
+            options.table.ordered_index = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            options.shards = atoi(argv[++i]);
+            if (options.shards <= 0 || options.shards > LOCK_STRIPES) {
+                fprintf(stderr, "Error: --shards must be between 1 and %d\n", LOCK_STRIPES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &options.table.memory_limit) != 0) {
+                fprintf(stderr, "Error: invalid memory limit %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--binary-backups") == 0) {
+            options.backup_format = BACKUP_BINARY;
+        } else if (strcmp(argv[i], "--delta-backups") == 0) {
+            options.backup_format = BACKUP_DELTA;
+        } else if (strcmp(argv[i], "--backup-threads") == 0 && i + 1 < argc) {
+            options.backup_threads = atoi(argv[++i]);
+            if (options.backup_threads <= 0 || options.backup_threads > MAX_SNAPSHOT_THREADS) {
+                fprintf(stderr, "Error: --backup-threads must be between 1 and %d\n", MAX_SNAPSHOT_THREADS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            options.restore_path = argv[++i];
+        } else if (strcmp(argv[i], "--wal") == 0 && i + 1 < argc) {
+            options.wal_path = argv[++i];
+        } else if (strcmp(argv[i], "--wal-sync") == 0 && i + 1 < argc) {
+            i++;
+            char *end;
+            if (strcmp(argv[i], "always") == 0) {
+                options.wal_sync = WAL_SYNC_ALWAYS;
+            } else if (strcmp(argv[i], "none") == 0) {
+                options.wal_sync = WAL_SYNC_NONE;
+            } else {
+                unsigned long interval = strtoul(argv[i], &end, 10);
+                if (end == argv[i] || *end != '\0' || interval == 0 || interval > 60000) {
+                    fprintf(stderr, "Error: --wal-sync must be always, none or 1 to 60000 ms\n");
+                    return 1;
+                }
+                options.wal_sync = WAL_SYNC_INTERVAL;
+                options.wal_interval_ms = (unsigned int)interval;
+            }
+        } else if (strcmp(argv[i], "--split-jobs") == 0 && i + 1 < argc) {
+            if (parse_size(argv[++i], &split_bytes) != 0 || split_bytes == 0) {
+                fprintf(stderr, "Error: invalid segment size %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--command-threads") == 0 && i + 1 < argc) {
+            command_threads = atoi(argv[++i]);
+            if (command_threads < 1 || command_threads > 1024) {
+                fprintf(stderr, "Error: --command-threads must be between 1 and 1024\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
     const char *dirpath = argv[1];
     concurrent_backups = atoi(argv[2]);
     MAX_THREADS = atoi(argv[3]);
@@ -123,12 +277,17 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (kvs_init()) {                                                               // Initializes the KVS system
+    options.max_clients = MAX_THREADS;                                              // Every job thread may submit to the shards
+    options.backup_workers = concurrent_backups;
+    if (kvs_init(&options)) {                                                               // Initializes the KVS system
         perror("Failed to initialize KVS");
         return 1;
     }
-
-    signal(SIGCHLD, handle_sigchld);                                                // Set up SIGCHLD handler for handling child process termination
+    if (command_threads > 0 && jobdag_start(command_threads, run_dag_command) != 0) {
+        perror("Failed to start the command threads");
+        kvs_terminate();
+        return 1;
+    }
 
     // Register cleanup for FIFO
     if (mkfifo(registration_fifo_name_global, 0666) == -1) {
@@ -151,34 +310,31 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    Job_data *job_data = file_list->job_data;
     pthread_t threads[MAX_THREADS];
     int num_files = file_list->num_files;
+    int num_threads = MAX_THREADS < num_files || split_bytes > 0 ? MAX_THREADS : num_files;   // Segments of split jobs can use every thread
+    if (num_threads > 0 && seed_jobs(file_list, num_threads) != 0) {
+        perror("Failed to queue the jobs");
+        num_threads = 0;
+    }
 
     // Create threads for processing jobs
-    for (int i = 0; i < MAX_THREADS && i < num_files; i++) {  
-        pthread_create(&threads[i], NULL, process_jobs_thread, (void *)file_list);
-        job_data = job_data->next;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, process_jobs_thread, (void *)(intptr_t)i);
     }
 
     // Wait for all threads to complete
-    for (int i = 0; i < MAX_THREADS && i < num_files; i++) {  
+    for (int i = 0; i < num_threads; i++) {
         pthread_join(threads[i], NULL); 
     }
+    jobsched_stop();
+    if (command_threads > 0) {
+        jobdag_stop();
+    }
 
     // Registra a função de limpeza do FIFO para ser chamada ao sair
     atexit(cleanup_fifo);
 
-    // Wait for all child processes (backups) to finish
-    while (running_backups > 0) {                                                   // Wait for all child processes (backups) to finish
-        pid_t pid = waitpid(-1, NULL, 0);
-        if (pid > 0) {
-            __sync_fetch_and_sub(&running_backups, 1);                              // Atomically decrement running backups counter
-        } else if (pid == -1 && errno == ECHILD) {
-            break;                                                                  // No more child processes
-        }
-    }
-
     // Free memory allocated for the file list
     Job_data *current_job = file_list->job_data;  
     while (current_job != NULL) {
@@ -216,139 +372,387 @@ int main(int argc, char *argv[]) {
     return 0;
 }
 
-void handle_sigchld(int signo) {                                                    // Handler for SIGCHLD signals to clean up finished child processes
-    (void)signo;                                                                    // Suppress unused parameter warning
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-        __sync_fetch_and_sub(&running_backups, 1);                                  // Atomically decrement running backups counter
-    }
-}
+// Runs one command of a job. Returns the delay of a WAIT, 0 for any other command.
+static unsigned int run_command(enum Command command, const char *filename, CommandArgs *args, OutBuf *out,
+                                int *backup_count, BackupGroup *backups) {
+    size_t num_pairs = args->num_pairs;
+    switch (command) {
+        case CMD_WRITE:
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 0;
+            }
+            if (kvs_write(num_pairs, args->keys, args->values)) {
+                fprintf(stderr, "Failed to write pair\n");
+            }
+            break;
 
+        case CMD_WRITE_TTL:
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 0;
+            }
+            if (kvs_write_ttl(num_pairs, args->keys, args->values, args->ttls)) {
+                fprintf(stderr, "Failed to write pair\n");
+            }
+            break;
 
-void perform_backup(const char *filename, int backup_num) {                         // Perform a backup operation in a child process
-    char backup_filename[MAX_JOB_FILE_NAME_SIZE];                                   // Generate the backup file name
-    snprintf(backup_filename, sizeof(backup_filename), "%.*s-%d.bck",
-        (int)(strlen(filename) - 4), filename, backup_num+1);
+        case CMD_READ:
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 0;
+            }
+            if (kvs_read(num_pairs, args->keys, out)) {
+                fprintf(stderr, "Failed to read pair\n");
+            }
+            break;
 
-    int backup_fd = open(backup_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);      // Open the backup file
-    if (backup_fd == -1) {
-        perror("Failed to create backup file");
-        return;
-    } else {
-        fprintf(stderr, "Backup file created: %s\n", backup_filename);
-    }
+        case CMD_READ_RANGE:
+            if (num_pairs != 2) {                                               // Exactly [from,to]
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 0;
+            }
+            if (kvs_read_range(args->keys[0].data, args->keys[1].data, out)) {
+                fprintf(stderr, "Failed to read range\n");
+            }
+            break;
 
-    if (kvs_backup(backup_fd) != 0) {                                               // Execute the backup operation
-        fprintf(stderr, "Failed to write backup to %s\n", backup_filename);
-        close(backup_fd);
-        return;
+        case CMD_DELETE:
+            if (num_pairs == 0) {
+                fprintf(stderr, "Invalid command. See HELP for usage\n");
+                return 0;
+            }
+            kvs_delete(num_pairs, args->keys, out);
+            break;
+
+        case CMD_SHOW:
+            kvs_show(out);
+            break;
+
+        case CMD_STATS:
+            kvs_stats(out);
+            break;
+
+        case CMD_WAIT:
+            if (args->delay > 0) {
+                outbuf_flush(out);                                              // The output so far is visible during the wait
+                return args->delay;                                             // The job is parked, its thread goes on with others
+            }
+            break;
+
+        case CMD_BACKUP:
+            if (kvs_backup_async(filename, backup_count, backups)) {
+                fprintf(stderr, "Failed to perform backup.\n");
+            }
+            break;
+
+        case CMD_INVALID:
+            outbuf_puts(out, "Invalid command. See HELP for usage\n");
+            break;
+
+        case CMD_HELP:
+            outbuf_puts(out,
+                "Available commands:\n"
+                "  WRITE [(key,value)(key2,value2),...]\n"
+                "  WRITE_TTL [(key,value,ms)(key2,value2,ms2),...]\n"
+                "  READ [key,key2,...]\n"
+                "  READ_RANGE [from,to]\n"
+                "  DELETE [key,key2,...]\n"
+                "  SHOW\n"
+                "  STATS\n"
+                "  WAIT <delay_ms>\n"
+                "  BACKUP\n"
+                "  HELP\n"
+            );
+            break;
+
+        case CMD_EMPTY:
+            break;
+        case EOC:
+            break;
     }
+    return 0;
+}
 
-    close(backup_fd);
+// Runs one command of a parallel window (jobdag.h), on a job or helper thread.
+static void run_dag_command(enum Command command, CommandArgs *args, OutBuf *out) {
+    run_command(command, NULL, args, out, NULL, NULL);                              // BACKUP is a barrier, never in a window
 }
 
-int process_job_file(const char *filename) {                                        // Process a .job file and execute the associated commands
-    int backup_count = 0;                                                           // Counter for backups performed for this job
+// Runs the commands of a job until its input ends, until end bytes of a text job were
+// read, or until a WAIT. With a window, the commands between barriers run as a
+// dependency graph. Returns the delay of the WAIT, 0 once the commands ran out.
+static unsigned int run_commands(const char *filename, Reader *reader, JobcFile *jobc, size_t end, OutBuf *out,
+                         CommandArgs *args, JobDag *dag, int *backup_count, BackupGroup *backups) {
+    enum Command command;
+    while ((reader == NULL || reader_offset(reader) < end) &&
+           (command = reader == NULL ? jobc_next(jobc, args) : parse_command(reader, args)) != EOC) {
+        if (dag != NULL && !jobdag_is_barrier(command) && jobdag_add(dag, command, args) == 0) {
+            if (jobdag_full(dag)) {
+                jobdag_run(dag, out);
+            }
+            continue;
+        }
+        if (dag != NULL) {
+            jobdag_run(dag, out);                                                   // Everything before it is done first
+        }
+        unsigned int delay = run_command(command, filename, args, out, backup_count, backups);
+        if (delay > 0) {
+            return delay;
+        }
+    }
+    if (dag != NULL) {
+        jobdag_run(dag, out);
+    }
+    return 0;
+}
 
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) {
-        perror("Failed to open file");
-        return -1;
+// Appends a segment's output to the job's .out. Returns 0 on success.
+static int append_output(int output_fd, int segment_fd) {
+    uint8_t buffer[64 * 1024];
+    ssize_t bytes;
+    if (lseek(segment_fd, 0, SEEK_SET) != 0) {
+        return 1;
     }
+    while ((bytes = read(segment_fd, buffer, sizeof(buffer))) > 0) {
+        if (write_all(output_fd, buffer, (size_t)bytes) != 0) {
+            return 1;
+        }
+    }
+    return bytes < 0;
+}
 
-    char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    char values[MAX_WRITE_SIZE][MAX_STRING_SIZE] = {0};
-    unsigned int delay;
-    size_t num_pairs;
+// Ends a split job once its last segment is done: the outputs of the segments are
+// appended to the .out in order, as if the job ran in one piece.
+static void finish_split_job(Job_data *job) {
+    int failed = 0;
+    for (size_t i = 1; i < job->num_segments; i++) {
+        if (job->segment_fds[i] == -1 || append_output(job->output_fd, job->segment_fds[i]) != 0) {
+            failed = 1;
+        }
+        if (job->segment_fds[i] != -1) {
+            close(job->segment_fds[i]);
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to write the output of %s\n", job->file_path);
+    }
+    close(job->output_fd);
+    free(job->segments);
+    free(job->segment_fds);
+    free(job->offsets);
+    job->segments = NULL;
+    job->segment_fds = NULL;
+    job->offsets = NULL;
+}
 
-    char output_filename[MAX_JOB_FILE_NAME_SIZE];                                   // Create the output file name
-    snprintf(output_filename, sizeof(output_filename), "%.*s.out",
-        (int)(strlen(filename) - 4), filename);
+// Creates the state of a job or segment; open_task opens it. Returns 0 on success.
+static int start_task(JobSegment *task) {
+    Job_data *job = task->job;
+    int split = job->num_segments > 1;
+    int compiled = !split && jobc_is_compiled(job->file_path);
+    JobRun *run = malloc(sizeof(JobRun));
+    if (run == NULL) {
+        perror("Failed to allocate job buffers");
+        return 1;
+    }
+    if (compiled && jobc_open(job->file_path, &run->jobc) != 0) {
+        free(run);
+        return 1;
+    }
+    run->compiled = compiled;
+    run->position = split ? job->offsets[task->index] : 0;
+    run->end = split ? job->offsets[task->index + 1] - run->position : SIZE_MAX;
+    run->fd = -1;
+    run->reader = NULL;
+    run->output_fd = split && task->index == 0 ? job->output_fd : -1;
+    run->output_created = 0;
+    run->output_failed = 0;
+    run->out = NULL;
+    run->backup_count = 0;
+    backup_group_init(&run->backups);
+    task->run = run;
+    return 0;
+}
 
-    int output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (output_fd == -1) {
+// Opens the input and output of a job or segment where it stopped (at its start the
+// first time). Returns 0 on success.
+static int open_task(JobSegment *task) {
+    Job_data *job = task->job;
+    JobRun *run = task->run;
+    if (!run->compiled) {
+        run->fd = open(job->file_path, O_RDONLY);
+        if (run->fd == -1 || lseek(run->fd, (off_t)run->position, SEEK_SET) == -1) {
+            perror("Failed to open file");
+            return 1;
+        }
+    }
+    if (run->output_fd == -1 && job->num_segments > 1) {                            // Segments after the first: an unlinked temporary
+        char temp_filename[MAX_JOB_FILE_NAME_SIZE];                                 // file, appended to the .out by the last segment
+        snprintf(temp_filename, sizeof(temp_filename), "%.*s.out.XXXXXX", (int)job_name_length(job->file_path), job->file_path);
+        run->output_fd = mkstemp(temp_filename);
+        if (run->output_fd != -1) {
+            unlink(temp_filename);
+        }
+    } else if (run->output_fd == -1) {
+        char output_filename[MAX_JOB_FILE_NAME_SIZE];                               // Create the output file name
+        snprintf(output_filename, sizeof(output_filename), "%.*s.out",
+            (int)job_name_length(job->file_path), job->file_path);
+        run->output_fd = open(output_filename, O_WRONLY | O_CREAT | (run->output_created ? O_APPEND : O_TRUNC), 0644);
+        run->output_created = 1;
+    }
+    if (run->output_fd == -1) {
         perror("Failed to open output file");
-        close(fd);
-        return -1;
+        return 1;
+    }
+    run->out = malloc(sizeof(OutBuf));                                              // Too large for the job thread's stack
+    run->reader = run->compiled ? NULL : malloc(sizeof(Reader));
+    if (run->out == NULL || (!run->compiled && run->reader == NULL)) {
+        perror("Failed to allocate job buffers");
+        return 1;
+    }
+    outbuf_init(run->out, run->output_fd);
+    if (!run->compiled) {
+        reader_init(run->reader, run->fd);
     }
+    return 0;
+}
 
-    enum Command command;
-    while ((command = get_next(fd)) != EOC) {
-        switch (command) {
-            case CMD_WRITE:
-                num_pairs = (size_t)parse_write(fd, keys, values, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                if (kvs_write(num_pairs, keys, values)) {
-                    fprintf(stderr, "Failed to write pair\n");
-                }
-                break;
+// Closes what open_task opened, remembering where a text job stopped. The output of a
+// segment stays open: its temporary file is unlinked already.
+static void close_task(JobSegment *task) {
+    JobRun *run = task->run;
+    if (run->out != NULL && outbuf_flush(run->out) != 0) {
+        run->output_failed = 1;
+    }
+    if (run->reader != NULL) {
+        size_t bytes = reader_offset(run->reader);
+        run->position += bytes;
+        if (run->end != SIZE_MAX) {
+            run->end -= bytes;
+        }
+    }
+    free(run->reader);
+    free(run->out);
+    run->reader = NULL;
+    run->out = NULL;
+    if (run->fd != -1) {
+        close(run->fd);
+        run->fd = -1;
+    }
+    if (task->job->num_segments <= 1 && run->output_fd != -1) {
+        close(run->output_fd);
+        run->output_fd = -1;
+    }
+}
 
-            case CMD_READ:
-                num_pairs = (size_t)parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                if (kvs_read(num_pairs, keys, output_fd)) {
-                    fprintf(stderr, "Failed to read pair\n");
-                }
-                break;
+// Ends a job or segment. The last segment of a split job to end writes its .out.
+static void finish_task(JobSegment *task) {
+    Job_data *job = task->job;
+    JobRun *run = task->run;
+    int output_fd = -1;
+    if (run != NULL) {
+        close_task(task);
+        if (run->compiled && run->jobc.failed) {
+            fprintf(stderr, "Compiled job %s is corrupted\n", job->file_path);
+        }
+        if (run->compiled) {
+            jobc_close(&run->jobc);
+        }
+        if (run->output_failed) {
+            fprintf(stderr, "Failed to write the output of %s\n", job->file_path);
+        }
+        if (backup_group_finish(&run->backups) > 0) {                               // The job ends when its backups are written
+            fprintf(stderr, "Some backups of %s failed\n", job->file_path);
+        }
+        output_fd = run->output_fd;
+        free(run);
+        task->run = NULL;
+    }
+    if (job->num_segments <= 1) {
+        return;
+    }
+    if (task->index > 0) {
+        job->segment_fds[task->index] = output_fd;
+    }
+    if (__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_ACQ_REL) == 0) {            // Sees the outputs of every other segment
+        finish_split_job(job);
+    }
+}
 
-            case CMD_DELETE:
-                num_pairs = (size_t)parse_read_delete(fd, keys, MAX_WRITE_SIZE, MAX_STRING_SIZE);
-                if (num_pairs == 0) {
-                    fprintf(stderr, "Invalid command. See HELP for usage\n");
-                    continue;
-                }
-                kvs_delete(num_pairs, keys, output_fd);
-                break;
+// Runs a job or segment until it ends, or until a WAIT parks it in the scheduler, closed,
+// so that its thread goes on with other jobs. A task run inline was never queued and
+// is not parked: it waits like before. Returns 1 if the task was parked.
+static int run_task(JobSegment *task, CommandArgs *args, JobDag *dag, int may_park) {
+    if (task->run == NULL && start_task(task) != 0) {
+        finish_task(task);
+        return 0;
+    }
+    JobRun *run = task->run;
+    for (;;) {
+        if (run->out == NULL && open_task(task) != 0) {                             // Reported, the job ends here
+            break;
+        }
+        unsigned int delay = run_commands(task->job->file_path, run->reader, &run->jobc, run->end, run->out,
+                                          args, dag, &run->backup_count, &run->backups);
+        if (delay == 0) {
+            break;
+        }
+        close_task(task);                                                           // Before another thread can take it
+        if (may_park && jobsched_defer(task, delay) == 0) {
+            return 1;
+        }
+        kvs_wait(delay);
+    }
+    finish_task(task);
+    return 0;
+}
 
-            case CMD_SHOW:
-                kvs_show(output_fd);
-                break;
+// Plans the segments of a large text job. When it splits, its .out is opened and the
+// segments after the first are pushed at the front of the worker's deque, so idle
+// workers steal them while this worker runs the first one.
+static void split_job(Job_data *job, int worker, CommandArgs *args, JobDag *dag) {
+    job->num_segments = 1;
+    int fd = open(job->file_path, O_RDONLY);
+    if (fd == -1) {
+        return;                                                                     // Reported when the job runs
+    }
+    size_t *offsets;
+    size_t segments = job_split(fd, split_bytes, &offsets);
+    close(fd);
+    if (segments <= 1) {
+        free(segments == 1 ? offsets : NULL);
+        return;
+    }
 
-            case CMD_WAIT:
-                if (parse_wait(fd, &delay, NULL) == -1) {
-                    continue;
-                }
-                if (delay > 0) {
-                    kvs_wait(delay); 
-                }
-                break;
-
-            case CMD_BACKUP:
-                kvs_wait_backup(filename, &backup_count);
-                break;
-
-            case CMD_INVALID:
-                dprintf(output_fd, "Invalid command. See HELP for usage\n");
-                break;
-
-            case CMD_HELP:
-                dprintf(output_fd,
-                    "Available commands:\n"
-                    "  WRITE [(key,value)(key2,value2),...]\n"
-                    "  READ [key,key2,...]\n"
-                    "  DELETE [key,key2,...]\n"
-                    "  SHOW\n"
-                    "  WAIT <delay_ms>\n"
-                    "  BACKUP\n"
-                    "  HELP\n"
-                );
-                break;
-
-            case CMD_EMPTY:
-                break;
-            case EOC:
-                kvs_terminate();
-                return 0;
+    char output_filename[MAX_JOB_FILE_NAME_SIZE];
+    snprintf(output_filename, sizeof(output_filename), "%.*s.out", (int)job_name_length(job->file_path), job->file_path);
+    job->segments = malloc(segments * sizeof(JobSegment));
+    job->segment_fds = malloc(segments * sizeof(int));
+    job->output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job->segments == NULL || job->segment_fds == NULL || job->output_fd == -1) {
+        if (job->output_fd != -1) {
+            close(job->output_fd);
+        }
+        free(job->segments);
+        free(job->segment_fds);
+        free(offsets);
+        job->segments = NULL;
+        job->segment_fds = NULL;
+        return;                                                                     // Runs in one piece instead
+    }
+    job->offsets = offsets;
+    job->num_segments = segments;
+    job->remaining = (int)segments;
+    for (size_t i = 1; i < segments; i++) {
+        job->segment_fds[i] = -1;
+        job->segments[i] = (JobSegment){ job, i, NULL };
+    }
+    for (size_t i = segments - 1; i > 0; i--) {                                     // Pushed last to first, so they are taken in order
+        if (jobsched_push(worker, &job->segments[i], 1) != 0) {
+            run_task(&job->segments[i], args, dag, 0);                              // The keys are disjoint, any order will do
         }
     }
-    close(fd);
-    close(output_fd);
-    return 0;
 }
 
 void handle_client_session(int client_fifo_fd) {
@@ -372,6 +776,11 @@ void handle_client_session(int client_fifo_fd) {
     fprintf(stdout, "Client session ended.\n");
 }
 
+// A job file ends in .job, or .jobc once compiled (x.job.bak or x.jobs are not jobs).
+static int is_job_file(const char *path) {
+    return jobc_is_compiled(path) || job_name_length(path) < strlen(path);
+}
+
 File_list *process_directory(const char *dirpath) {                                 // Process all .job files in a given directory and create a job list
     DIR *dir = opendir(dirpath);
 
@@ -389,6 +798,7 @@ File_list *process_directory(const char *dirpath) {
         return NULL;
     }
 
+    file_list->job_data = NULL;
     file_list->num_files = 0;
 
     while ((entry = readdir(dir)) != NULL) {
@@ -399,12 +809,25 @@ File_list *process_directory(const char *dirpath) {
         }
 
         struct stat file_metadata;
-        if (stat(filepath, &file_metadata) == 0 && S_ISREG(file_metadata.st_mode) && strstr(entry->d_name, ".job")) {
+        if (!is_job_file(filepath)) {
+            continue;
+        }
+        if (!jobc_is_compiled(filepath)) {                                          // x.jobc is run instead of x.job, both would write x.out
+            char compiled[MAX_JOB_FILE_NAME_SIZE];
+            if ((size_t)snprintf(compiled, sizeof(compiled), "%sc", filepath) < sizeof(compiled) &&
+                stat(compiled, &file_metadata) == 0 && S_ISREG(file_metadata.st_mode)) {
+                continue;
+            }
+        }
+        if (stat(filepath, &file_metadata) == 0 && S_ISREG(file_metadata.st_mode)) {
             Job_data *job_data = (Job_data *)malloc(sizeof(Job_data));
             job_data->file_path = strdup(filepath);
-            job_data->running_backups = 0;
-            job_data->concurrent_backups = concurrent_backups;
-            job_data->status = 0;
+            job_data->size = (size_t)file_metadata.st_size;
+            job_data->first = (JobSegment){ job_data, 0, NULL };
+            job_data->segments = NULL;
+            job_data->offsets = NULL;
+            job_data->num_segments = 0;
+            job_data->segment_fds = NULL;
             job_data->next = NULL;
             if (file_list->job_data == NULL) { 
                 file_list->job_data = job_data;
@@ -424,18 +847,59 @@ File_list *process_directory(const char *dirpath) {
 }
 
 void *process_jobs_thread(void *arg) {                                                   // Process the job list using threads, assigning a thread to each job
-    File_list *file_list = (File_list *)arg;
-    Job_data *job_data = file_list->job_data;
-    for (; job_data != NULL; job_data = job_data->next) {
-        pthread_mutex_lock(&file_list->mutex);
-        if (job_data->status == 0) {                                                // Process the job file if it has not been processed yet
-            job_data->status = 1;
-            process_job_file(job_data->file_path);
-            pthread_mutex_unlock(&file_list->mutex);
-            
+    int worker = (int)(intptr_t)arg;
+    CommandArgs args;                                                               // Reused by every command of the thread's jobs
+    command_args_init(&args);
+    JobDag window;                                                                  // Commands parsed ahead (--command-threads)
+    JobDag *dag = NULL;
+    if (jobdag_enabled()) {
+        if (jobdag_init(&window) == 0) {
+            dag = &window;
         } else {
-            pthread_mutex_unlock(&file_list->mutex);                                // Skip the job file if it has already been processed
+            perror("Failed to allocate the command window, commands run in order");
+        }
+    }
+    JobSegment *task;
+    while ((task = jobsched_next(worker)) != NULL) {
+        Job_data *job = task->job;
+        if (task->index == 0 && task->run == NULL && split_bytes > 0 && job->size / 2 >= split_bytes &&
+            !jobc_is_compiled(job->file_path)) {
+            split_job(job, worker, &args, dag);
+        }
+        if (run_task(task, &args, dag, 1) == 0) {                                   // Parked at a WAIT: not done yet
+            jobsched_done();
         }
     }
+    command_args_free(&args);
+    if (dag != NULL) {
+        jobdag_free(dag);
+    }
     return NULL;
 }
+
+static int compare_job_sizes(const void *a, const void *b) {
+    size_t size_a = (*(Job_data *const *)a)->size;
+    size_t size_b = (*(Job_data *const *)b)->size;
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;                          // Largest first
+}
+
+int seed_jobs(File_list *file_list, int workers) {                                  // Deal the jobs out to the workers' deques, largest first
+    if (jobsched_start(workers) != 0) {
+        return 1;
+    }
+    Job_data **jobs = malloc((size_t)file_list->num_files * sizeof(Job_data *));
+    if (jobs == NULL) {
+        return 1;
+    }
+    size_t count = 0;
+    for (Job_data *job_data = file_list->job_data; job_data != NULL; job_data = job_data->next) {
+        jobs[count++] = job_data;
+    }
+    qsort(jobs, count, sizeof(Job_data *), compare_job_sizes);
+    int failed = 0;
+    for (size_t i = 0; i < count && !failed; i++) {
+        failed = jobsched_push((int)(i % (size_t)workers), &jobs[i]->first, 0);
+    }
+    free(jobs);
+    return failed;
+}
@@ -4,17 +4,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "constants.h"
+#include "jobc.h"
 #include "kvs.h"
 #include "operations.h"
+#include "shards.h"
+#include "snapfile.h"
+#include "ttl.h"
+#include "wal.h"
 
 static struct HashTable* kvs_table = NULL;
-extern int concurrent_backups;
-extern int running_backups;
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -24,15 +26,59 @@ static struct timespec delay_to_timespec(unsigned int delay_ms) {
 }
 
 // Initializes the key-value store (KVS)
-int kvs_init() {
+int kvs_init(const KvsOptions *options) {
     if (kvs_table != NULL) {    
         char error_message[MAX_STRING_SIZE];
         snprintf(error_message, MAX_STRING_SIZE, "KVS state has already been initialized\n");
         write(STDERR_FILENO, error_message, strlen(error_message));
         return 1;
     }
-    kvs_table = create_hash_table();
-    return kvs_table == NULL;
+    kvs_table = create_hash_table(&options->table);
+    if (kvs_table == NULL) {
+        return 1;
+    }
+    if (options->restore_path != NULL) {                                            // Loaded before any thread can see the table
+        uint64_t pairs;
+        if (snapfile_restore(kvs_table, options->restore_path, &pairs) != 0) {
+            free_table(kvs_table);
+            kvs_table = NULL;
+            return 1;
+        }
+        printf("Restored %lu pairs from %s\n", (unsigned long)pairs, options->restore_path);
+    }
+    if (ttl_start(kvs_table) != 0) {                                                // Sleeps until a WRITE_TTL schedules a deadline
+        free_table(kvs_table);
+        kvs_table = NULL;
+        return 1;
+    }
+    if (options->wal_path != NULL) {                                                // Replayed on top of the restored snapshot
+        unsigned long records;
+        if (wal_start(kvs_table, options->wal_path, options->wal_sync, options->wal_interval_ms, &records) != 0) {
+            ttl_stop();
+            free_table(kvs_table);
+            kvs_table = NULL;
+            return 1;
+        }
+        if (records > 0) {
+            printf("Replayed %lu records from %s\n", records, options->wal_path);
+        }
+    }
+    if (backup_start(kvs_table, options->backup_workers, options->backup_format, options->backup_threads) != 0) {
+        wal_stop();
+        ttl_stop();
+        free_table(kvs_table);
+        kvs_table = NULL;
+        return 1;
+    }
+    if (options->shards > 0 && shards_start(kvs_table, options->shards, options->max_clients) != 0) {
+        backup_stop();
+        wal_stop();
+        ttl_stop();
+        free_table(kvs_table);
+        kvs_table = NULL;
+        return 1;
+    }
+    return 0;
 }
 
 // Terminates the key-value store (KVS)
@@ -43,138 +89,207 @@ int kvs_terminate() {
         write(STDERR_FILENO, error_message, strlen(error_message));
         return 1;
     }
+    backup_stop();                                                                              // Writes the backups still queued
+    if (shards_enabled()) {
+        shards_stop();
+    }
+    wal_stop();                                                                                 // Syncs the changes still pending
+    ttl_stop();
     free_table(kvs_table);
     return 0;
 }
 
 // Writes one or more key-value pairs to the KVS
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]) {
+int kvs_write(size_t num_pairs, const Span *keys, const Span *values) {
     if (kvs_table == NULL) {
         char error_message[MAX_STRING_SIZE];
         snprintf(error_message, MAX_STRING_SIZE, " write KVS state must be initialized\n");
         write(STDERR_FILENO, error_message, strlen(error_message));
         return 1;
     }
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-            char error_message[MAX_STRING_SIZE];
-            snprintf(error_message, MAX_STRING_SIZE, "Failed to write keypair (%s,%s)\n", keys[i], values[i]);
-            write(STDERR_FILENO, error_message, strlen(error_message));
-        }
+    int result = shards_enabled() ? shard_write_pairs(num_pairs, keys, values)
+                                  : write_pairs(kvs_table, num_pairs, keys, values);            // Every pair is applied under the same locks
+    wal_sync();
+    if (result != 0) {
+        char error_message[MAX_STRING_SIZE];
+        snprintf(error_message, MAX_STRING_SIZE, "Failed to write some keypairs\n");
+        write(STDERR_FILENO, error_message, strlen(error_message));
     }
     return 0;
 }
 
-// Reads one or more key-value pairs from the KVS
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd) {
+// Writes one or more key-value pairs that expire after ttls[i] milliseconds
+int kvs_write_ttl(size_t num_pairs, const Span *keys, const Span *values, const unsigned int *ttls) {
     if (kvs_table == NULL) {
         char error_message[MAX_STRING_SIZE];
-        snprintf(error_message, MAX_STRING_SIZE, " read KVS state must be initialized\n");
+        snprintf(error_message, MAX_STRING_SIZE, " write KVS state must be initialized\n");
         write(STDERR_FILENO, error_message, strlen(error_message));
         return 1;
     }
-
-    qsort(keys, num_pairs, sizeof(keys[0]), (int (*)(const void*, const void*)) strcmp);        // Sort the keys alphabetically
-
-    dprintf(output_fd, "[");
+    uint64_t now = monotonic_ms();
+    uint64_t *expires_at = malloc(num_pairs * sizeof(uint64_t));                                // Batches have no size limit, too large for the stack
+    if (expires_at == NULL) {
+        char error_message[MAX_STRING_SIZE];
+        snprintf(error_message, MAX_STRING_SIZE, "Failed to write some keypairs\n");
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        return 0;
+    }
+    for (size_t i = 0; i < num_pairs; i++) {
+        expires_at[i] = now + ttls[i];
+    }
+    int result = write_pairs_ttl(kvs_table, num_pairs, keys, values, expires_at);              // Not routed to the shards, the bucket locks suffice
     for (size_t i = 0; i < num_pairs; i++) {
-        char* result = read_pair(kvs_table, keys[i]);
-        if (result == NULL) {
-            dprintf(output_fd,"(%s,KVSERROR)", keys[i]);                                        // When the key is not found
-        } else {
-            dprintf(output_fd,"(%s,%s)", keys[i], result);                                      // When the key is found
+        if (ttl_schedule(&keys[i], expires_at[i]) != 0) {                                        // Still invisible once expired, just reclaimed later
+            result = 1;
         }
-        free(result);
     }
-    dprintf(output_fd, "]\n");
+    free(expires_at);
+    wal_sync();
+    if (result != 0) {
+        char error_message[MAX_STRING_SIZE];
+        snprintf(error_message, MAX_STRING_SIZE, "Failed to write some keypairs\n");
+        write(STDERR_FILENO, error_message, strlen(error_message));
+    }
     return 0;
 }
 
-// Deletes one or more key-value pairs from the KVS
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd) {
-  pthread_mutex_lock(&kvs_table->table_mutex);
+// Writes a pair in the "(key,value)" format used by READ (KVSERROR when value is NULL)
+static void print_read_pair(const char *key, const char *value, void *arg) {
+    OutBuf *out = arg;
+    outbuf_write(out, "(", 1);
+    outbuf_puts(out, key);
+    outbuf_write(out, ",", 1);
+    outbuf_puts(out, value != NULL ? value : "KVSERROR");
+    outbuf_write(out, ")", 1);
+}
 
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(((const Span *)a)->data, ((const Span *)b)->data);
+}
+
+// Reads one or more key-value pairs from the KVS
+int kvs_read(size_t num_pairs, Span *keys, OutBuf *out) {
     if (kvs_table == NULL) {
         char error_message[MAX_STRING_SIZE];
-        snprintf(error_message, MAX_STRING_SIZE, "delete KVS state must be initialized\n");
+        snprintf(error_message, MAX_STRING_SIZE, " read KVS state must be initialized\n");
         write(STDERR_FILENO, error_message, strlen(error_message));
-        pthread_mutex_unlock(&kvs_table->table_mutex); 
         return 1;
     }
-    int aux = 0;
 
-    for (size_t i = 0; i < num_pairs; i++) {
-        if (delete_pair(kvs_table, keys[i]) != 0) {
-            if (!aux) {
-                dprintf(output_fd,"[");
-                aux = 1;
-            }
-            dprintf(output_fd,"(%s,KVSMISSING)", keys[i]);                                      // When the key is not found
-        }
+    size_t sorted = 1;
+    while (sorted < num_pairs && strcmp(keys[sorted - 1].data, keys[sorted].data) <= 0) {
+        sorted++;
+    }
+    if (sorted < num_pairs) {                                                                   // Sort the keys alphabetically, unless they already are
+        qsort(keys, num_pairs, sizeof(keys[0]), compare_keys);                                  // Only the spans move
     }
-    if (aux) {
-        dprintf(output_fd,"]\n");
+
+    outbuf_write(out, "[", 1);
+    if (shards_enabled()) {
+        shard_read_pairs(num_pairs, keys, print_read_pair, out);                                // Replies are printed in key order
+    } else {
+        read_pairs(kvs_table, num_pairs, keys, print_read_pair, out);                           // Values are printed straight from the table
     }
-    pthread_mutex_unlock(&kvs_table->table_mutex);
+    outbuf_write(out, "]\n", 2);
     return 0;
 }
 
-// Writes the state of the KVS
-void kvs_show(int output_fd) {
-    pthread_mutex_lock(&kvs_table->table_mutex);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = kvs_table->table[i];
-        while (keyNode != NULL) {
-            dprintf(output_fd, "(%s, %s)\n", keyNode->key, keyNode->value);
-            keyNode = keyNode->next;
-        }
+// Reads the key-value pairs of a key range from the KVS
+int kvs_read_range(const char *from, const char *to, OutBuf *out) {
+    if (kvs_table == NULL) {
+        char error_message[MAX_STRING_SIZE];
+        snprintf(error_message, MAX_STRING_SIZE, " read KVS state must be initialized\n");
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        return 1;
+    }
+
+    outbuf_write(out, "[", 1);
+    int result = read_range(kvs_table, from, to, print_read_pair, out);                         // Pairs come in key order
+    outbuf_write(out, "]\n", 2);
+    return result;
+}
+
+// Output of a DELETE: the missing keys are listed between brackets, if there are any
+typedef struct DeleteOutput {
+    OutBuf *out;
+    int aux;                                                                                    // Set once "[" was written
+} DeleteOutput;
+
+static void print_missing_key(const char *key, void *arg) {
+    DeleteOutput *output = arg;
+    if (!output->aux) {
+        outbuf_write(output->out, "[", 1);
+        output->aux = 1;
     }
-    pthread_mutex_unlock(&kvs_table->table_mutex);
+    outbuf_write(output->out, "(", 1);                                                          // When the key is not found
+    outbuf_puts(output->out, key);
+    outbuf_puts(output->out, ",KVSMISSING)");
 }
 
-// Creates a backup of the KVS state
-int kvs_backup(int output_fd) {
+// Deletes one or more key-value pairs from the KVS
+int kvs_delete(size_t num_pairs, const Span *keys, OutBuf *out) {
     if (kvs_table == NULL) {
         char error_message[MAX_STRING_SIZE];
-        snprintf(error_message, MAX_STRING_SIZE, "backup KVS state must be initialized\n");
+        snprintf(error_message, MAX_STRING_SIZE, "delete KVS state must be initialized\n");
         write(STDERR_FILENO, error_message, strlen(error_message));
         return 1;
     }
 
-    for (int i = 0; i < TABLE_SIZE; i++) {                                                      // Iterate over the elements of the table and writes them
-        KeyNode *keyNode = kvs_table->table[i];
-        while (keyNode != NULL) {
-            dprintf(output_fd, "(%s, %s)\n", keyNode->key, keyNode->value);
-            keyNode = keyNode->next;
-        }
+    DeleteOutput output = { out, 0 };
+    if (shards_enabled()) {
+        shard_delete_pairs(num_pairs, keys, print_missing_key, &output);
+    } else {
+        delete_pairs(kvs_table, num_pairs, keys, print_missing_key, &output);                   // Locks only the buckets of the keys
+    }
+    wal_sync();
+    if (output.aux) {
+        outbuf_write(out, "]\n", 2);
     }
-    return 0;                                                                                   // Backup was successful
+    return 0;
 }
 
-// Waits for the last backup to be called
-void kvs_wait_backup(const char *filename, int *backup_count) { 
-    while(1){
-        if (running_backups <= concurrent_backups){
-            break;
-        }
-        wait(NULL);
-    }
-    pid_t pid = fork();
+// Writes a pair in the "(key, value)" format used by SHOW and BACKUP
+static void print_pair(const char *key, const char *value, void *arg) {
+    OutBuf *out = arg;
+    outbuf_write(out, "(", 1);
+    outbuf_puts(out, key);
+    outbuf_write(out, ", ", 2);
+    outbuf_puts(out, value);
+    outbuf_write(out, ")\n", 2);
+}
 
-    if (pid == 0) {
-        perform_backup(filename, *backup_count);                                                // Child process 
-        exit(EXIT_SUCCESS);
-    } else if (pid > 0) {
-        (*backup_count)++;                                                                      // Parent process
-        __sync_fetch_and_add(&running_backups, 1);                                              // Atomically increment the counter
+// Writes the state of the KVS
+void kvs_show(OutBuf *out) {
+    foreach_pair(kvs_table, print_pair, out);                                                   // Pairs are visited in key order
+}
 
-        pid_t child_pid = waitpid(pid, NULL, 0);                                                // Wait for the child process to finish
-        if (child_pid > 0) {
-            __sync_fetch_and_sub(&running_backups, 1);                                          // Atomically decrement after success
-        }
-    } else {
-        perror("Failed to fork process for backup");                                            // Error handling
+// Writes the memory counters of the KVS
+void kvs_stats(OutBuf *out) {
+    TableStats stats;
+    table_stats(kvs_table, &stats);
+    outbuf_puts(out, "(pairs, ");
+    outbuf_put_u64(out, stats.pairs);
+    outbuf_puts(out, ")\n(resident_bytes, ");
+    outbuf_put_u64(out, stats.resident_bytes);
+    outbuf_puts(out, ")\n(evictions, ");
+    outbuf_put_u64(out, stats.evictions);
+    outbuf_puts(out, ")\n(expirations, ");
+    outbuf_put_u64(out, stats.expirations);
+    outbuf_write(out, ")\n", 2);
+}
+
+// Queues a backup of the KVS state to <job>-<n>.bck
+int kvs_backup_async(const char *filename, int *backup_count, BackupGroup *group) {
+    if (kvs_table == NULL) {
+        char error_message[MAX_STRING_SIZE];
+        snprintf(error_message, MAX_STRING_SIZE, "backup KVS state must be initialized\n");
+        write(STDERR_FILENO, error_message, strlen(error_message));
+        return 1;
     }
+
+    char backup_filename[MAX_JOB_FILE_NAME_SIZE];
+    snprintf(backup_filename, sizeof(backup_filename), "%.*s-%d.bck", (int)job_name_length(filename), filename, ++(*backup_count));
+    return backup_submit(backup_filename, group);                                               // Written by a backup worker
 }
 
 void kvs_wait(unsigned int delay_ms) {                                                          // Waits for a given amount of time
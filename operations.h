@@ -2,10 +2,29 @@
 #define KVS_OPERATIONS_H
 
 #include <stddef.h>
+#include "backup.h"
+#include "kvs.h"
+#include "outbuf.h"
+#include "wal.h"
+
+// Startup options of the KVS, given on the server command line.
+typedef struct KvsOptions {
+    TableConfig table;                                                              // Hash table layout (--engine, --ordered-index)
+    int shards;                                                                     // Shard executor threads, 0 for direct access (--shards)
+    int max_clients;                                                                // Job threads that may use the shards
+    int backup_workers;                                                             // Backups written at the same time (concurrent_backups)
+    enum BackupFormat backup_format;                                                // Format of the .bck files (--binary/delta-backups)
+    int backup_threads;                                                             // Threads serializing each backup (--backup-threads)
+    const char *restore_path;                                                       // Binary snapshot loaded at startup, or NULL (--restore)
+    const char *wal_path;                                                           // Write-ahead log, or NULL (--wal)
+    enum WalSync wal_sync;                                                          // When the WAL is synced (--wal-sync)
+    unsigned int wal_interval_ms;                                                   // Sync period with WAL_SYNC_INTERVAL
+} KvsOptions;
 
 /// Initializes the KVS state.
+/// @param options Startup options.
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
-int kvs_init();
+int kvs_init(const KvsOptions *options);
 
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
@@ -13,38 +32,56 @@ int kvs_terminate();
 
 /// Writes a key value pair to the KVS. If key already exists it is updated.
 /// @param num_pairs Number of pairs being written.
-/// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param keys Array of keys.
+/// @param values Array of values.
+/// @return 0 if the pairs were written successfully, 1 otherwise.
+int kvs_write(size_t num_pairs, const Span *keys, const Span *values);
+
+/// Writes key value pairs that expire after a given time. Expired pairs read as missing.
+/// @param num_pairs Number of pairs being written.
+/// @param keys Array of keys.
+/// @param values Array of values.
+/// @param ttls Time to live of each pair, in milliseconds.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write_ttl(size_t num_pairs, const Span *keys, const Span *values, const unsigned int *ttls);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param keys Array of keys, sorted in place.
+/// @param out Buffer of the output file.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd);
+int kvs_read(size_t num_pairs, Span *keys, OutBuf *out);
+
+/// Reads every pair whose key is between two keys (inclusive), in key order.
+/// @param from Smallest key of the range.
+/// @param to Largest key of the range.
+/// @param out Buffer of the output file.
+/// @return 0 if the range was read successfully, 1 otherwise.
+int kvs_read_range(const char *from, const char *to, OutBuf *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
+/// @param keys Array of keys.
+/// @param out Buffer of the output file, for the missing keys.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int output_fd);
+int kvs_delete(size_t num_pairs, const Span *keys, OutBuf *out);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int output_fd);
-
-/// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(int backup_fd);
+/// @param out Buffer of the output file.
+void kvs_show(OutBuf *out);
 
-/// Waits for the last backup to be called.
-void kvs_wait_backup(const char *filename, int *backup_count);
+/// Writes the memory counters of the KVS (pairs, resident bytes, evictions, expirations).
+/// @param out Buffer of the output file.
+void kvs_stats(OutBuf *out);
 
-/// Performs a backup of the KVS state.
-void perform_backup(const char *filename, int backup_num);
+/// Takes a snapshot of the KVS state and queues it to be written to the job's next
+/// backup file (<job>-<n>.bck) by the backup workers. Returns once the snapshot is
+/// taken; only blocks while the backup queue is full.
+/// @param filename Path of the .job file.
+/// @param backup_count Backups of the job so far, incremented.
+/// @param group Backups of the job, to wait for them when the job ends.
+/// @return 0 if the backup was queued successfully, 1 otherwise.
+int kvs_backup_async(const char *filename, int *backup_count, BackupGroup *group);
 
 /// Waits for a given amount of time.
 /// @param delay_us Delay in milliseconds.
@@ -0,0 +1,124 @@
+#include "outbuf.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+void outbuf_init(OutBuf *out, int fd) {
+    out->fd = fd;
+    out->failed = 0;
+    out->length = 0;
+    out->memory = NULL;
+    out->memory_length = 0;
+    out->memory_capacity = 0;
+}
+
+void outbuf_init_memory(OutBuf *out) {
+    outbuf_init(out, -1);
+}
+
+// Appends bytes to the memory of a buffer in memory mode. Returns 0 on success.
+static int keep_in_memory(OutBuf *out, const char *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (length > out->memory_capacity - out->memory_length) {
+        size_t capacity = out->memory_capacity > 0 ? out->memory_capacity : OUTBUF_SIZE;
+        while (capacity - out->memory_length < length) {
+            capacity *= 2;
+        }
+        char *memory = realloc(out->memory, capacity);
+        if (memory == NULL) {
+            return 1;
+        }
+        out->memory = memory;
+        out->memory_capacity = capacity;
+    }
+    memcpy(out->memory + out->memory_length, data, length);
+    out->memory_length += length;
+    return 0;
+}
+
+// Writes every byte of the vectors, retrying short writes.
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        size_t left = (size_t)written;
+        while (count > 0 && left >= iov->iov_len) {                                 // Skip the vectors written whole
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+void outbuf_spill(OutBuf *out, const char *data, size_t length) {
+    if (out->fd < 0) {
+        if (!out->failed && (keep_in_memory(out, out->data, out->length) != 0 || keep_in_memory(out, data, length) != 0)) {
+            out->failed = 1;
+        }
+        out->length = 0;
+        return;
+    }
+    struct iovec iov[2] = {
+        { out->data, out->length },
+        { (void *)data, length },
+    };
+    if (!out->failed && writev_all(out->fd, iov, 2) != 0) {
+        out->failed = 1;
+    }
+    out->length = 0;
+}
+
+int outbuf_flush(OutBuf *out) {
+    if (out->length > 0) {
+        outbuf_spill(out, NULL, 0);
+    }
+    return out->failed;
+}
+
+int outbuf_take(OutBuf *out, char **bytes, size_t *length) {
+    if (out->memory == NULL && out->length > 0 && !out->failed) {                   // Most outputs fit in the buffer: one copy
+        out->memory = malloc(out->length);
+        if (out->memory != NULL) {
+            memcpy(out->memory, out->data, out->length);
+            out->memory_length = out->length;
+            out->memory_capacity = out->length;
+            out->length = 0;
+        }
+    }
+    outbuf_spill(out, NULL, 0);
+    int failed = out->failed;
+    *bytes = failed ? NULL : out->memory;
+    *length = failed ? 0 : out->memory_length;
+    if (failed) {
+        free(out->memory);
+    }
+    out->failed = 0;
+    out->memory = NULL;
+    out->memory_length = 0;
+    out->memory_capacity = 0;
+    return failed;
+}
+
+void outbuf_put_u64(OutBuf *out, uint64_t value) {
+    char digits[20];
+    size_t start = sizeof(digits);
+    do {                                                                            // Least significant digit first
+        digits[--start] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    outbuf_write(out, digits + start, sizeof(digits) - start);
+}
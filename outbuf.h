@@ -0,0 +1,77 @@
+#ifndef KVS_OUTBUF_H
+#define KVS_OUTBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define OUTBUF_SIZE (64 * 1024)                                                     // Bytes gathered before a write()
+
+// Output buffer of a file (a job's .out, a text backup). The pairs are formatted into
+// it by hand, without printf, and reach the file in large writes: when the buffer is
+// full, and when its owner calls outbuf_flush. Used by one thread at a time. A buffer
+// started with outbuf_init_memory has no file: it keeps everything in memory until the
+// output is taken with outbuf_take.
+typedef struct OutBuf {
+    int fd;                                                                         // -1 in memory mode
+    int failed;                                                                     // A write failed, later output is dropped
+    size_t length;                                                                  // Bytes buffered
+    char *memory;                                                                   // Bytes spilled in memory mode (malloc)
+    size_t memory_length;
+    size_t memory_capacity;
+    char data[OUTBUF_SIZE];
+} OutBuf;
+
+/// Starts buffering the output of a file.
+/// @param out Buffer to initialize.
+/// @param fd File to write to.
+void outbuf_init(OutBuf *out, int fd);
+
+/// Starts gathering output in memory, for outbuf_take.
+/// @param out Buffer to initialize.
+void outbuf_init_memory(OutBuf *out);
+
+/// Takes the output gathered in memory mode, leaving the buffer empty and ready for more.
+/// @param out Output buffer in memory mode.
+/// @param bytes Receives the bytes, to be freed by the caller, or NULL when there are none.
+/// @param length Receives the number of bytes.
+/// @return 0 if the output was taken whole, 1 if some was lost (out of memory).
+int outbuf_take(OutBuf *out, char **bytes, size_t *length);
+
+/// Writes the buffered bytes, together with data, with one writev.
+/// @param out Output buffer.
+/// @param data Bytes that did not fit in the buffer.
+/// @param length Number of bytes.
+void outbuf_spill(OutBuf *out, const char *data, size_t length);
+
+/// Writes the buffered bytes to the file.
+/// @param out Output buffer.
+/// @return 0 if every byte written so far reached the file, 1 otherwise.
+int outbuf_flush(OutBuf *out);
+
+/// Appends bytes to the output.
+/// @param out Output buffer.
+/// @param data Bytes to append.
+/// @param length Number of bytes.
+static inline void outbuf_write(OutBuf *out, const char *data, size_t length) {
+    if (length <= OUTBUF_SIZE - out->length) {
+        memcpy(out->data + out->length, data, length);
+        out->length += length;
+    } else {
+        outbuf_spill(out, data, length);
+    }
+}
+
+/// Appends a string to the output.
+/// @param out Output buffer.
+/// @param string String to append.
+static inline void outbuf_puts(OutBuf *out, const char *string) {
+    outbuf_write(out, string, strlen(string));
+}
+
+/// Appends an unsigned number, in decimal, to the output.
+/// @param out Output buffer.
+/// @param value Number to append.
+void outbuf_put_u64(OutBuf *out, uint64_t value);
+
+#endif  // KVS_OUTBUF_H
@@ -3,6 +3,7 @@
 #include <dirent.h>                                                                 // For directory manipulation
 #include <fcntl.h>                                                                  // For open() and O_RDONLY
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>                                                                  // For perror() and snprintf()
 #include <stdlib.h>
 #include <string.h>
@@ -12,86 +13,30 @@
 
 #include "constants.h"
 
-// Reads a string from the file descriptor until a delimiter is found or the buffer is full.
-static int read_string(int fd, char *buffer, size_t max) {
-    ssize_t bytes_read;
-    char ch;
-    size_t i = 0;
-    int value = -1;
-
-    while (i < max) {
-        bytes_read = read(fd, &ch, 1);                                              // Read a single character from the file descriptor
-
-        if (bytes_read <= 0) {
-            return -1;
-        }
-
-        if (ch == ' ') {
-            return -1;
-        }
-
-        if (ch == ',') {
-            value = 0;
-            break;
-        }
-        else if (ch == ')') {
-            value = 1;
-            break;
-        }
-        else if (ch == ']') {
-            value = 2;
-            break;
-        }
-        buffer[i++] = ch;                                                           // Store the character in the buffer
-    }
-    buffer[i] = '\0';                                                               // Null-terminate the string
-    return value;
-}
-
-// Reads an unsigned integer from the file descriptor.
-static int read_uint(int fd, unsigned int *value, char *next) {
-    char buf[16];
-    int i = 0;
-    while (1) {                                                                     // Read characters until a non-digit character is found
-        if (read(fd, buf + i, 1) == 0) {
-            *next = '\0';
-            break;
-        }
-        *next = buf[i];
-
-        if (buf[i] > '9' || buf[i] < '0') {                                         // Check if the character is a digit
-            buf[i] = '\0';
-            break;
-        }
-        i++;
-    }
-
-    unsigned long ul = strtoul(buf, NULL, 10);                                      // Convert the string to an unsigned long
-
-    if (ul > UINT_MAX) {
-        return 1;
-    }
-
-    *value = (unsigned int)ul;
-    return 0;
-    }
-
-static void cleanup(int fd) {
-    char ch;
-    while (read(fd, &ch, 1) == 1 && ch != '\n');
-}
-
-enum Command get_next(int fd) {
+enum Command get_next(Reader *reader) {
     char buf[16];
-    if (read(fd, buf, 1) != 1) {
+    if (reader_read(reader, buf, 1) != 1) {
         return EOC;
     }
 
     switch (buf[0]) {
         case 'W':
-        if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-            if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-                cleanup(fd);
+        if (reader_read(reader, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+            if (reader_read(reader, buf + 5, 1) != 1 || strncmp(buf, "WRITE", 5) != 0) {
+                reader_skip_line(reader);
+                return CMD_INVALID;
+            }
+
+            if (buf[5] == '_') {
+                if (reader_read(reader, buf + 6, 4) != 4 || strncmp(buf, "WRITE_TTL ", 10) != 0) {
+                    reader_skip_line(reader);
+                    return CMD_INVALID;
+                }
+                return CMD_WRITE_TTL;
+            }
+
+            if (buf[5] != ' ') {
+                reader_skip_line(reader);
                 return CMD_INVALID;
             }
             return CMD_WRITE;
@@ -100,82 +45,168 @@ enum Command get_next(int fd) {
         return CMD_WAIT;
 
         case 'R':
-        if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-            cleanup(fd);
+        if (reader_read(reader, buf + 1, 4) != 4 || strncmp(buf, "READ", 4) != 0) {
+            reader_skip_line(reader);
+            return CMD_INVALID;
+        }
+
+        if (buf[4] == '_') {
+            if (reader_read(reader, buf + 5, 6) != 6 || strncmp(buf, "READ_RANGE ", 11) != 0) {
+                reader_skip_line(reader);
+                return CMD_INVALID;
+            }
+            return CMD_READ_RANGE;
+        }
+
+        if (buf[4] != ' ') {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
         return CMD_READ;
 
         case 'D':
-        if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-            cleanup(fd);
+        if (reader_read(reader, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
         return CMD_DELETE;
 
         case 'S':
-        if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-            cleanup(fd);
+        if (reader_read(reader, buf + 1, 3) != 3) {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
-        if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-            cleanup(fd);
+        if (strncmp(buf, "STAT", 4) == 0) {
+            if (reader_read(reader, buf + 4, 1) != 1 || buf[4] != 'S') {
+                reader_skip_line(reader);
+                return CMD_INVALID;
+            }
+
+            if (reader_read(reader, buf + 5, 1) != 0 && buf[5] != '\n') {
+                reader_skip_line(reader);
+                return CMD_INVALID;
+            }
+
+            return CMD_STATS;
+        }
+
+        if (strncmp(buf, "SHOW", 4) != 0) {
+            reader_skip_line(reader);
+            return CMD_INVALID;
+        }
+
+        if (reader_read(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
         return CMD_SHOW;
 
         case 'B':
-        if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-            cleanup(fd);
+        if (reader_read(reader, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
-        if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-            cleanup(fd);
+        if (reader_read(reader, buf + 6, 1) != 0 && buf[6] != '\n') {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
         return CMD_BACKUP;
 
         case 'H':
-        if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-            cleanup(fd);
+        if (reader_read(reader, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
-        if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-            cleanup(fd);
+        if (reader_read(reader, buf + 4, 1) != 0 && buf[4] != '\n') {
+            reader_skip_line(reader);
             return CMD_INVALID;
         }
 
         return CMD_HELP;
 
         case '#':
-            cleanup(fd);
+            reader_skip_line(reader);
             return CMD_EMPTY;
 
         case '\n':
             return CMD_EMPTY;
 
         default:
-            cleanup(fd);
+            reader_skip_line(reader);
             return CMD_INVALID;
     }
 }
 
+void command_args_init(CommandArgs *args) {
+    memset(args, 0, sizeof(*args));
+    arena_init(&args->arena);
+}
+
+int command_args_reserve(CommandArgs *args, size_t num_pairs) {
+    if (num_pairs <= args->capacity) {
+        return 0;
+    }
+    size_t capacity = args->capacity > 0 ? args->capacity * 2 : 64;
+    while (capacity < num_pairs) {
+        capacity *= 2;
+    }
+    Span *keys = realloc(args->keys, capacity * sizeof(*keys));
+    if (keys != NULL) {
+        args->keys = keys;
+    }
+    Span *values = realloc(args->values, capacity * sizeof(*values));
+    if (values != NULL) {
+        args->values = values;
+    }
+    unsigned int *ttls = realloc(args->ttls, capacity * sizeof(*ttls));
+    if (ttls != NULL) {
+        args->ttls = ttls;
+    }
+    if (keys == NULL || values == NULL || ttls == NULL) {
+        return 1;
+    }
+    args->capacity = capacity;
+    return 0;
+}
+
+void command_args_free(CommandArgs *args) {
+    arena_free(&args->arena);
+    free(args->keys);
+    free(args->values);
+    free(args->ttls);
+    memset(args, 0, sizeof(*args));
+}
+
+// Reads a string straight into the arena (see reader_string).
+static int parse_string(Reader *reader, Arena *arena, Span *string, size_t size) {
+    char *buffer = arena_reserve(arena, size);
+    if (buffer == NULL) {
+        return -1;
+    }
+    int delimiter = reader_string(reader, buffer, size, &string->length);
+    if (delimiter >= 0) {
+        string->data = buffer;
+        arena_commit(arena, string->length + 1);
+    }
+    return delimiter;
+}
+
 // Parses a key-value pair from the file descriptor.
-int parse_pair(int fd, char *key, char *value) {
-    if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-        cleanup(fd);
+static int parse_pair(Reader *reader, CommandArgs *args, size_t i, size_t max_string_size) {
+    if (parse_string(reader, &args->arena, &args->keys[i], max_string_size) != 0) {
+        reader_skip_line(reader);
         return 0;
     }
 
-    if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-        cleanup(fd);
+    if (parse_string(reader, &args->arena, &args->values[i], max_string_size) != 1) {
+        reader_skip_line(reader);
         return 0;
     }
 
@@ -183,33 +214,30 @@ int parse_pair(int fd, char *key, char *value) {
 }
 
 // Parses a WRITE command from the file descriptor.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+size_t parse_write(Reader *reader, CommandArgs *args, size_t max_string_size) {
     char ch;
 
-    if (read(fd, &ch, 1) != 1 || ch != '[') {
-        cleanup(fd);
+    if (reader_read(reader, &ch, 1) != 1 || ch != '[') {
+        reader_skip_line(reader);
         return 0;
     }
 
-    if (read(fd, &ch, 1) != 1 || ch != '(') {
-        cleanup(fd);
+    if (reader_read(reader, &ch, 1) != 1 || ch != '(') {
+        reader_skip_line(reader);
         return 0;
     }
 
     size_t num_pairs = 0;                                                           // Number of key-value pairs
-    char key[max_string_size];
-    char value[max_string_size];
-    while (num_pairs < max_pairs) {
-        if (parse_pair(fd, key, value) == 0) {
-            cleanup(fd);
+    for (;;) {
+        if (command_args_reserve(args, num_pairs + 1) != 0 ||
+            parse_pair(reader, args, num_pairs, max_string_size) == 0) {            // Straight from the read buffer to the arena
+            reader_skip_line(reader);
             return 0;
         }
+        num_pairs++;
 
-        strcpy(keys[num_pairs], key);                                               // Copy the key and value to the arrays
-        strcpy(values[num_pairs++], value);                                         // Increment the number of key-value pairs
-
-        if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-            cleanup(fd);
+        if (reader_read(reader, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+            reader_skip_line(reader);
             return 0;
         }
 
@@ -218,13 +246,60 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
         }
     }
 
-    if (num_pairs == max_pairs) {
-        cleanup(fd);
+    if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+        reader_skip_line(reader);
         return 0;
     }
 
-    if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-        cleanup(fd);
+    return num_pairs;
+}
+
+// Parses a WRITE_TTL command from the file descriptor.
+size_t parse_write_ttl(Reader *reader, CommandArgs *args, size_t max_string_size) {
+    char ch;
+
+    if (reader_read(reader, &ch, 1) != 1 || ch != '[') {
+        reader_skip_line(reader);
+        return 0;
+    }
+
+    if (reader_read(reader, &ch, 1) != 1 || ch != '(') {
+        reader_skip_line(reader);
+        return 0;
+    }
+
+    size_t num_pairs = 0;
+    char ttl[16];
+    for (;;) {
+        if (command_args_reserve(args, num_pairs + 1) != 0 ||
+            parse_string(reader, &args->arena, &args->keys[num_pairs], max_string_size) != 0 ||
+            parse_string(reader, &args->arena, &args->values[num_pairs], max_string_size) != 0 ||
+            reader_string(reader, ttl, sizeof(ttl) - 1, NULL) != 1) {
+            reader_skip_line(reader);
+            return 0;
+        }
+
+        char *end;
+        unsigned long ms = strtoul(ttl, &end, 10);
+        if (ttl[0] < '0' || ttl[0] > '9' || *end != '\0' || ms > UINT_MAX) {         // Only digits
+            reader_skip_line(reader);
+            return 0;
+        }
+
+        args->ttls[num_pairs++] = (unsigned int)ms;
+
+        if (reader_read(reader, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
+            reader_skip_line(reader);
+            return 0;
+        }
+
+        if (ch == ']') {
+            break;
+        }
+    }
+
+    if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+        reader_skip_line(reader);
         return 0;
     }
 
@@ -232,24 +307,26 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
 }
 
 // Parses a READ or DELETE command from the file descriptor.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(Reader *reader, CommandArgs *args, size_t max_keys, size_t max_string_size) {
     char ch;
 
-    if (read(fd, &ch, 1) != 1 || ch != '[') {
-        cleanup(fd);
+    if (reader_read(reader, &ch, 1) != 1 || ch != '[') {
+        reader_skip_line(reader);
         return 0;
     }
 
     size_t num_keys = 0;
-    char key[max_string_size];
     while (num_keys < max_keys) {
-        int output = read_string(fd, key, max_string_size);
+        if (command_args_reserve(args, num_keys + 1) != 0) {
+            reader_skip_line(reader);
+            return 0;
+        }
+        int output = parse_string(reader, &args->arena, &args->keys[num_keys], max_string_size);
         if (output < 0 || output == 1) {
-            cleanup(fd);
+            reader_skip_line(reader);
             return 0;
         }
-
-        strcpy(keys[num_keys++], key);
+        num_keys++;
 
         if (output == 2){
             break;
@@ -257,12 +334,12 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
     }
 
     if (num_keys == max_keys) {
-        cleanup(fd);
+        reader_skip_line(reader);
         return 0;
     }
 
-    if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-        cleanup(fd);
+    if (reader_read(reader, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
+        reader_skip_line(reader);
         return 0;
     }
 
@@ -270,22 +347,22 @@ size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys,
 }
 
 // Parses a WAIT command from the file descriptor.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(Reader *reader, unsigned int *delay, unsigned int *thread_id) {
     char ch;
 
-    if (read_uint(fd, delay, &ch) != 0) {                                           // Read the delay
-        cleanup(fd);
+    if (reader_uint(reader, delay, &ch) != 0) {                                           // Read the delay
+        reader_skip_line(reader);
         return -1;
     }
 
     if (ch == ' ') {
         if (thread_id == NULL) {
-            cleanup(fd);
+            reader_skip_line(reader);
             return 0;
         }
 
-        if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-            cleanup(fd);
+        if (reader_uint(reader, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+            reader_skip_line(reader);
             return -1;
         }
 
@@ -293,11 +370,46 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
     } else if (ch == '\n' || ch == '\0') {
         return 0;
     } else {
-        cleanup(fd);
+        reader_skip_line(reader);
         return -1;
     }
 }
 
+enum Command parse_command(Reader *reader, CommandArgs *args) {
+    arena_reset(&args->arena);                                                      // The last command is done with its strings
+    enum Command command = get_next(reader);
+    args->num_pairs = 0;
+    switch (command) {
+        case CMD_WRITE:
+            args->num_pairs = parse_write(reader, args, MAX_STRING_SIZE);
+            break;
+        case CMD_WRITE_TTL:
+            args->num_pairs = parse_write_ttl(reader, args, MAX_STRING_SIZE);
+            break;
+        case CMD_READ:
+        case CMD_DELETE:
+            args->num_pairs = parse_read_delete(reader, args, SIZE_MAX, MAX_STRING_SIZE);
+            break;
+        case CMD_READ_RANGE:
+            args->num_pairs = parse_read_delete(reader, args, 3, MAX_STRING_SIZE);         // Exactly [from,to] is valid
+            break;
+        case CMD_WAIT:
+            if (parse_wait(reader, &args->delay, NULL) == -1) {
+                return CMD_EMPTY;
+            }
+            break;
+        case CMD_SHOW:
+        case CMD_STATS:
+        case CMD_BACKUP:
+        case CMD_HELP:
+        case CMD_EMPTY:
+        case CMD_INVALID:
+        case EOC:
+            break;
+    }
+    return command;
+}
+
 void process_job_files(const char *dir_path) {                                      // Process all .job files in a given directory
     DIR *dir = opendir(dir_path);
     struct dirent *entry;
@@ -2,13 +2,19 @@
 #define KVS_PARSER_H
 
 #include <stddef.h>
+#include "arena.h"
 #include "constants.h"
+#include "reader.h"
+#include "span.h"
 
 enum Command {
     CMD_WRITE,
+    CMD_WRITE_TTL,
     CMD_READ,
+    CMD_READ_RANGE,
     CMD_DELETE,
     CMD_SHOW,
+    CMD_STATS,
     CMD_WAIT,
     CMD_BACKUP,
     CMD_HELP,
@@ -17,33 +23,73 @@ enum Command {
     EOC  // End of commands
 };
 
+// Arguments of a command, rebuilt by every parse_command or jobc_next. The strings
+// are in the arena (or in the mapped .jobc file), with their lengths, and the arrays
+// grow to the largest command seen, so a job thread keeps one CommandArgs for all its
+// jobs and a command has no size limit.
+typedef struct CommandArgs {
+    Arena arena;                                                                    // Strings of the last text command
+    Span *keys;
+    Span *values;                                                                   // WRITE, WRITE_TTL
+    unsigned int *ttls;                                                             // WRITE_TTL
+    size_t capacity;                                                                // Pairs the arrays can hold
+    size_t num_pairs;                                                               // Pairs or keys of the command
+    unsigned int delay;                                                             // WAIT
+} CommandArgs;
+
 /// Reads a command from a line and returns the corresponding command type.
-/// @param line The line to parse.
+/// @param reader Reader of the job file.
 /// @return The command read.
-enum Command get_next(int fd);
+enum Command get_next(Reader *reader);
+
+/// Starts the arguments of a job thread, empty until the first command.
+/// @param args Arguments to initialize.
+void command_args_init(CommandArgs *args);
+
+/// Makes room for a number of pairs in the arrays of a command.
+/// @param args Arguments of the command.
+/// @param num_pairs Pairs the arrays must hold.
+/// @return 0 on success, 1 if out of memory.
+int command_args_reserve(CommandArgs *args, size_t num_pairs);
+
+/// Frees the arrays and the arena of a job thread's arguments.
+/// @param args Arguments to free.
+void command_args_free(CommandArgs *args);
 
-/// Parses a WRITE command from a line.
-/// @param line The line containing the WRITE command.
-/// @param keys Array to store parsed keys.
-/// @param values Array to store parsed values.
-/// @param max_keys Maximum number of key-value pairs to parse.
+/// Parses a WRITE command from a line, into the arena of args.
+/// @param reader Reader of the job file, after the WRITE command.
+/// @param args Receives the keys and values.
 /// @param max_string_size Maximum size for keys and values.
 /// @return The number of key-value pairs parsed, or 0 on error.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(Reader *reader, CommandArgs *args, size_t max_string_size);
+
+/// Parses a WRITE_TTL command from a line: (key,value,ttl) triples, ttl in milliseconds.
+/// @param reader Reader of the job file, after the WRITE_TTL command.
+/// @param args Receives the keys, values and TTLs.
+/// @param max_string_size Maximum size for keys and values.
+/// @return The number of triples parsed, or 0 on error.
+size_t parse_write_ttl(Reader *reader, CommandArgs *args, size_t max_string_size);
 
 /// Parses a READ or DELETE command from a line.
-/// @param line The line containing the READ or DELETE command.
-/// @param keys Array to store parsed keys.
-/// @param max_keys Maximum number of keys to parse.
+/// @param reader Reader of the job file, after the READ or DELETE command.
+/// @param args Receives the keys.
+/// @param max_keys Keys accepted, plus one (SIZE_MAX for no limit).
 /// @param max_string_size Maximum size for keys.
 /// @return The number of keys parsed, or 0 on error.
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(Reader *reader, CommandArgs *args, size_t max_keys, size_t max_string_size);
 
 /// Parses a WAIT command from a line.
-/// @param line The line containing the WAIT command.
+/// @param reader Reader of the job file, after the WAIT command.
 /// @param delay Pointer to store the parsed delay (in milliseconds).
 /// @param thread_id Pointer to store the thread ID, if specified (optional).
 /// @return 0 if the delay was parsed successfully, or -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(Reader *reader, unsigned int *delay, unsigned int *thread_id);
+
+/// Reads the next command and its arguments (get_next followed by its parse_* call).
+/// The strings of the previous command are dropped.
+/// @param reader Reader of the job file.
+/// @param args Receives the arguments: num_pairs is 0 if they were invalid.
+/// @return The command read; CMD_EMPTY for a malformed WAIT, which is skipped silently.
+enum Command parse_command(Reader *reader, CommandArgs *args);
 
 #endif  // KVS_PARSER_H
@@ -0,0 +1,223 @@
+#include "reader.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define READER_X86 1
+#else
+#define READER_X86 0
+#endif
+
+static inline int is_delimiter(char ch) {
+    return ch == ' ' || ch == ',' || ch == ')' || ch == ']';
+}
+
+// Each scanner returns the index of the first delimiter of p[0..length), or length.
+static size_t scan_scalar(const char *p, size_t length) {
+    size_t i = 0;
+    while (i < length && !is_delimiter(p[i])) {
+        i++;
+    }
+    return i;
+}
+
+#if READER_X86
+static size_t scan_sse2(const char *p, size_t length) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i paren = _mm_set1_epi8(')');
+    const __m128i bracket = _mm_set1_epi8(']');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, comma)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(block, paren), _mm_cmpeq_epi8(block, bracket)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);                  // One bit per byte
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    return i + scan_scalar(p + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *p, size_t length) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i paren = _mm256_set1_epi8(')');
+    const __m256i bracket = _mm256_set1_epi8(']');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(const void *)(p + i));
+        __m256i hits = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, comma)),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(block, paren), _mm256_cmpeq_epi8(block, bracket)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+    }
+    if (i + 16 <= length) {                                                         // Tail, in VEX code too: calling the SSE2
+        __m128i block = _mm_loadu_si128((const __m128i *)(const void *)(p + i));    // scanner would pay for the transition
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(space)),
+                                                 _mm_cmpeq_epi8(block, _mm256_castsi256_si128(comma))),
+                                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(paren)),
+                                                 _mm_cmpeq_epi8(block, _mm256_castsi256_si128(bracket))));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz(mask);
+        }
+        i += 16;
+    }
+    return i + scan_scalar(p + i, length - i);
+}
+#endif
+
+static size_t scan_auto(const char *p, size_t length);
+
+static size_t (*scan_delimiter)(const char *p, size_t length) = scan_auto;
+
+// Resolves READER_SCAN_AUTO on the first scan.
+static size_t scan_auto(const char *p, size_t length) {
+    reader_use_scan(READER_SCAN_AUTO);
+    return scan_delimiter(p, length);
+}
+
+int reader_use_scan(enum ReaderScan scan) {
+    size_t (*chosen)(const char *p, size_t length) = scan_scalar;
+    switch (scan) {
+        case READER_SCAN_AUTO:
+#if READER_X86
+            chosen = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+            break;
+        case READER_SCAN_SCALAR:
+            break;
+        case READER_SCAN_SSE2:
+#if READER_X86
+            chosen = scan_sse2;
+            break;
+#else
+            return 1;
+#endif
+        case READER_SCAN_AVX2:
+#if READER_X86
+            if (!__builtin_cpu_supports("avx2")) {
+                return 1;
+            }
+            chosen = scan_avx2;
+            break;
+#else
+            return 1;
+#endif
+    }
+    __atomic_store_n(&scan_delimiter, chosen, __ATOMIC_RELAXED);                    // Job threads may race to resolve AUTO
+    return 0;
+}
+
+void reader_init(Reader *reader, int fd) {
+    reader->fd = fd;
+    reader->consumed = 0;
+    reader->position = 0;
+    reader->length = 0;
+}
+
+size_t reader_fill(Reader *reader) {
+    ssize_t bytes_read;
+    reader->consumed += reader->length;
+    do {
+        bytes_read = read(reader->fd, reader->data, READER_BUFFER_SIZE);
+    } while (bytes_read < 0 && errno == EINTR);
+    reader->position = 0;
+    reader->length = bytes_read > 0 ? (size_t)bytes_read : 0;
+    return reader->length;
+}
+
+size_t reader_read_slow(Reader *reader, char *buffer, size_t count) {
+    size_t done = 0;
+    while (done < count) {
+        if (reader->position == reader->length && reader_fill(reader) == 0) {
+            break;
+        }
+        size_t available = reader->length - reader->position;
+        size_t taken = count - done < available ? count - done : available;
+        memcpy(buffer + done, reader->data + reader->position, taken);
+        reader->position += taken;
+        done += taken;
+    }
+    return done;
+}
+
+int reader_string(Reader *reader, char *buffer, size_t size, size_t *length) {
+    size_t i = 0;
+    for (;;) {
+        if (reader->position == reader->length && reader_fill(reader) == 0) {
+            return -1;
+        }
+        const char *start = reader->data + reader->position;
+        size_t available = reader->length - reader->position;
+        if (available > size - i) {                                                 // At most size bytes, delimiter included
+            available = size - i;
+        }
+        size_t j = __atomic_load_n(&scan_delimiter, __ATOMIC_RELAXED)(start, available);
+        if (j < available) {                                                        // The string ends in the buffer
+            char ch = start[j];
+            memcpy(buffer + i, start, j);
+            buffer[i + j] = '\0';
+            reader->position += j + 1;
+            if (length != NULL) {
+                *length = i + j;
+            }
+            return ch == ',' ? 0 : ch == ')' ? 1 : ch == ']' ? 2 : -1;
+        }
+        memcpy(buffer + i, start, available);
+        i += available;
+        reader->position += available;
+        if (i == size) {                                                            // Too long for the buffer
+            return -1;
+        }
+    }
+}
+
+int reader_uint(Reader *reader, unsigned int *value, char *next) {
+    unsigned long number = 0;
+    int overflow = 0;
+    for (;;) {
+        if (reader->position == reader->length && reader_fill(reader) == 0) {
+            *next = '\0';
+            break;
+        }
+        char ch = reader->data[reader->position++];
+        if (ch < '0' || ch > '9') {
+            *next = ch;
+            break;
+        }
+        number = number * 10 + (unsigned long)(ch - '0');
+        if (number > UINT_MAX) {
+            overflow = 1;
+            number = UINT_MAX;
+        }
+    }
+    if (overflow) {
+        return 1;
+    }
+    *value = (unsigned int)number;
+    return 0;
+}
+
+void reader_skip_line(Reader *reader) {
+    for (;;) {
+        if (reader->position == reader->length && reader_fill(reader) == 0) {
+            return;
+        }
+        const char *start = reader->data + reader->position;
+        const char *newline = memchr(start, '\n', reader->length - reader->position);
+        if (newline != NULL) {
+            reader->position += (size_t)(newline - start) + 1;
+            return;
+        }
+        reader->position = reader->length;
+    }
+}
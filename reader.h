@@ -0,0 +1,89 @@
+#ifndef KVS_READER_H
+#define KVS_READER_H
+
+#include <stddef.h>
+#include <string.h>
+
+#define READER_BUFFER_SIZE (64 * 1024)                                              // Bytes asked from each read()
+
+// Buffered reader of a job file or of the client's input, shared by both parsers.
+// The file is read in large chunks and the parsers take bytes out of the buffer, so
+// a command costs no system call unless it crosses the end of a chunk. On a pipe or
+// a terminal read() returns what is there, so the reader never waits for more input
+// than the parser asked for.
+typedef struct Reader {
+    int fd;
+    size_t consumed;                                                                // Bytes read before data[0]
+    size_t position;                                                                // Next byte of data to hand out
+    size_t length;                                                                  // Bytes in data
+    char data[READER_BUFFER_SIZE];
+} Reader;
+
+/// Starts reading a file.
+/// @param reader Reader to initialize.
+/// @param fd File to read from.
+void reader_init(Reader *reader, int fd);
+
+/// Reads the next chunk of the file, once every buffered byte was handed out.
+/// @param reader Reader to refill.
+/// @return Number of bytes buffered, 0 at the end of the file or on error.
+size_t reader_fill(Reader *reader);
+
+/// Reads bytes like read(), but returns fewer than asked only at the end of the file.
+/// @param reader Reader to read from.
+/// @param buffer Receives the bytes.
+/// @param count Number of bytes to read.
+/// @return Number of bytes read.
+size_t reader_read_slow(Reader *reader, char *buffer, size_t count);
+
+/// Bytes handed out since reader_init, that is the offset of the next byte in the
+/// file relative to where reading started.
+/// @param reader Reader of the file.
+/// @return Number of bytes.
+static inline size_t reader_offset(const Reader *reader) {
+    return reader->consumed + reader->position;
+}
+
+static inline size_t reader_read(Reader *reader, char *buffer, size_t count) {
+    if (count <= reader->length - reader->position) {                               // Usually the bytes are already there
+        memcpy(buffer, reader->data + reader->position, count);
+        reader->position += count;
+        return count;
+    }
+    return reader_read_slow(reader, buffer, count);
+}
+
+// Delimiter scanners of reader_string. They find the first ' ', ',', ')' or ']' of
+// a run of buffered bytes, 16 (SSE2) or 32 (AVX2) bytes per step.
+enum ReaderScan {
+    READER_SCAN_AUTO,                                                               // The widest the CPU supports
+    READER_SCAN_SCALAR,
+    READER_SCAN_SSE2,
+    READER_SCAN_AVX2
+};
+
+/// Picks the delimiter scanner of every reader. Called before the readers are used.
+/// @param scan Scanner to use.
+/// @return 0 if the CPU supports the scanner, 1 otherwise (the scanner is unchanged).
+int reader_use_scan(enum ReaderScan scan);
+
+/// Reads a string up to the next ',', ')' or ']', which is consumed.
+/// @param reader Reader to read from.
+/// @param buffer Receives the string, NUL-terminated.
+/// @param size Size of buffer: strings of up to size - 1 characters are accepted.
+/// @param length Receives the length of the string, if not NULL.
+/// @return 0 after ',', 1 after ')', 2 after ']', -1 on a space, a longer string or the end of the file.
+int reader_string(Reader *reader, char *buffer, size_t size, size_t *length);
+
+/// Reads an unsigned number, and the character after its digits.
+/// @param reader Reader to read from.
+/// @param value Receives the number.
+/// @param next Receives the character after the digits ('\0' at the end of the file).
+/// @return 0 if the number was read successfully, 1 if it does not fit an unsigned int.
+int reader_uint(Reader *reader, unsigned int *value, char *next);
+
+/// Skips the rest of the current line, newline included.
+/// @param reader Reader to read from.
+void reader_skip_line(Reader *reader);
+
+#endif  // KVS_READER_H
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE                                                                 // For pthread_setaffinity_np
+#include "shards.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum ShardOp {
+    SHARD_WRITE,
+    SHARD_READ,
+    SHARD_DELETE
+};
+
+// Part of a batch that belongs to one shard. Owned by the job thread that submits it.
+typedef struct ShardRequest {
+    enum ShardOp op;
+    size_t num_pairs;
+    const Span *keys;
+    const Span *values;                                                             // WRITE input
+    char (*results)[MAX_STRING_SIZE + 1];                                           // READ output
+    int *found;                                                                     // READ/DELETE output: 1 if the key existed
+    size_t next;                                                                    // Key the executor is reporting on
+    int result;
+    int done;                                                                       // Set by the executor once the request was applied
+} ShardRequest;
+
+// Ring buffer with one producer (a job thread) and one consumer (an executor).
+typedef struct SpscQueue {
+    _Alignas(64) size_t head;                                                       // Next slot to pop, written by the consumer
+    _Alignas(64) size_t tail;                                                       // Next slot to push, written by the producer
+    ShardRequest *slots[SHARD_QUEUE_SIZE];
+} SpscQueue;
+
+typedef struct Shard {
+    pthread_t thread;
+    int id;
+    SpscQueue *queues;                                                              // One per client
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;                                                            // Signaled when a request is pushed to a sleeping shard
+    int sleeping;
+} Shard;
+
+// Scratch space of a job thread: a batch is regrouped by shard into contiguous slices.
+typedef struct ShardClient {
+    size_t capacity;                                                                // Pairs the arrays below can hold
+    Span *keys;                                                                     // The caller's spans, the strings are not copied
+    Span *values;
+    char (*results)[MAX_STRING_SIZE + 1];
+    int *found;
+    size_t *slot;                                                                   // slot[i]: position of the caller's i-th key in the arrays
+    size_t *fill;                                                                   // Pairs of each shard (then start of each slice)
+    ShardRequest *requests;                                                         // One per shard
+} ShardClient;
+
+static HashTable *shard_table = NULL;
+static Shard *shards = NULL;
+static ShardClient *clients = NULL;
+static int num_shards = 0;
+static int max_clients = 0;
+static int next_client = 0;                                                         // Ids handed out so far
+static int stopping = 0;
+
+static _Thread_local int client_id = -1;                                           // Id of the calling job thread, -1 if not registered, -2 if none was left
+
+static int spsc_push(SpscQueue *queue, ShardRequest *request) {
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == SHARD_QUEUE_SIZE) {
+        return 1;                                                                   // Full
+    }
+    queue->slots[tail & (SHARD_QUEUE_SIZE - 1)] = request;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static ShardRequest *spsc_pop(SpscQueue *queue) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;                                                                // Empty
+    }
+    ShardRequest *request = queue->slots[head & (SHARD_QUEUE_SIZE - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return request;
+}
+
+// Reports the values of a READ in key order.
+static void store_read_result(const char *key, const char *value, void *arg) {
+    ShardRequest *request = arg;
+    (void)key;
+    request->found[request->next] = value != NULL;
+    if (value != NULL) {
+        strcpy(request->results[request->next], value);
+    }
+    request->next++;
+}
+
+// Reports the missing keys of a DELETE (called in key order).
+static void store_missing_key(const char *key, void *arg) {
+    ShardRequest *request = arg;
+    while (request->keys[request->next].data != key) {                              // Keys before this one were deleted
+        request->next++;
+    }
+    request->found[request->next++] = 0;
+}
+
+static void execute_request(ShardRequest *request) {
+    request->next = 0;
+    switch (request->op) {
+        case SHARD_WRITE:
+            request->result = write_pairs(shard_table, request->num_pairs, request->keys, request->values);
+            break;
+        case SHARD_READ:
+            request->result = read_pairs(shard_table, request->num_pairs, request->keys, store_read_result, request);
+            break;
+        case SHARD_DELETE:
+            for (size_t i = 0; i < request->num_pairs; i++) {
+                request->found[i] = 1;
+            }
+            request->result = delete_pairs(shard_table, request->num_pairs, request->keys, store_missing_key, request);
+            break;
+    }
+    __atomic_store_n(&request->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *shard_thread(void *arg) {
+    Shard *shard = arg;
+    int idle = 0;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        int worked = 0;
+        for (int c = 0; c < max_clients; c++) {
+            ShardRequest *request;
+            while ((request = spsc_pop(&shard->queues[c])) != NULL) {
+                execute_request(request);
+                worked = 1;
+            }
+        }
+        if (worked) {
+            idle = 0;
+        } else if (++idle < SHARD_IDLE_SPINS) {
+            sched_yield();
+        } else {                                                                    // Sleep until a request is pushed (or 1 ms passes)
+            pthread_mutex_lock(&shard->mutex);
+            __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+            int pending = 0;
+            for (int c = 0; c < max_clients && !pending; c++) {                     // Recheck after announcing the sleep
+                SpscQueue *queue = &shard->queues[c];
+                pending = __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+            }
+            if (!pending && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&shard->wake, &shard->mutex, &deadline);
+            }
+            __atomic_store_n(&shard->sleeping, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&shard->mutex);
+            idle = 0;
+        }
+    }
+    return NULL;
+}
+
+// Pins the calling executor to one core, round robin over the online cores.
+static void pin_to_core(Shard *shard) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores <= 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)(shard->id % cores), &set);
+    pthread_setaffinity_np(shard->thread, sizeof(set), &set);
+}
+
+int shards_start(HashTable *ht, int count, int num_clients) {
+    shards = calloc((size_t)count, sizeof(Shard));
+    clients = calloc((size_t)num_clients, sizeof(ShardClient));
+    if (shards == NULL || clients == NULL) {
+        free(shards);
+        free(clients);
+        return 1;
+    }
+    shard_table = ht;
+    num_shards = count;
+    max_clients = num_clients;
+    next_client = 0;
+    stopping = 0;
+
+    for (int s = 0; s < num_shards; s++) {
+        Shard *shard = &shards[s];
+        shard->id = s;
+        shard->queues = aligned_alloc(_Alignof(SpscQueue), (size_t)max_clients * sizeof(SpscQueue));
+        if (shard->queues == NULL) {
+            num_shards = s;
+            shards_stop();
+            return 1;
+        }
+        memset(shard->queues, 0, (size_t)max_clients * sizeof(SpscQueue));
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->wake, NULL);
+        if (pthread_create(&shard->thread, NULL, shard_thread, shard) != 0) {
+            free(shard->queues);
+            num_shards = s;
+            shards_stop();
+            return 1;
+        }
+        pin_to_core(shard);
+    }
+    return 0;
+}
+
+void shards_stop(void) {
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (int s = 0; s < num_shards; s++) {
+        pthread_mutex_lock(&shards[s].mutex);
+        pthread_cond_signal(&shards[s].wake);
+        pthread_mutex_unlock(&shards[s].mutex);
+        pthread_join(shards[s].thread, NULL);
+        pthread_mutex_destroy(&shards[s].mutex);
+        pthread_cond_destroy(&shards[s].wake);
+        free(shards[s].queues);
+    }
+    for (int c = 0; c < max_clients; c++) {
+        free(clients[c].keys);
+        free(clients[c].values);
+        free(clients[c].results);
+        free(clients[c].found);
+        free(clients[c].slot);
+        free(clients[c].fill);
+        free(clients[c].requests);
+    }
+    free(shards);
+    free(clients);
+    shards = NULL;
+    clients = NULL;
+    num_shards = 0;
+    max_clients = 0;
+    shard_table = NULL;
+}
+
+int shards_enabled(void) {
+    return shards != NULL;
+}
+
+// Scratch space of the calling thread, registering it on first use.
+// Returns NULL when every client id is taken (the caller then uses the table directly).
+static ShardClient *get_client(size_t num_pairs) {
+    if (client_id == -1) {
+        int id = __sync_fetch_and_add(&next_client, 1);
+        client_id = id < max_clients ? id : -2;
+    }
+    if (client_id < 0) {
+        return NULL;
+    }
+    ShardClient *client = &clients[client_id];
+
+    if (client->requests == NULL) {
+        client->requests = calloc((size_t)num_shards, sizeof(ShardRequest));
+        client->fill = calloc((size_t)num_shards, sizeof(size_t));
+        if (client->requests == NULL || client->fill == NULL) {
+            return NULL;
+        }
+    }
+    if (client->capacity < num_pairs) {                                             // Grows to the largest batch seen
+        size_t capacity = client->capacity * 2 > num_pairs ? client->capacity * 2 : num_pairs;
+        free(client->keys);
+        free(client->values);
+        free(client->results);
+        free(client->found);
+        free(client->slot);
+        client->keys = malloc(capacity * sizeof(*client->keys));
+        client->values = malloc(capacity * sizeof(*client->values));
+        client->results = malloc(capacity * sizeof(*client->results));
+        client->found = malloc(capacity * sizeof(int));
+        client->slot = malloc(capacity * sizeof(size_t));
+        if (client->keys == NULL || client->values == NULL || client->results == NULL ||
+            client->found == NULL || client->slot == NULL) {
+            client->capacity = 0;
+            return NULL;
+        }
+        client->capacity = capacity;
+    }
+    return client;
+}
+
+// Regroups a batch by shard, sends one request to each shard involved and waits for
+// all of them. Returns 1 if any request failed.
+static int submit_batch(ShardClient *client, enum ShardOp op, size_t num_pairs,
+                        const Span *keys, const Span *values) {
+    memset(client->fill, 0, (size_t)num_shards * sizeof(size_t));
+    for (size_t i = 0; i < num_pairs; i++) {                                        // Count the pairs of each shard
+        size_t shard = key_stripe(&keys[i]) % (size_t)num_shards;
+        client->slot[i] = shard;
+        client->fill[shard]++;
+    }
+    size_t start = 0;
+    for (int s = 0; s < num_shards; s++) {                                          // Slice of each shard
+        ShardRequest *request = &client->requests[s];
+        request->op = op;
+        request->num_pairs = client->fill[s];
+        request->keys = client->keys + start;
+        request->values = client->values + start;
+        request->results = client->results + start;
+        request->found = client->found + start;
+        request->done = 0;
+        client->fill[s] = start;
+        start += request->num_pairs;
+    }
+    for (size_t i = 0; i < num_pairs; i++) {                                        // Place the pairs in order in their slice
+        size_t position = client->fill[client->slot[i]]++;
+        client->slot[i] = position;
+        client->keys[position] = keys[i];
+        if (op == SHARD_WRITE) {
+            client->values[position] = values[i];
+        }
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+        ShardRequest *request = &client->requests[s];
+        if (request->num_pairs == 0) {
+            continue;
+        }
+        Shard *shard = &shards[s];
+        while (spsc_push(&shard->queues[client_id], request) != 0) {
+            sched_yield();
+        }
+        if (__atomic_load_n(&shard->sleeping, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&shard->mutex);
+            pthread_cond_signal(&shard->wake);
+            pthread_mutex_unlock(&shard->mutex);
+        }
+    }
+
+    int result = 0;
+    for (int s = 0; s < num_shards; s++) {                                          // Gather the replies
+        ShardRequest *request = &client->requests[s];
+        if (request->num_pairs == 0) {
+            continue;
+        }
+        while (!__atomic_load_n(&request->done, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        result |= request->result;
+    }
+    return result;
+}
+
+int shard_write_pairs(size_t num_pairs, const Span *keys, const Span *values) {
+    ShardClient *client = get_client(num_pairs);
+    if (client == NULL) {
+        return write_pairs(shard_table, num_pairs, keys, values);
+    }
+    return submit_batch(client, SHARD_WRITE, num_pairs, keys, values);
+}
+
+int shard_read_pairs(size_t num_pairs, const Span *keys,
+                     void (*visit)(const char *key, const char *value, void *arg), void *arg) {
+    ShardClient *client = get_client(num_pairs);
+    if (client == NULL) {
+        return read_pairs(shard_table, num_pairs, keys, visit, arg);
+    }
+    int result = submit_batch(client, SHARD_READ, num_pairs, keys, NULL);
+    for (size_t i = 0; i < num_pairs; i++) {                                        // Replies back in the caller's order
+        size_t position = client->slot[i];
+        visit(keys[i].data, client->found[position] ? client->results[position] : NULL, arg);
+    }
+    return result;
+}
+
+int shard_delete_pairs(size_t num_pairs, const Span *keys,
+                       void (*missing)(const char *key, void *arg), void *arg) {
+    ShardClient *client = get_client(num_pairs);
+    if (client == NULL) {
+        return delete_pairs(shard_table, num_pairs, keys, missing, arg);
+    }
+    int result = submit_batch(client, SHARD_DELETE, num_pairs, keys, NULL);
+    for (size_t i = 0; i < num_pairs; i++) {
+        if (!client->found[client->slot[i]]) {
+            missing(keys[i].data, arg);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,47 @@
+#ifndef KVS_SHARDS_H
+#define KVS_SHARDS_H
+
+#include <stddef.h>
+#include "constants.h"
+#include "kvs.h"
+
+#define SHARD_QUEUE_SIZE 16                                                         // Requests in flight per (job thread, shard) queue (power of two)
+#define SHARD_IDLE_SPINS 64                                                         // Empty polls before an executor goes to sleep
+
+// In sharded mode the key space is split by lock stripe: shard s owns every stripe i
+// with i % num_shards == s and is the only thread that applies WRITE/READ/DELETE
+// batches to those keys. Job threads hand their batches over through one
+// single-producer single-consumer queue per (job thread, shard) pair, so the bucket
+// locks the executors take are never contended by other batches.
+
+/// Starts the shard executor threads, each pinned to a core.
+/// @param ht Hash table whose stripes are split among the shards.
+/// @param num_shards Number of executor threads.
+/// @param num_clients Maximum number of job threads that will submit batches.
+/// @return 0 if the executors were started successfully, 1 otherwise.
+int shards_start(HashTable *ht, int num_shards, int num_clients);
+
+/// Stops and joins the shard executors. No batch may be in flight.
+void shards_stop(void);
+
+/// Tells whether batches are being routed to shard executors.
+/// @return 1 if the shards are running, 0 otherwise.
+int shards_enabled(void);
+
+/// Writes a batch of pairs through the shards that own them (see write_pairs).
+/// @return 0 if every pair was written successfully, 1 otherwise.
+int shard_write_pairs(size_t num_pairs, const Span *keys, const Span *values);
+
+/// Reads a batch of keys through the shards that own them (see read_pairs).
+/// visit is called in key order, by the calling thread, once every shard replied.
+/// @return 0 if the keys were read successfully, 1 otherwise.
+int shard_read_pairs(size_t num_pairs, const Span *keys,
+                     void (*visit)(const char *key, const char *value, void *arg), void *arg);
+
+/// Deletes a batch of keys through the shards that own them (see delete_pairs).
+/// missing is called in key order, by the calling thread, once every shard replied.
+/// @return 0 if every key was deleted, 1 if some were missing.
+int shard_delete_pairs(size_t num_pairs, const Span *keys,
+                       void (*missing)(const char *key, void *arg), void *arg);
+
+#endif  // KVS_SHARDS_H
@@ -0,0 +1,95 @@
+#include "skiplist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+
+// Level of the node of an entry: 1 + (number of trailing zero bit pairs of the hash).
+static int node_level(uint64_t hash) {
+    uint32_t bits = (uint32_t)(hash >> 32) | (1u << (2 * (SKIPLIST_MAX_LEVEL - 1)));
+    return 1 + __builtin_ctz(bits) / 2;
+}
+
+int skiplist_init(SkipList *list) {
+    list->head = calloc(1, sizeof(SkipNode) + SKIPLIST_MAX_LEVEL * sizeof(SkipNode *));
+    if (list->head == NULL) {
+        return 1;
+    }
+    list->level = 1;
+    list->size = 0;
+    return 0;
+}
+
+// Fills update[i] with the last node of level i whose key is smaller than key.
+static void find_predecessors(const SkipList *list, const char *key, SkipNode **update) {
+    SkipNode *node = list->head;
+    for (int i = list->level - 1; i >= 0; i--) {
+        while (node->next[i] != NULL && strcmp(node->next[i]->entry->key, key) < 0) {
+            node = node->next[i];
+        }
+        update[i] = node;
+    }
+}
+
+int skiplist_insert(SkipList *list, struct KeyNode *entry) {
+    int level = node_level(entry->hash);
+    SkipNode *node = malloc(sizeof(SkipNode) + (size_t)level * sizeof(SkipNode *));
+    if (node == NULL) {
+        return 1;
+    }
+    node->entry = entry;
+
+    SkipNode *update[SKIPLIST_MAX_LEVEL];
+    find_predecessors(list, entry->key, update);
+    for (int i = list->level; i < level; i++) {                                     // New levels start at the head
+        update[i] = list->head;
+    }
+    if (level > list->level) {
+        list->level = level;
+    }
+    for (int i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    list->size++;
+    return 0;
+}
+
+void skiplist_remove(SkipList *list, const char *key) {
+    SkipNode *update[SKIPLIST_MAX_LEVEL];
+    find_predecessors(list, key, update);
+
+    SkipNode *node = update[0]->next[0];
+    if (node == NULL || strcmp(node->entry->key, key) != 0) {
+        return;
+    }
+    for (int i = 0; i < list->level && update[i]->next[i] == node; i++) {
+        update[i]->next[i] = node->next[i];
+    }
+    while (list->level > 1 && list->head->next[list->level - 1] == NULL) {
+        list->level--;
+    }
+    list->size--;
+    free(node);
+}
+
+SkipNode *skiplist_lower_bound(const SkipList *list, const char *key) {
+    if (key == NULL) {
+        return list->head->next[0];
+    }
+    SkipNode *update[SKIPLIST_MAX_LEVEL];
+    find_predecessors(list, key, update);
+    return update[0]->next[0];
+}
+
+void skiplist_destroy(SkipList *list) {
+    SkipNode *node = list->head;
+    while (node != NULL) {
+        SkipNode *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    list->head = NULL;
+    list->size = 0;
+}
@@ -0,0 +1,50 @@
+#ifndef KVS_SKIPLIST_H
+#define KVS_SKIPLIST_H
+
+#include <stddef.h>
+
+#define SKIPLIST_MAX_LEVEL 16                                                       // Enough for 4^16 keys
+
+struct KeyNode;
+
+typedef struct SkipNode {
+    struct KeyNode *entry;                                                          // Pair indexed by this node
+    struct SkipNode *next[];                                                        // One link per level of the node
+} SkipNode;
+
+// Skip list of hash table nodes ordered by key. A node's level is derived from the
+// key's hash (each level kept with probability 1/4), so no random state is needed.
+// Not thread-safe.
+typedef struct SkipList {
+    SkipNode *head;                                                                 // Sentinel with SKIPLIST_MAX_LEVEL links
+    int level;                                                                      // Number of levels in use
+    size_t size;
+} SkipList;
+
+/// Initializes an empty skip list.
+/// @param list Skip list to initialize.
+/// @return 0 if the list was initialized successfully, 1 otherwise.
+int skiplist_init(SkipList *list);
+
+/// Inserts a node whose key is not in the list yet.
+/// @param list Skip list to modify.
+/// @param entry Node to index (its key and hash fields must be set).
+/// @return 0 if the node was inserted successfully, 1 otherwise.
+int skiplist_insert(SkipList *list, struct KeyNode *entry);
+
+/// Removes a key from the list, if present.
+/// @param list Skip list to modify.
+/// @param key Key to remove.
+void skiplist_remove(SkipList *list, const char *key);
+
+/// Finds the first node whose key is not smaller than the given key.
+/// @param list Skip list to search.
+/// @param key Lower bound, NULL for the first node of the list.
+/// @return The node found, NULL if every key is smaller.
+SkipNode *skiplist_lower_bound(const SkipList *list, const char *key);
+
+/// Frees every node of the list (not the indexed entries).
+/// @param list Skip list to destroy.
+void skiplist_destroy(SkipList *list);
+
+#endif  // KVS_SKIPLIST_H
@@ -0,0 +1,462 @@
+#include "snapfile.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "codec.h"
+
+#define RESTORE_BATCH 256                                                           // Pairs written under one set of locks
+
+struct SnapWriter {
+    int fd;                                                                         // -1 for a segment, kept in memory
+    int failed;                                                                     // A write failed, the rest is skipped
+    uint32_t flags;
+    uint64_t offset;                                                                // Where the next block goes
+    uint64_t pairs;
+    uint64_t blocks;
+    uint32_t block_pairs;
+    size_t block_length;                                                            // Entry bytes in block
+    uint8_t *index;                                                                 // Index section, built while writing
+    size_t index_length;
+    size_t index_capacity;
+    uint8_t *segment;                                                               // Blocks of a segment
+    size_t segment_length;
+    size_t segment_capacity;
+    uint8_t block[SNAPFILE_BLOCK_HEADER_SIZE + SNAPFILE_BLOCK_SIZE];
+};
+
+typedef struct SnapReader {
+    HashTable *ht;
+    const SnapFile *file;
+    const uint64_t *offsets;                                                        // Offset of each block
+    uint64_t next_block;                                                            // Claimed with __sync_fetch_and_add
+    uint64_t pairs;                                                                 // Pairs loaded so far
+    int failed;
+} SnapReader;
+
+// Grows a buffer to hold at least needed bytes. Returns 0 on success.
+static int grow(uint8_t **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    size_t grown_capacity = *capacity > 0 ? *capacity * 2 : 4096;
+    while (grown_capacity < needed) {
+        grown_capacity *= 2;
+    }
+    uint8_t *grown = realloc(*buffer, grown_capacity);
+    if (grown == NULL) {
+        return 1;
+    }
+    *buffer = grown;
+    *capacity = grown_capacity;
+    return 0;
+}
+
+// Writes bytes to the file, or appends them to the segment.
+static int emit(SnapWriter *writer, const uint8_t *data, size_t length) {
+    if (writer->fd != -1) {
+        return write_all(writer->fd, data, length);
+    }
+    if (grow(&writer->segment, &writer->segment_capacity, writer->segment_length + length) != 0) {
+        return 1;
+    }
+    memcpy(writer->segment + writer->segment_length, data, length);
+    writer->segment_length += length;
+    return 0;
+}
+
+// Writes the pending block, if it has any entry.
+static void flush_block(SnapWriter *writer) {
+    if (writer->block_pairs == 0 || writer->failed) {
+        return;
+    }
+    put_u32(writer->block, writer->block_pairs);
+    put_u32(writer->block + 4, (uint32_t)writer->block_length);
+    put_u32(writer->block + 8, crc32c(writer->block + SNAPFILE_BLOCK_HEADER_SIZE, writer->block_length));
+    put_u32(writer->block + 12, 0);
+    size_t length = SNAPFILE_BLOCK_HEADER_SIZE + writer->block_length;
+    writer->failed = emit(writer, writer->block, length);
+    writer->offset += length;
+    writer->blocks++;
+    writer->block_pairs = 0;
+    writer->block_length = 0;
+}
+
+// Records the offset and first key of the block being started.
+static void index_block(SnapWriter *writer, const char *key, size_t key_length) {
+    size_t needed = writer->index_length + 10 + key_length;
+    if (grow(&writer->index, &writer->index_capacity, needed) != 0) {
+        writer->failed = 1;
+        return;
+    }
+    uint8_t *entry = writer->index + writer->index_length;
+    put_u64(entry, writer->offset);
+    put_u16(entry + 8, (uint16_t)key_length);
+    memcpy(entry + 10, key, key_length);
+    writer->index_length = needed;
+}
+
+SnapWriter *snapfile_create(int fd, uint32_t flags) {
+    SnapWriter *writer = calloc(1, sizeof(SnapWriter));
+    uint8_t header[SNAPFILE_HEADER_SIZE] = { 0 };
+    if (writer == NULL || write_all(fd, header, sizeof(header)) != 0) {            // Filled in once the counts are known
+        free(writer);
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->flags = SNAPFILE_INDEXED | flags;
+    writer->offset = SNAPFILE_HEADER_SIZE;
+    return writer;
+}
+
+void snapfile_append(SnapWriter *writer, const char *key, const char *value) {
+    size_t key_length = strlen(key);
+    size_t value_length = value != NULL ? strlen(value) : 0;
+    size_t length = 4 + key_length + value_length;
+
+    if (writer->block_length + length > SNAPFILE_BLOCK_SIZE) {
+        flush_block(writer);
+    }
+    if (writer->failed) {
+        return;
+    }
+    if (writer->block_pairs == 0) {
+        index_block(writer, key, key_length);
+    }
+    uint8_t *entry = writer->block + SNAPFILE_BLOCK_HEADER_SIZE + writer->block_length;
+    put_u16(entry, (uint16_t)key_length);
+    put_u16(entry + 2, value != NULL ? (uint16_t)value_length : SNAPFILE_DELETED);
+    memcpy(entry + 4, key, key_length);
+    memcpy(entry + 4 + key_length, value != NULL ? value : "", value_length);
+    writer->block_length += length;
+    writer->block_pairs++;
+    writer->pairs++;
+}
+
+int snapfile_finish(SnapWriter *writer) {
+    flush_block(writer);
+    uint64_t index_offset = writer->offset;
+    if (!writer->failed && writer->index_length > 0) {
+        writer->failed = write_all(writer->fd, writer->index, writer->index_length);
+    }
+
+    uint8_t header[SNAPFILE_HEADER_SIZE] = { 0 };
+    memcpy(header, SNAPFILE_MAGIC, sizeof(SNAPFILE_MAGIC));
+    put_u32(header + 8, SNAPFILE_VERSION);
+    put_u32(header + 12, writer->flags);
+    put_u64(header + 16, writer->pairs);
+    put_u64(header + 24, writer->blocks);
+    put_u64(header + 32, index_offset);
+    put_u32(header + 40, crc32c(writer->index, writer->index_length));
+    put_u32(header + 44, crc32c(header, 44));
+    int failed = writer->failed || pwrite(writer->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header);
+
+    free(writer->index);
+    free(writer);
+    return failed;
+}
+
+// Appends a pair to the file (snapshot_foreach visitor).
+static void write_entry(const char *key, const char *value, void *arg) {
+    snapfile_append(arg, key, value);
+}
+
+static void skip_entry(const char *key, const char *value, void *arg) {
+    (void)key;
+    (void)value;
+    (void)arg;
+}
+
+// Appends a segment's blocks to the file, and its index entries moved to where the
+// blocks land. Frees the segment.
+static void append_segment(SnapWriter *writer, SnapWriter *segment) {
+    flush_block(segment);
+    writer->failed |= segment->failed;
+    if (!writer->failed && segment->segment_length > 0) {
+        writer->failed = write_all(writer->fd, segment->segment, segment->segment_length);
+    }
+    for (size_t offset = 0; offset < segment->index_length && !writer->failed;) {
+        uint8_t *entry = segment->index + offset;
+        size_t length = 10 + get_u16(entry + 8);
+        if (grow(&writer->index, &writer->index_capacity, writer->index_length + length) != 0) {
+            writer->failed = 1;
+            break;
+        }
+        memcpy(writer->index + writer->index_length, entry, length);
+        put_u64(writer->index + writer->index_length, writer->offset + get_u64(entry));
+        writer->index_length += length;
+        offset += length;
+    }
+    writer->offset += segment->segment_length;
+    writer->pairs += segment->pairs;
+    writer->blocks += segment->blocks;
+    free(segment->segment);
+    free(segment->index);
+    free(segment);
+}
+
+int snapfile_write(HashTable *ht, int snapshot, int fd, int threads) {
+    SnapWriter *writer = snapfile_create(fd, ht->snapshots[snapshot].delta ? SNAPFILE_DELTA : 0);
+    if (writer == NULL) {
+        snapshot_foreach(ht, snapshot, skip_entry, NULL);                           // Still releases the snapshot
+        return 1;
+    }
+    if (threads <= 1) {
+        int failed = snapshot_foreach(ht, snapshot, write_entry, writer);
+        return snapfile_finish(writer) || failed;
+    }
+
+    void *segments[MAX_SNAPSHOT_THREADS];                                           // One per key range, offsets from 0
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        segments[i] = calloc(1, sizeof(SnapWriter));
+        if (segments[i] == NULL) {
+            failed = 1;
+        } else {
+            ((SnapWriter *)segments[i])->fd = -1;
+        }
+    }
+    if (failed) {
+        snapshot_foreach(ht, snapshot, skip_entry, NULL);
+    } else {
+        failed = snapshot_foreach_ranges(ht, snapshot, threads, write_entry, segments);
+    }
+    for (int i = 0; i < threads; i++) {                                             // Stitched in key order
+        if (segments[i] != NULL) {
+            append_segment(writer, segments[i]);
+        }
+    }
+    return snapfile_finish(writer) || failed;
+}
+
+int snapfile_open(const char *path, SnapFile *file) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open snapshot");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SNAPFILE_HEADER_SIZE) {
+        fprintf(stderr, "Snapshot %s is too short\n", path);
+        close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);                                                                      // The mapping keeps the file open
+    if (map == MAP_FAILED) {
+        perror("Failed to map snapshot");
+        return 1;
+    }
+    posix_madvise(map, size, POSIX_MADV_WILLNEED);                                  // Read ahead the whole file
+
+    file->map = map;
+    file->size = size;
+    file->flags = get_u32(map + 12);
+    file->pairs = get_u64(map + 16);
+    file->blocks = get_u64(map + 24);
+    if (memcmp(map, SNAPFILE_MAGIC, sizeof(SNAPFILE_MAGIC)) != 0 || get_u32(map + 8) != SNAPFILE_VERSION ||
+        get_u32(map + 44) != crc32c(map, 44) || file->blocks > size / SNAPFILE_BLOCK_HEADER_SIZE) {
+        fprintf(stderr, "%s is not a valid snapshot\n", path);
+        snapfile_close(file);
+        return 1;
+    }
+    return 0;
+}
+
+void snapfile_close(SnapFile *file) {
+    munmap((void *)file->map, file->size);
+    file->map = NULL;
+}
+
+int snapfile_seek(const SnapFile *file, uint64_t offset, uint64_t blocks, SnapCursor *cursor) {
+    cursor->file = file;
+    cursor->blocks = blocks;
+    cursor->pairs = 0;
+    cursor->entry = cursor->end = file->map + SNAPFILE_HEADER_SIZE;
+    if (offset > file->size || file->size - offset < SNAPFILE_BLOCK_HEADER_SIZE) {
+        return 1;
+    }
+    const uint8_t *block = file->map + offset;
+    uint32_t length = get_u32(block + 4);
+    const uint8_t *entry = block + SNAPFILE_BLOCK_HEADER_SIZE;
+    if (file->size - offset - SNAPFILE_BLOCK_HEADER_SIZE < length || crc32c(entry, length) != get_u32(block + 8)) {
+        return 1;
+    }
+    cursor->entry = entry;
+    cursor->end = entry + length;
+    cursor->pairs = get_u32(block);
+    return 0;
+}
+
+int snapfile_next(SnapCursor *cursor, SnapEntry *next) {
+    while (cursor->entry == cursor->end) {                                          // Block done, go to the next one
+        if (cursor->pairs != 0) {
+            return -1;
+        }
+        if (cursor->blocks == 0) {
+            return 0;
+        }
+        if (snapfile_seek(cursor->file, (uint64_t)(cursor->end - cursor->file->map), cursor->blocks - 1, cursor) != 0) {
+            return -1;
+        }
+    }
+    const uint8_t *entry = cursor->entry;
+    if (cursor->end - entry < 4 || cursor->pairs == 0) {
+        return -1;
+    }
+    size_t key_length = get_u16(entry);
+    size_t value_length = get_u16(entry + 2);
+    next->deleted = value_length == SNAPFILE_DELETED;
+    if (next->deleted) {
+        value_length = 0;
+    }
+    if (key_length >= MAX_STRING_SIZE || value_length >= MAX_STRING_SIZE ||
+        (size_t)(cursor->end - entry) < 4 + key_length + value_length) {
+        return -1;
+    }
+    memcpy(next->key, entry + 4, key_length);
+    next->key[key_length] = '\0';
+    next->key_length = key_length;
+    memcpy(next->value, entry + 4 + key_length, value_length);
+    next->value[value_length] = '\0';
+    next->value_length = value_length;
+    cursor->entry = entry + 4 + key_length + value_length;
+    cursor->pairs--;
+    return 1;
+}
+
+// Loads the pairs of one block. Returns the number of pairs, or -1 if it is corrupted.
+static long load_block(SnapReader *reader, uint64_t offset) {
+    SnapCursor cursor;
+    if (snapfile_seek(reader->file, offset, 0, &cursor) != 0) {
+        return -1;
+    }
+
+    SnapEntry entries[RESTORE_BATCH];
+    Span keys[RESTORE_BATCH];
+    Span values[RESTORE_BATCH];
+    size_t batch = 0;
+    long loaded = 0;
+    int result;
+    while ((result = snapfile_next(&cursor, &entries[batch])) == 1) {
+        if (entries[batch].deleted) {                                               // Full snapshots have no removed keys
+            return -1;
+        }
+        keys[batch] = (Span){ entries[batch].key, entries[batch].key_length };
+        values[batch] = (Span){ entries[batch].value, entries[batch].value_length };
+        loaded++;
+        if (++batch == RESTORE_BATCH) {
+            if (write_pairs(reader->ht, batch, keys, values) != 0) {
+                return -1;
+            }
+            batch = 0;
+        }
+    }
+    if (result < 0 || (batch > 0 && write_pairs(reader->ht, batch, keys, values) != 0)) {
+        return -1;
+    }
+    return loaded;
+}
+
+static void *restore_thread(void *arg) {
+    SnapReader *reader = arg;
+    for (;;) {
+        uint64_t block = __sync_fetch_and_add(&reader->next_block, 1);             // Claim the next block
+        if (block >= reader->file->blocks || __atomic_load_n(&reader->failed, __ATOMIC_RELAXED)) {
+            return NULL;
+        }
+        long pairs = load_block(reader, reader->offsets[block]);
+        if (pairs < 0) {
+            __atomic_store_n(&reader->failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        __sync_fetch_and_add(&reader->pairs, (uint64_t)pairs);
+    }
+}
+
+// Finds the offset of every block, from the index if the file has a valid one,
+// otherwise by walking the block headers. Returns 0 on success.
+static int locate_blocks(const SnapFile *file, uint64_t *offsets) {
+    const uint8_t *map = file->map;
+    size_t size = file->size;
+    uint64_t index_offset = get_u64(map + 32);
+    if ((file->flags & SNAPFILE_INDEXED) && index_offset <= size &&
+        crc32c(map + index_offset, size - index_offset) == get_u32(map + 40)) {
+        const uint8_t *entry = map + index_offset;
+        const uint8_t *end = map + size;
+        for (uint64_t i = 0; i < file->blocks; i++) {
+            if (end - entry < 10 || (size_t)(end - entry) < 10u + get_u16(entry + 8)) {
+                return 1;
+            }
+            offsets[i] = get_u64(entry);
+            entry += 10 + get_u16(entry + 8);
+        }
+        return 0;
+    }
+
+    uint64_t offset = SNAPFILE_HEADER_SIZE;
+    for (uint64_t i = 0; i < file->blocks; i++) {
+        if (offset > size || size - offset < SNAPFILE_BLOCK_HEADER_SIZE) {
+            return 1;
+        }
+        offsets[i] = offset;
+        offset += SNAPFILE_BLOCK_HEADER_SIZE + get_u32(map + offset + 4);
+    }
+    return 0;
+}
+
+int snapfile_restore(HashTable *ht, const char *path, uint64_t *pairs) {
+    SnapFile file;
+    *pairs = 0;
+    if (snapfile_open(path, &file) != 0) {
+        return 1;
+    }
+    if (file.flags & SNAPFILE_DELTA) {
+        fprintf(stderr, "Snapshot %s is a delta, compact it with its base first\n", path);
+        snapfile_close(&file);
+        return 1;
+    }
+
+    SnapReader reader = { ht, &file, NULL, 0, 0, 0 };
+    reserve_table(ht, (size_t)file.pairs);
+    uint64_t *offsets = malloc((file.blocks > 0 ? file.blocks : 1) * sizeof(uint64_t));
+    int failed = offsets == NULL || locate_blocks(&file, offsets) != 0;
+    reader.offsets = offsets;
+
+    if (!failed) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t num_threads = cores > 0 ? (size_t)cores : 1;
+        if (num_threads > SNAPFILE_RESTORE_THREADS) {
+            num_threads = SNAPFILE_RESTORE_THREADS;
+        }
+        if (num_threads > file.blocks) {
+            num_threads = file.blocks > 0 ? (size_t)file.blocks : 1;
+        }
+        pthread_t threads[SNAPFILE_RESTORE_THREADS];
+        size_t started = 0;
+        for (; started + 1 < num_threads; started++) {                             // This thread is the last loader
+            if (pthread_create(&threads[started], NULL, restore_thread, &reader) != 0) {
+                break;
+            }
+        }
+        restore_thread(&reader);
+        for (size_t i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        failed = reader.failed || reader.pairs != file.pairs;
+    }
+    if (failed) {
+        fprintf(stderr, "Snapshot %s is corrupted\n", path);
+    }
+    *pairs = reader.pairs;
+    free(offsets);
+    snapfile_close(&file);
+    return failed;
+}
@@ -0,0 +1,118 @@
+#ifndef KVS_SNAPFILE_H
+#define KVS_SNAPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "constants.h"
+#include "kvs.h"
+
+#define SNAPFILE_MAGIC "KVSSNAP"                                                    // First 8 bytes of the file (with the NUL)
+#define SNAPFILE_VERSION 1
+#define SNAPFILE_INDEXED 0x1                                                        // Flag: the file ends with a block index
+#define SNAPFILE_DELTA 0x2                                                          // Flag: changes since the previous file of a chain
+#define SNAPFILE_DELETED 0xFFFF                                                     // Value length of a removed key (deltas only)
+#define SNAPFILE_HEADER_SIZE 48
+#define SNAPFILE_BLOCK_HEADER_SIZE 16
+#define SNAPFILE_BLOCK_SIZE (64 * 1024)                                             // Entry bytes of a full block
+#define SNAPFILE_RESTORE_THREADS 8                                                  // Most threads loading blocks at once
+
+// Binary snapshot layout (every integer little-endian):
+//   header  magic[8] version:u32 flags:u32 pairs:u64 blocks:u64 index_offset:u64
+//           index_crc:u32 header_crc:u32 (crc of the 44 bytes before it)
+//   blocks  pairs:u32 length:u32 crc:u32 reserved:u32, then length bytes of
+//           entries: key_length:u16 value_length:u16 key value
+//   index   per block: offset:u64 key_length:u16 first_key (keys are sorted)
+// Blocks are checksummed (CRC-32C) and self-contained, so with the index a restore
+// loads them from several threads straight out of the mapped file. A delta file
+// holds the pairs written since the previous file of its chain, and the keys
+// removed since then (value length SNAPFILE_DELETED).
+
+typedef struct SnapWriter SnapWriter;
+
+// Snapshot file mapped in memory.
+typedef struct SnapFile {
+    const uint8_t *map;
+    size_t size;
+    uint32_t flags;
+    uint64_t pairs;                                                                 // Entries, deletions included
+    uint64_t blocks;
+} SnapFile;
+
+// Position of a sequential read of a snapshot file.
+typedef struct SnapCursor {
+    const SnapFile *file;
+    const uint8_t *entry;                                                           // Next entry of the current block
+    const uint8_t *end;                                                             // End of the current block
+    uint32_t pairs;                                                                 // Entries left in the current block
+    uint64_t blocks;                                                                // Blocks left after the current one
+} SnapCursor;
+
+// Entry read from a snapshot file.
+typedef struct SnapEntry {
+    char key[MAX_STRING_SIZE];
+    char value[MAX_STRING_SIZE];                                                    // Empty for a removed key
+    size_t key_length;
+    size_t value_length;
+    int deleted;                                                                    // The key was removed (only in delta files)
+} SnapEntry;
+
+/// Starts writing a snapshot file.
+/// @param fd File to write to (seekable, empty).
+/// @param flags SNAPFILE_DELTA for a delta file, 0 otherwise.
+/// @return Writer of the file, NULL on failure.
+SnapWriter *snapfile_create(int fd, uint32_t flags);
+
+/// Appends an entry. Entries must come in ascending key order.
+/// @param writer Writer of the file.
+/// @param key Key of the pair.
+/// @param value Value of the pair, NULL for a removed key.
+void snapfile_append(SnapWriter *writer, const char *key, const char *value);
+
+/// Writes the pending block, the index and the header, and frees the writer.
+/// @param writer Writer of the file.
+/// @return 0 if the whole file was written successfully, 1 otherwise.
+int snapfile_finish(SnapWriter *writer);
+
+/// Writes a snapshot of the table in the binary format, and releases the snapshot.
+/// Snapshots taken with snapshot_begin_delta are written as delta files. With several
+/// threads, each one encodes the blocks of a key range into memory, and the ranges
+/// are then written one after the other.
+/// @param ht Hash table the snapshot was taken from.
+/// @param snapshot Id returned by snapshot_begin or snapshot_begin_delta.
+/// @param fd File to write to (seekable, empty).
+/// @param threads Threads encoding the file (1 to MAX_SNAPSHOT_THREADS).
+/// @return 0 if the snapshot was written successfully, 1 otherwise.
+int snapfile_write(HashTable *ht, int snapshot, int fd, int threads);
+
+/// Maps a snapshot file and checks its header.
+/// @param path Snapshot file.
+/// @param file Receives the mapping.
+/// @return 0 if the file was mapped successfully, 1 otherwise.
+int snapfile_open(const char *path, SnapFile *file);
+
+/// Unmaps a snapshot file.
+/// @param file File returned by snapfile_open.
+void snapfile_close(SnapFile *file);
+
+/// Places a cursor on a block of a file, checking its checksum.
+/// @param file Mapped file.
+/// @param offset Offset of the block.
+/// @param blocks Blocks to read after this one.
+/// @param cursor Cursor to place.
+/// @return 0 if the block is valid, 1 otherwise.
+int snapfile_seek(const SnapFile *file, uint64_t offset, uint64_t blocks, SnapCursor *cursor);
+
+/// Reads the next entry of a file.
+/// @param cursor Cursor placed by snapfile_seek.
+/// @param entry Receives the entry.
+/// @return 1 if an entry was read, 0 at the end, -1 if the file is corrupted.
+int snapfile_next(SnapCursor *cursor, SnapEntry *entry);
+
+/// Loads every pair of a full binary snapshot file into the table.
+/// @param ht Hash table to fill (not yet shared with other threads).
+/// @param path Snapshot file.
+/// @param pairs Receives the number of pairs loaded.
+/// @return 0 if the file was loaded successfully, 1 if it is missing, a delta or corrupted.
+int snapfile_restore(HashTable *ht, const char *path, uint64_t *pairs);
+
+#endif  // KVS_SNAPFILE_H
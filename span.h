@@ -0,0 +1,14 @@
+#ifndef KVS_SPAN_H
+#define KVS_SPAN_H
+
+#include <stddef.h>
+
+// A key or value of a batch: its bytes and their length, measured once where the string
+// is read (parser, compiled job, WAL or snapshot record). The bytes are followed by a
+// NUL, so data can also be used as a C string.
+typedef struct Span {
+    const char *data;
+    size_t length;                                                                  // Bytes before the NUL
+} Span;
+
+#endif  // KVS_SPAN_H
@@ -0,0 +1,73 @@
+#!/bin/bash
+
+# Get binary path from command line arguments
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable>"
+    exit
+fi
+kvs_binary=$1
+
+jobs_dir="tests-public/recovery/jobs"
+results_dir="tests-public/recovery/results"
+compact_binary="tools/compact"
+jobc_binary="kvs-jobc"
+failed=0
+
+# Compares an output with the expected result
+check() {
+    local name=$1
+    local output_file=$2
+    local result_file=$3
+
+    if [ -f "$output_file" ] && diff "$output_file" "$result_file"; then
+        echo -e "\e[32mTest passed for $name\e[0m"
+    else
+        echo -e "\e[31mTest failed for $name\e[0m"
+        failed=1
+    fi
+}
+
+# Runs a single job in a directory of its own, with extra options
+run_job() {
+    local job=$1
+    local dir=$2
+    shift 2
+
+    mkdir -p "$dir"
+    cp "$jobs_dir/$job.job" "$dir"
+    "./$kvs_binary" "$dir" 1 1 "$dir/fifo" "$@" &> /dev/null
+}
+
+temp_dir=$(mktemp -d)
+
+# WAL: replayed at startup, and a torn record at its end is cut off
+run_job wal "$temp_dir/wal" --wal "$temp_dir/wal.log"
+cp "$temp_dir/wal.log" "$temp_dir/torn.log"
+run_job show "$temp_dir/wal-show" --wal "$temp_dir/wal.log"
+check wal "$temp_dir/wal-show/show.out" "$results_dir/wal.result"
+truncate -s -5 "$temp_dir/torn.log"                                               # Part of the last WRITE is lost
+run_job show "$temp_dir/torn-show" --wal "$temp_dir/torn.log"
+check wal-torn "$temp_dir/torn-show/show.out" "$results_dir/wal-torn.result"
+
+# Binary backup: restored as it was when BACKUP ran
+run_job backup "$temp_dir/backup" --binary-backups
+run_job show "$temp_dir/backup-show" --restore "$temp_dir/backup/backup-1.bck"
+check backup "$temp_dir/backup-show/show.out" "$results_dir/backup.result"
+
+# Delta backups: a full backup and a delta compacted into one snapshot
+run_job delta "$temp_dir/delta" --delta-backups
+"./$compact_binary" "$temp_dir/delta.bck" "$temp_dir/delta/delta-1.bck" "$temp_dir/delta/delta-2.bck" &> /dev/null
+run_job show "$temp_dir/delta-show" --restore "$temp_dir/delta.bck"
+check delta "$temp_dir/delta-show/show.out" "$results_dir/delta.result"
+
+# Compiled jobs: same output as the text jobs of exercise 1
+for file in tests-public/jobs/*.job; do
+    filename=$(basename "$file" .job)
+    mkdir -p "$temp_dir/jobc-$filename"
+    "./$jobc_binary" "$file" "$temp_dir/jobc-$filename/$filename.jobc" &> /dev/null
+    "./$kvs_binary" "$temp_dir/jobc-$filename" 1 1 "$temp_dir/fifo" &> /dev/null
+    check "$filename.jobc" "$temp_dir/jobc-$filename/$filename.out" "tests-public/results/$filename.result"
+done
+
+rm -rf "$temp_dir"
+exit $failed
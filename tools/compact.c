@@ -0,0 +1,116 @@
+/**
+ * Merges a full binary backup and the delta backups taken after it into one full
+ * snapshot, which can then be loaded with --restore.
+ * Usage: tools/compact <output> <full.bck> [<delta.bck>...]
+ * The deltas must be given in the order they were taken (<job>-2.bck, <job>-3.bck, ...).
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "snapfile.h"
+
+// One of the merged files, with its next entry.
+typedef struct Input {
+    SnapFile file;
+    SnapCursor cursor;
+    SnapEntry entry;
+    int done;                                                                       // No entry left
+} Input;
+
+// Reads the next entry of an input. Returns 0 on success, 1 if the file is corrupted.
+static int advance(Input *input) {
+    int result = snapfile_next(&input->cursor, &input->entry);
+    input->done = result != 1;
+    return result < 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output> <full.bck> [<delta.bck>...]\n", argv[0]);
+        return 1;
+    }
+    int num_inputs = argc - 2;
+    Input *inputs = calloc((size_t)num_inputs, sizeof(Input));
+    if (inputs == NULL) {
+        return 1;
+    }
+
+    int opened = 0;
+    int failed = 0;
+    for (; opened < num_inputs && !failed; opened++) {
+        Input *input = &inputs[opened];
+        const char *path = argv[opened + 2];
+        if (snapfile_open(path, &input->file) != 0) {
+            failed = 1;
+            break;
+        }
+        if ((opened == 0) != !(input->file.flags & SNAPFILE_DELTA)) {               // One full file, then deltas
+            fprintf(stderr, "%s must be a %s backup\n", path, opened == 0 ? "full" : "delta");
+            failed = 1;
+        } else if (input->file.blocks == 0) {
+            input->done = 1;
+        } else if (snapfile_seek(&input->file, SNAPFILE_HEADER_SIZE, input->file.blocks - 1, &input->cursor) != 0 ||
+                   advance(input) != 0) {
+            fprintf(stderr, "Snapshot %s is corrupted\n", path);
+            failed = 1;
+        }
+    }
+
+    int fd = -1;
+    SnapWriter *writer = NULL;
+    if (!failed) {
+        fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        writer = fd != -1 ? snapfile_create(fd, 0) : NULL;
+        if (writer == NULL) {
+            perror("Failed to create output");
+            failed = 1;
+        }
+    }
+
+    unsigned long pairs = 0;
+    while (!failed) {                                                               // Merge the sorted files, the last one wins
+        int newest = -1;
+        for (int i = 0; i < num_inputs; i++) {
+            if (!inputs[i].done && (newest == -1 || strcmp(inputs[i].entry.key, inputs[newest].entry.key) <= 0)) {
+                newest = i;
+            }
+        }
+        if (newest == -1) {
+            break;
+        }
+        if (!inputs[newest].entry.deleted) {
+            snapfile_append(writer, inputs[newest].entry.key, inputs[newest].entry.value);
+            pairs++;
+        }
+        char key[MAX_STRING_SIZE];
+        strcpy(key, inputs[newest].entry.key);
+        for (int i = 0; i < num_inputs && !failed; i++) {
+            if (!inputs[i].done && strcmp(inputs[i].entry.key, key) == 0 && advance(&inputs[i]) != 0) {
+                fprintf(stderr, "Snapshot %s is corrupted\n", argv[i + 2]);
+                failed = 1;
+            }
+        }
+    }
+
+    if (writer != NULL && snapfile_finish(writer) != 0) {
+        fprintf(stderr, "Failed to write %s\n", argv[1]);
+        failed = 1;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    for (int i = 0; i < opened; i++) {
+        snapfile_close(&inputs[i].file);
+    }
+    free(inputs);
+    if (failed) {
+        return 1;
+    }
+    printf("Compacted %lu pairs into %s\n", pairs, argv[1]);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Compiles a text job into the binary job format (see jobc.h). The server runs a
+ * .jobc straight from the mapped file, with the same output as the text job, so
+ * jobs replayed many times are parsed only once.
+ * Usage: kvs-jobc <input.job> [<output.jobc>]
+ * The output defaults to the input path with the .jobc extension.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "jobc.h"
+#include "reader.h"
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <input.job> [<output.jobc>]\n", argv[0]);
+        return 1;
+    }
+    char output[MAX_JOB_FILE_NAME_SIZE];
+    if (argc == 3) {
+        snprintf(output, sizeof(output), "%s", argv[2]);
+    } else if ((size_t)snprintf(output, sizeof(output), "%.*s.jobc", (int)job_name_length(argv[1]), argv[1]) >=
+               sizeof(output)) {
+        fprintf(stderr, "Output path is too long\n");
+        return 1;
+    }
+    if (jobc_is_compiled(argv[1])) {
+        fprintf(stderr, "%s is already compiled\n", argv[1]);
+        return 1;
+    }
+
+    int in_fd = open(argv[1], O_RDONLY);
+    if (in_fd == -1) {
+        perror("Failed to open job");
+        return 1;
+    }
+    int out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1) {
+        perror("Failed to create output");
+        close(in_fd);
+        return 1;
+    }
+    Reader *reader = malloc(sizeof(Reader));
+    uint64_t commands = 0;
+    int failed = reader == NULL;
+    if (!failed) {
+        reader_init(reader, in_fd);
+        failed = jobc_compile(reader, out_fd, &commands);
+    }
+    free(reader);
+    close(in_fd);
+    if (close(out_fd) != 0 || failed) {
+        fprintf(stderr, "Failed to write %s\n", output);
+        unlink(output);
+        return 1;
+    }
+    printf("Compiled %lu commands into %s\n", (unsigned long)commands, output);
+    return 0;
+}
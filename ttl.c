@@ -0,0 +1,188 @@
+#include "ttl.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define WHEEL_SLOTS (1u << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+typedef struct TimerEntry {
+    struct TimerEntry *next;                                                        // Next entry of the slot (or of the due list)
+    uint64_t expires_at;                                                            // Deadline given to the key
+    uint64_t tick;                                                                  // First tick at or after the deadline
+    size_t key_length;
+    char key[MAX_STRING_SIZE + 1];
+} TimerEntry;
+
+typedef struct TimingWheel {
+    TimerEntry *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t base;                                                                  // Next tick to process
+    size_t size;                                                                    // Entries in the wheel
+} TimingWheel;
+
+static TimingWheel wheel;
+static HashTable *ttl_table = NULL;
+static pthread_t ttl_thread;
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_cond = PTHREAD_COND_INITIALIZER;                       // Signaled when the wheel stops being empty
+static int running = 0;
+static int stopping = 0;
+
+// Places an entry in the slot of its tick, in the lowest level that reaches it.
+// Must be called with wheel_mutex held.
+static void wheel_insert(TimerEntry *entry) {
+    uint64_t tick = entry->tick < wheel.base ? wheel.base : entry->tick;           // Overdue entries go to the next tick processed
+    uint64_t delta = tick - wheel.base;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    if (delta >> (WHEEL_BITS * WHEEL_LEVELS) != 0) {                                // Beyond the wheel: parked in the farthest slot,
+        tick = wheel.base + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;      // inserted again when it is cascaded
+    }
+    TimerEntry **slot = &wheel.slots[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    entry->next = *slot;
+    *slot = entry;
+}
+
+// Moves the entries of the current slot of a level to the levels below.
+// Returns the index of that slot. Must be called with wheel_mutex held.
+static size_t cascade(int level) {
+    size_t index = (size_t)(wheel.base >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    TimerEntry *entry = wheel.slots[level][index];
+    wheel.slots[level][index] = NULL;
+    while (entry != NULL) {
+        TimerEntry *next = entry->next;
+        wheel_insert(entry);
+        entry = next;
+    }
+    return index;
+}
+
+// Processes every tick up to now_tick, moving the entries that are due to *due.
+// Must be called with wheel_mutex held.
+static void wheel_advance(uint64_t now_tick, TimerEntry **due) {
+    while (wheel.base <= now_tick && wheel.size > 0) {
+        size_t index = (size_t)wheel.base & WHEEL_MASK;
+        if (index == 0) {                                                           // Level 0 wrapped around, refill it
+            for (int level = 1; level < WHEEL_LEVELS && cascade(level) == 0; level++);
+        }
+        TimerEntry *entry = wheel.slots[0][index];
+        wheel.slots[0][index] = NULL;
+        while (entry != NULL) {
+            TimerEntry *next = entry->next;
+            entry->next = *due;
+            *due = entry;
+            wheel.size--;
+            entry = next;
+        }
+        wheel.base++;
+    }
+}
+
+// Reclaims the keys of a due list, TTL_REAP_BATCH at a time, and frees the entries.
+static void reap(TimerEntry *due) {
+    while (due != NULL) {
+        Span keys[TTL_REAP_BATCH];
+        uint64_t expires_at[TTL_REAP_BATCH];
+        TimerEntry *batch = due;
+        size_t n = 0;
+        for (; due != NULL && n < TTL_REAP_BATCH; due = due->next) {
+            keys[n] = (Span){ due->key, due->key_length };
+            expires_at[n++] = due->expires_at;
+        }
+        expire_pairs(ttl_table, n, keys, expires_at);                               // Locks are released between batches
+        while (batch != due) {
+            TimerEntry *next = batch->next;
+            free(batch);
+            batch = next;
+        }
+    }
+}
+
+static void *ttl_thread_main(void *arg) {
+    (void)arg;
+    struct timespec tick = { 0, WHEEL_TICK_MS * 1000000L };
+
+    pthread_mutex_lock(&wheel_mutex);
+    while (!stopping) {
+        if (wheel.size == 0) {                                                      // Nothing scheduled, no need to tick
+            pthread_cond_wait(&wheel_cond, &wheel_mutex);
+            continue;
+        }
+        TimerEntry *due = NULL;
+        wheel_advance(monotonic_ms() / WHEEL_TICK_MS, &due);
+        pthread_mutex_unlock(&wheel_mutex);
+
+        reap(due);                                                                  // Writers can schedule meanwhile
+        nanosleep(&tick, NULL);
+
+        pthread_mutex_lock(&wheel_mutex);
+    }
+    pthread_mutex_unlock(&wheel_mutex);
+    return NULL;
+}
+
+int ttl_start(HashTable *ht) {
+    memset(&wheel, 0, sizeof(wheel));
+    wheel.base = monotonic_ms() / WHEEL_TICK_MS;
+    ttl_table = ht;
+    stopping = 0;
+    if (pthread_create(&ttl_thread, NULL, ttl_thread_main, NULL) != 0) {
+        return 1;
+    }
+    running = 1;
+    return 0;
+}
+
+void ttl_stop(void) {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&wheel_mutex);
+    stopping = 1;
+    pthread_cond_signal(&wheel_cond);
+    pthread_mutex_unlock(&wheel_mutex);
+    pthread_join(ttl_thread, NULL);
+    running = 0;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {                            // The pairs go away with the table
+        for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+            TimerEntry *entry = wheel.slots[level][i];
+            while (entry != NULL) {
+                TimerEntry *next = entry->next;
+                free(entry);
+                entry = next;
+            }
+            wheel.slots[level][i] = NULL;
+        }
+    }
+    wheel.size = 0;
+    ttl_table = NULL;
+}
+
+int ttl_schedule(const Span *key, uint64_t expires_at) {
+    if (key->length > MAX_STRING_SIZE) {
+        return 1;
+    }
+    TimerEntry *entry = malloc(sizeof(TimerEntry));
+    if (entry == NULL) {
+        return 1;
+    }
+    memcpy(entry->key, key->data, key->length + 1);
+    entry->key_length = key->length;
+    entry->expires_at = expires_at;
+    entry->tick = (expires_at + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+
+    pthread_mutex_lock(&wheel_mutex);
+    if (wheel.size == 0) {                                                          // The thread stopped ticking, catch up at once
+        wheel.base = monotonic_ms() / WHEEL_TICK_MS;
+        pthread_cond_signal(&wheel_cond);
+    }
+    wheel_insert(entry);
+    wheel.size++;
+    pthread_mutex_unlock(&wheel_mutex);
+    return 0;
+}
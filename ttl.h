@@ -0,0 +1,35 @@
+#ifndef KVS_TTL_H
+#define KVS_TTL_H
+
+#include <stdint.h>
+#include "constants.h"
+#include "kvs.h"
+
+#define WHEEL_LEVELS 4                                                              // Levels of the timing wheel
+#define WHEEL_BITS 6                                                                // Each level has 1 << WHEEL_BITS slots
+#define WHEEL_TICK_MS 10                                                            // Resolution of the wheel
+#define TTL_REAP_BATCH 64                                                           // Expired keys reclaimed under one set of locks
+
+// Deadlines are kept in a hierarchical timing wheel: level 0 has one slot per tick,
+// level l one slot per 64^l ticks, and a slot of level l is cascaded down when level
+// l - 1 wraps around. Scheduling and advancing one tick are O(1); the table itself is
+// never scanned. A background thread advances the wheel and hands the keys whose
+// deadline passed to expire_pairs, TTL_REAP_BATCH at a time, so a burst of expiries
+// never holds the bucket locks for long. Until then, expired pairs are already
+// invisible to reads (see write_pairs_ttl).
+
+/// Starts the expiry thread.
+/// @param ht Hash table whose expired pairs are reclaimed.
+/// @return 0 if the thread was started successfully, 1 otherwise.
+int ttl_start(HashTable *ht);
+
+/// Stops the expiry thread and drops the deadlines still scheduled.
+void ttl_stop(void);
+
+/// Schedules the reclaiming of a key once its deadline passes.
+/// @param key Key written with a TTL.
+/// @param expires_at Deadline given to the key (monotonic_ms).
+/// @return 0 if the deadline was scheduled successfully, 1 otherwise.
+int ttl_schedule(const Span *key, uint64_t expires_at);
+
+#endif  // KVS_TTL_H
@@ -0,0 +1,408 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "ttl.h"
+
+#define WAL_WRITE 1
+#define WAL_DELETE 2
+#define WAL_MAX_ENTRIES UINT16_MAX                                                  // Entries of a record (count:u16), larger batches take several
+
+typedef struct WalRecord {
+    struct WalRecord *next;                                                         // Older record of the stack
+    size_t length;                                                                  // Bytes of data (header included)
+    uint8_t data[];
+} WalRecord;
+
+static WalRecord *pending = NULL;                                                   // Lock-free stack, newest first
+static sem_t wake;                                                                  // Posted when pending stops being empty
+static int wal_fd = -1;
+static enum WalSync wal_policy;
+static unsigned int wal_interval_ms;
+static uint64_t monotonic_base;                                                     // Clocks when the WAL was opened, to turn
+static uint64_t realtime_base;                                                      // deadlines into wall-clock time
+static HashTable *wal_table = NULL;
+static TableJournal journal;
+static pthread_t writer_thread;
+static int stopping = 0;
+static int lost = 0;                                                                // A record could not be made or written
+
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_durable = PTHREAD_COND_INITIALIZER;                      // Signaled after each group commit
+static uint64_t generation = 0;                                                     // Group commits done (wal_mutex)
+static uint64_t wanted = 0;                                                         // Generation a wal_sync waits for (wal_mutex)
+
+static uint64_t realtime_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+// Reports, once, that changes are no longer all logged.
+static void record_lost(void) {
+    if (!__atomic_exchange_n(&lost, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "WAL: failed to log some changes, they would be lost in a crash\n");
+    }
+}
+
+static WalRecord *new_record(size_t payload) {
+    WalRecord *record = malloc(sizeof(WalRecord) + WAL_RECORD_HEADER_SIZE + payload);
+    if (record == NULL) {
+        record_lost();
+        return NULL;
+    }
+    record->length = WAL_RECORD_HEADER_SIZE + payload;
+    return record;
+}
+
+// Seals a record and pushes it for the writer thread. Never blocks.
+static void push_record(WalRecord *record) {
+    size_t payload = record->length - WAL_RECORD_HEADER_SIZE;
+    put_u32(record->data, (uint32_t)payload);
+    put_u32(record->data + 4, crc32c(record->data + WAL_RECORD_HEADER_SIZE, payload));
+
+    WalRecord *head = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+    do {
+        record->next = head;
+    } while (!__atomic_compare_exchange_n(&pending, &head, record, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (head == NULL) {                                                             // The writer may be asleep
+        sem_post(&wake);
+    }
+}
+
+// Logs up to WAL_MAX_ENTRIES pairs of a write batch as one record.
+static void log_write(size_t num_pairs, const Span *keys, const Span *values, const uint64_t *expires_at) {
+    size_t payload = 3;
+    for (size_t i = 0; i < num_pairs; i++) {
+        payload += 12 + keys[i].length + values[i].length;
+    }
+    WalRecord *record = new_record(payload);
+    if (record == NULL) {
+        return;
+    }
+    uint8_t *p = record->data + WAL_RECORD_HEADER_SIZE;
+    *p++ = WAL_WRITE;
+    put_u16(p, (uint16_t)num_pairs);
+    p += 2;
+    for (size_t i = 0; i < num_pairs; i++) {
+        uint64_t deadline = expires_at != NULL && expires_at[i] != 0 ? expires_at[i] - monotonic_base + realtime_base : 0;
+        put_u16(p, (uint16_t)keys[i].length);
+        put_u16(p + 2, (uint16_t)values[i].length);
+        put_u64(p + 4, deadline);
+        memcpy(p + 12, keys[i].data, keys[i].length);
+        memcpy(p + 12 + keys[i].length, values[i].data, values[i].length);
+        p += 12 + keys[i].length + values[i].length;
+    }
+    push_record(record);
+}
+
+// Logs up to WAL_MAX_ENTRIES keys of a delete batch as one record.
+static void log_remove(size_t num_pairs, const Span *keys) {
+    size_t payload = 3;
+    for (size_t i = 0; i < num_pairs; i++) {
+        payload += 2 + keys[i].length;
+    }
+    WalRecord *record = new_record(payload);
+    if (record == NULL) {
+        return;
+    }
+    uint8_t *p = record->data + WAL_RECORD_HEADER_SIZE;
+    *p++ = WAL_DELETE;
+    put_u16(p, (uint16_t)num_pairs);
+    p += 2;
+    for (size_t i = 0; i < num_pairs; i++) {
+        put_u16(p, (uint16_t)keys[i].length);
+        memcpy(p + 2, keys[i].data, keys[i].length);
+        p += 2 + keys[i].length;
+    }
+    push_record(record);
+}
+
+static void journal_write(void *arg, size_t num_pairs, const Span *keys, const Span *values,
+                          const uint64_t *expires_at) {
+    (void)arg;
+    for (size_t i = 0; i < num_pairs; i += WAL_MAX_ENTRIES) {
+        size_t count = num_pairs - i < WAL_MAX_ENTRIES ? num_pairs - i : WAL_MAX_ENTRIES;
+        log_write(count, keys + i, values + i, expires_at != NULL ? expires_at + i : NULL);
+    }
+}
+
+static void journal_remove(void *arg, size_t num_pairs, const Span *keys) {
+    (void)arg;
+    for (size_t i = 0; i < num_pairs; i += WAL_MAX_ENTRIES) {
+        log_remove(num_pairs - i < WAL_MAX_ENTRIES ? num_pairs - i : WAL_MAX_ENTRIES, keys + i);
+    }
+}
+
+// Sleeps until records are pushed, a wal_sync asks for a commit, or (with unsynced
+// data under WAL_SYNC_INTERVAL) until the sync is due.
+static void wait_for_work(uint64_t sync_due) {
+    if (sync_due == 0) {
+        while (sem_wait(&wake) != 0 && errno == EINTR);
+        return;
+    }
+    uint64_t now = monotonic_ms();
+    if (now >= sync_due) {
+        return;
+    }
+    uint64_t deadline = realtime_ms() + (sync_due - now);
+    struct timespec until = { (time_t)(deadline / 1000), (long)(deadline % 1000) * 1000000 };
+    while (sem_timedwait(&wake, &until) != 0 && errno == EINTR);
+}
+
+// Takes every pushed record, oldest first, into buffer. Returns the number of bytes.
+static size_t take_records(uint8_t **buffer, size_t *capacity) {
+    WalRecord *record = __atomic_exchange_n(&pending, NULL, __ATOMIC_ACQUIRE);
+    WalRecord *oldest = NULL;
+    size_t length = 0;
+    while (record != NULL) {                                                        // Reverse the stack
+        WalRecord *next = record->next;
+        record->next = oldest;
+        oldest = record;
+        length += record->length;
+        record = next;
+    }
+    if (length > *capacity) {
+        uint8_t *grown = realloc(*buffer, length);
+        if (grown == NULL) {
+            record_lost();
+            length = 0;
+        } else {
+            *buffer = grown;
+            *capacity = length;
+        }
+    }
+    size_t offset = 0;
+    while (oldest != NULL) {
+        WalRecord *next = oldest->next;
+        if (length > 0) {
+            memcpy(*buffer + offset, oldest->data, oldest->length);
+            offset += oldest->length;
+        }
+        free(oldest);
+        oldest = next;
+    }
+    return offset;
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    uint8_t *buffer = NULL;
+    size_t capacity = 0;
+    uint64_t sync_due = 0;                                                          // When unsynced data must be synced, 0 if none
+
+    for (;;) {
+        wait_for_work(wal_policy == WAL_SYNC_INTERVAL ? sync_due : 0);
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+        size_t length = take_records(&buffer, &capacity);
+        if (length > 0) {
+            if (write_all(wal_fd, buffer, length) != 0) {                           // One write for the whole group
+                record_lost();
+            }
+            if (sync_due == 0) {
+                sync_due = monotonic_ms() + wal_interval_ms;
+            }
+        }
+        if (sync_due != 0 && (wal_policy == WAL_SYNC_ALWAYS || stop ||
+                              (wal_policy == WAL_SYNC_INTERVAL && monotonic_ms() >= sync_due))) {
+            fdatasync(wal_fd);
+            sync_due = 0;
+        }
+
+        pthread_mutex_lock(&wal_mutex);
+        generation++;
+        pthread_cond_broadcast(&wal_durable);
+        if (generation < wanted) {                                                  // A wal_sync needs one more commit
+            sem_post(&wake);
+        }
+        pthread_mutex_unlock(&wal_mutex);
+
+        if (stop && __atomic_load_n(&pending, __ATOMIC_ACQUIRE) == NULL) {
+            break;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static void ignore_missing(const char *key, void *arg) {
+    (void)key;
+    (void)arg;
+}
+
+// Applies one record. Returns 0 on success, 1 if it is malformed.
+static int replay_record(HashTable *ht, const uint8_t *p, size_t length) {
+    if (length < 3) {
+        return 1;
+    }
+    const uint8_t *end = p + length;
+    uint8_t op = p[0];
+    size_t count = get_u16(p + 1);
+    p += 3;
+
+    char (*strings)[2][MAX_STRING_SIZE] = malloc((count + 1) * sizeof(*strings));    // Key and value of each entry
+    Span *keys = malloc((count + 1) * sizeof(*keys));
+    Span *values = malloc((count + 1) * sizeof(*values));
+    uint64_t *expires_at = malloc((count + 1) * sizeof(uint64_t));
+    int failed = strings == NULL || keys == NULL || values == NULL || expires_at == NULL ||
+                 (op != WAL_WRITE && op != WAL_DELETE);
+    int has_deadline = 0;
+    uint64_t now_monotonic = monotonic_ms();
+    uint64_t now_realtime = realtime_ms();
+
+    for (size_t i = 0; i < count && !failed; i++) {
+        size_t header = op == WAL_WRITE ? 12 : 2;
+        if ((size_t)(end - p) < header) {
+            failed = 1;
+            break;
+        }
+        size_t key_length = get_u16(p);
+        size_t value_length = op == WAL_WRITE ? get_u16(p + 2) : 0;
+        if (key_length >= MAX_STRING_SIZE || value_length >= MAX_STRING_SIZE ||
+            (size_t)(end - p) < header + key_length + value_length) {
+            failed = 1;
+            break;
+        }
+        memcpy(strings[i][0], p + header, key_length);
+        strings[i][0][key_length] = '\0';
+        keys[i] = (Span){ strings[i][0], key_length };
+        if (op == WAL_WRITE) {
+            uint64_t deadline = get_u64(p + 4);
+            memcpy(strings[i][1], p + header + key_length, value_length);
+            strings[i][1][value_length] = '\0';
+            values[i] = (Span){ strings[i][1], value_length };
+            if (deadline == 0) {
+                expires_at[i] = 0;
+            } else {                                                                // Already past: invisible at once, like before
+                expires_at[i] = deadline > now_realtime ? now_monotonic + (deadline - now_realtime) : 1;
+                has_deadline = 1;
+            }
+        }
+        p += header + key_length + value_length;
+    }
+
+    if (!failed && op == WAL_WRITE) {
+        write_pairs_ttl(ht, count, keys, values, has_deadline ? expires_at : NULL);
+        for (size_t i = 0; i < count && has_deadline; i++) {
+            if (expires_at[i] != 0) {
+                ttl_schedule(&keys[i], expires_at[i]);
+            }
+        }
+    } else if (!failed) {
+        delete_pairs(ht, count, keys, ignore_missing, NULL);
+    }
+    free(strings);
+    free(keys);
+    free(values);
+    free(expires_at);
+    return failed;
+}
+
+// Replays the records of the WAL. Returns the offset where the valid records end.
+static off_t replay(HashTable *ht, int fd, unsigned long *replayed) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+
+    size_t offset = 0;
+    while (size - offset >= WAL_RECORD_HEADER_SIZE) {
+        const uint8_t *record = map + offset;
+        size_t length = get_u32(record);
+        const uint8_t *payload = record + WAL_RECORD_HEADER_SIZE;
+        if (size - offset - WAL_RECORD_HEADER_SIZE < length || crc32c(payload, length) != get_u32(record + 4) ||
+            replay_record(ht, payload, length) != 0) {
+            break;                                                                  // Torn by a crash: the log ends here
+        }
+        offset += WAL_RECORD_HEADER_SIZE + length;
+        (*replayed)++;
+    }
+    munmap(map, size);
+    return (off_t)offset;
+}
+
+int wal_start(HashTable *ht, const char *path, enum WalSync sync, unsigned int interval_ms, unsigned long *replayed) {
+    *replayed = 0;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Failed to open WAL");
+        return 1;
+    }
+    off_t end = replay(ht, fd, replayed);
+    if (end < 0 || ftruncate(fd, end) != 0 || lseek(fd, end, SEEK_SET) != end) {   // Drops a torn record, appends after the rest
+        perror("Failed to replay WAL");
+        close(fd);
+        return 1;
+    }
+
+    wal_fd = fd;
+    wal_policy = sync;
+    wal_interval_ms = interval_ms;
+    monotonic_base = monotonic_ms();
+    realtime_base = realtime_ms();
+    stopping = 0;
+    generation = 0;
+    wanted = 0;
+    if (sem_init(&wake, 0, 0) != 0 || pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        close(fd);
+        wal_fd = -1;
+        return 1;
+    }
+    wal_table = ht;
+    journal = (TableJournal){ journal_write, journal_remove, NULL };
+    set_table_journal(ht, &journal);                                                // Replayed changes are not logged again
+    return 0;
+}
+
+void wal_stop(void) {
+    if (wal_table == NULL) {
+        return;
+    }
+    set_table_journal(wal_table, NULL);
+    wal_table = NULL;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&wake);
+    pthread_join(writer_thread, NULL);                                              // Writes and syncs what is left
+    sem_destroy(&wake);
+    close(wal_fd);
+    wal_fd = -1;
+}
+
+void wal_sync(void) {
+    if (wal_table == NULL || wal_policy != WAL_SYNC_ALWAYS) {
+        return;
+    }
+    // The records pushed before this call are either in the group being written now,
+    // which ends the next commit, or still pushed, taken by the commit after it
+    pthread_mutex_lock(&wal_mutex);
+    uint64_t target = generation + 2;
+    if (target > wanted) {
+        wanted = target;
+    }
+    pthread_mutex_unlock(&wal_mutex);
+    sem_post(&wake);
+
+    pthread_mutex_lock(&wal_mutex);
+    while (generation < target) {
+        pthread_cond_wait(&wal_durable, &wal_mutex);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
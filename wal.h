@@ -0,0 +1,46 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include "constants.h"
+#include "kvs.h"
+
+#define WAL_RECORD_HEADER_SIZE 8                                                    // length:u32 crc:u32
+#define WAL_DEFAULT_INTERVAL_MS 100                                                 // fsync period of WAL_SYNC_INTERVAL
+
+// When the WAL is flushed to disk.
+enum WalSync {
+    WAL_SYNC_ALWAYS,                                                                // Before WRITE/DELETE return
+    WAL_SYNC_INTERVAL,                                                              // At most interval_ms after a change
+    WAL_SYNC_NONE                                                                   // Left to the kernel
+};
+
+// Every WRITE, WRITE_TTL and DELETE batch is appended to the WAL as one record (one
+// per 65535 entries of a larger batch):
+//   length:u32 crc:u32 (CRC-32C of the payload), then a payload of
+//   op:u8 count:u16 and count entries
+//   write   key_length:u16 value_length:u16 deadline:u64 key value
+//   delete  key_length:u16 key
+// Deadlines are wall-clock milliseconds (0 for none), so they survive a restart.
+// Records are made by the threads that apply the batches, while they still hold
+// the batch's locks, and pushed onto a lock-free stack with a single CAS. One writer
+// thread takes the whole stack at a time and writes it with one write() (a group
+// commit), then syncs it as the policy says. At startup the WAL is replayed on top of
+// the restored snapshot; a torn record at the end (a crash during a write) is cut off.
+
+/// Replays a WAL into the table, then starts logging every change to it.
+/// @param ht Hash table to replay into and to watch.
+/// @param path WAL file, created if missing.
+/// @param sync When the WAL is synced to disk.
+/// @param interval_ms Sync period with WAL_SYNC_INTERVAL.
+/// @param replayed Receives the number of records replayed.
+/// @return 0 if the WAL was opened successfully, 1 otherwise.
+int wal_start(HashTable *ht, const char *path, enum WalSync sync, unsigned int interval_ms, unsigned long *replayed);
+
+/// Writes the records still pending, syncs them and closes the WAL.
+void wal_stop(void);
+
+/// With WAL_SYNC_ALWAYS, waits until every change the calling thread made is on
+/// disk. Returns at once otherwise.
+void wal_sync(void);
+
+#endif  // KVS_WAL_H